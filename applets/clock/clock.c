@@ -10,27 +10,35 @@
  */
 
 #include <config.h>
+#include <errno.h>
 #include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <glib-unix.h>
 #include <gtk/gtk.h>
 #include <matchbox-panel/mb-panel.h>
 
 typedef struct {
         GtkLabel *label;
 
-        guint timeout_id;
+        /* Fires on every minute, or when the clock is set */
+        int timer_fd;
+        guint source_id;
 } ClockApplet;
 
 static void
 clock_applet_free (ClockApplet *applet)
 {
-        g_source_remove (applet->timeout_id);
+        g_source_remove (applet->source_id);
+
+        if (applet->timer_fd != -1)
+                close (applet->timer_fd);
 
         g_slice_free (ClockApplet, applet);
 }
 
-/* Called every minute */
-static gboolean
-timeout (ClockApplet *applet)
+static void
+update (ClockApplet *applet)
 {
         time_t t;
         char str[6], *markup;
@@ -43,23 +51,62 @@ timeout (ClockApplet *applet)
         gtk_label_set_markup (applet->label, markup);
 
         g_free (markup);
+}
+
+/* Without a timer, wake up on the next minute */
+static gboolean
+timeout (ClockApplet *applet)
+{
+        update (applet);
+
+        applet->source_id = g_timeout_add_seconds (60 - time (NULL) % 60,
+                                                   (GSourceFunc) timeout,
+                                                   applet);
+
+        return FALSE;
+}
+
+/* Arm the timer for the start of the next minute. Time zones are whole
+ * minutes off UTC, so this is the next local minute too. The timer is
+ * cancelled if the clock is set, after suspend or an NTP step. */
+static gboolean
+arm_timer (ClockApplet *applet)
+{
+        struct itimerspec spec = { { 0, 0 }, { 0, 0 } };
+        struct timespec now;
+
+        clock_gettime (CLOCK_REALTIME, &now);
+        spec.it_value.tv_sec = (now.tv_sec / 60 + 1) * 60;
+
+        if (timerfd_settime (applet->timer_fd,
+                             TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                             &spec, NULL) == -1) {
+                g_warning ("Cannot set clock timer: %s", g_strerror (errno));
+                return FALSE;
+        }
 
-        /* Keep going */
         return TRUE;
 }
 
-/* Called on the next minute after applet creation */
+/* Called on every minute, and when the clock was set */
 static gboolean
-initial_timeout (ClockApplet *applet)
+timer_cb (int fd, GIOCondition condition, ClockApplet *applet)
 {
-        timeout (applet);
+        guint64 expirations;
+
+        /* Fails with ECANCELED if the clock was set, which is another
+         * reason to update */
+        if (read (fd, &expirations, sizeof (expirations)) == -1 &&
+            errno == EAGAIN)
+                return TRUE;
 
-        /* Install a new timeout that is called every minute */
-        applet->timeout_id = g_timeout_add_seconds (60,
-                                                    (GSourceFunc) timeout,
-                                                    applet);
+        update (applet);
+
+        if (arm_timer (applet))
+                return TRUE;
+
+        timeout (applet);
 
-        /* Don't call this again */
         return FALSE;
 }
 
@@ -69,8 +116,6 @@ mb_panel_applet_create (const char    *id,
 {
         ClockApplet *applet;
         GtkWidget *label;
-        time_t t;
-        struct tm *local_time;
 
         applet = g_slice_new0 (ClockApplet);
 
@@ -87,15 +132,20 @@ mb_panel_applet_create (const char    *id,
                 gtk_label_set_angle (GTK_LABEL (label), 90.0);
         }
 
-        /* Set up a timeout to be called when we hit the next minute */
-        t = time (NULL);
-        local_time = localtime (&t);
-
-        applet->timeout_id = g_timeout_add_seconds (60 - local_time->tm_sec,
-                                                    (GSourceFunc) initial_timeout,
-                                                    applet);
-
-        timeout (applet);
+        update (applet);
+
+        applet->timer_fd = timerfd_create (CLOCK_REALTIME,
+                                           TFD_NONBLOCK | TFD_CLOEXEC);
+        if (applet->timer_fd != -1 && arm_timer (applet)) {
+                applet->source_id = g_unix_fd_add (applet->timer_fd, G_IO_IN,
+                                                   (GUnixFDSourceFunc) timer_cb,
+                                                   applet);
+        } else {
+                if (applet->timer_fd == -1)
+                        g_warning ("Cannot create clock timer: %s",
+                                   g_strerror (errno));
+                timeout (applet);
+        }
 
         gtk_widget_show (label);
 
@@ -0,0 +1,359 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+
+/*
+ * Licensed under the GPL v2 or greater.
+ *
+ * launcher-group: a button opening a menu of desktop entries, either those
+ * of a category or an explicit list. The menu is only built when it is
+ * opened, its icons are only loaded when GTK+ draws them, and it is thrown
+ * away, icons and all, once it has been closed for a while or when the
+ * desktop entries change.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gtk/gtk.h>
+#include <matchbox-panel/mb-panel.h>
+#include <matchbox-panel/mb-panel-scaling-image2.h>
+
+/* How long a closed menu is kept, in seconds */
+#define DROP_TIMEOUT 30
+
+#define DEFAULT_ICON "applications-other"
+
+typedef struct {
+        GtkWidget *button;
+
+        char *category;
+        char **ids;
+        int columns;
+
+        GtkWidget *menu;
+        guint drop_id;
+        /* The entries changed while the menu was open */
+        gboolean stale;
+
+        guint monitor_id;
+} GroupApplet;
+
+static void
+group_applet_free (GroupApplet *applet)
+{
+        mb_panel_desktop_remove_monitor (applet->monitor_id);
+
+        if (applet->drop_id)
+                g_source_remove (applet->drop_id);
+        if (applet->menu)
+                gtk_widget_destroy (applet->menu);
+
+        g_free (applet->category);
+        g_strfreev (applet->ids);
+
+        g_slice_free (GroupApplet, applet);
+}
+
+static gboolean
+in_category (const MBPanelDesktopEntry *entry, const char *category)
+{
+        char **categories;
+        gboolean found = FALSE;
+        int i;
+
+        if (entry->categories == NULL)
+                return FALSE;
+
+        categories = g_strsplit (entry->categories, ";", -1);
+        for (i = 0; categories[i] && !found; i++)
+                found = strcmp (categories[i], category) == 0;
+        g_strfreev (categories);
+
+        return found;
+}
+
+static gint
+compare_names (gconstpointer a, gconstpointer b)
+{
+        const MBPanelDesktopEntry *entry_a = a, *entry_b = b;
+
+        return g_utf8_collate (entry_a->name ? entry_a->name : entry_a->id,
+                               entry_b->name ? entry_b->name : entry_b->id);
+}
+
+/* The entries to show: the explicit list in order, or those of the
+ * category (or all of them) by name */
+static GList *
+get_entries (GroupApplet *applet)
+{
+        const MBPanelDesktopEntry *entries, *entry;
+        GList *list = NULL;
+        guint i, n;
+
+        if (applet->ids) {
+                for (i = 0; applet->ids[i]; i++) {
+                        entry = mb_panel_desktop_entry_lookup (applet->ids[i]);
+                        if (entry && entry->exec)
+                                list = g_list_prepend (list, (gpointer) entry);
+                }
+
+                return g_list_reverse (list);
+        }
+
+        entries = mb_panel_desktop_entry_get_all (&n);
+        for (i = 0; i < n; i++) {
+                entry = &entries[i];
+
+                if (entry->id == NULL || entry->exec == NULL ||
+                    entry->no_display)
+                        continue;
+
+                if (applet->category && !in_category (entry, applet->category))
+                        continue;
+
+                list = g_list_prepend (list, (gpointer) entry);
+        }
+
+        return g_list_sort (list, compare_names);
+}
+
+static void
+item_activate_cb (GtkMenuItem *item, GroupApplet *applet)
+{
+        const MBPanelDesktopEntry *entry;
+        char **argv;
+
+        /* Look the entry up again, the index may have been reloaded */
+        entry = mb_panel_desktop_entry_lookup
+                (g_object_get_data (G_OBJECT (item), "desktop-id"));
+        if (entry == NULL || entry->exec == NULL)
+                return;
+
+        argv = mb_panel_launch_exec_to_argv (entry->exec);
+        if (argv[0])
+                mb_panel_launch (applet->button, entry->id, entry->name,
+                                 argv, entry->startup_notify);
+        g_strfreev (argv);
+}
+
+static GtkWidget *
+create_item (GroupApplet *applet, const MBPanelDesktopEntry *entry)
+{
+        GtkWidget *item, *box, *image, *label;
+        GIcon *icon;
+
+        item = gtk_menu_item_new ();
+        g_object_set_data_full (G_OBJECT (item), "desktop-id",
+                                g_strdup (entry->id), g_free);
+        g_signal_connect (item, "activate",
+                          G_CALLBACK (item_activate_cb), applet);
+
+        box = gtk_box_new (applet->columns ? GTK_ORIENTATION_VERTICAL
+                                           : GTK_ORIENTATION_HORIZONTAL,
+                           6);
+        gtk_container_add (GTK_CONTAINER (item), box);
+
+        /* GTK+ only loads the icon when the item is drawn */
+        if (entry->icon && g_path_is_absolute (entry->icon)) {
+                GFile *file = g_file_new_for_path (entry->icon);
+                icon = g_file_icon_new (file);
+                g_object_unref (file);
+        } else {
+                icon = g_themed_icon_new_with_default_fallbacks
+                        (entry->icon ? entry->icon : DEFAULT_ICON);
+        }
+
+        image = gtk_image_new_from_gicon (icon,
+                                          applet->columns ? GTK_ICON_SIZE_DIALOG
+                                                          : GTK_ICON_SIZE_MENU);
+        g_object_unref (icon);
+        gtk_box_pack_start (GTK_BOX (box), image, FALSE, FALSE, 0);
+
+        label = gtk_label_new (entry->name ? entry->name : entry->id);
+        gtk_box_pack_start (GTK_BOX (box), label, FALSE, FALSE, 0);
+
+        return item;
+}
+
+static void
+build_menu (GroupApplet *applet)
+{
+        GtkWidget *item;
+        GList *entries, *l;
+        int i;
+
+        applet->menu = gtk_menu_new ();
+        gtk_menu_attach_to_widget (GTK_MENU (applet->menu),
+                                   applet->button, NULL);
+
+        entries = get_entries (applet);
+
+        for (l = entries, i = 0; l; l = l->next, i++) {
+                item = create_item (applet, l->data);
+
+                if (applet->columns)
+                        gtk_menu_attach (GTK_MENU (applet->menu), item,
+                                         i % applet->columns,
+                                         i % applet->columns + 1,
+                                         i / applet->columns,
+                                         i / applet->columns + 1);
+                else
+                        gtk_menu_shell_append (GTK_MENU_SHELL (applet->menu),
+                                               item);
+        }
+
+        if (entries == NULL) {
+                item = gtk_menu_item_new_with_label ("No applications");
+                gtk_widget_set_sensitive (item, FALSE);
+                gtk_menu_shell_append (GTK_MENU_SHELL (applet->menu), item);
+        }
+
+        g_list_free (entries);
+
+        gtk_widget_show_all (applet->menu);
+}
+
+static gboolean
+drop_menu (GroupApplet *applet)
+{
+        applet->drop_id = 0;
+        applet->stale = FALSE;
+
+        gtk_widget_destroy (applet->menu);
+        applet->menu = NULL;
+
+        return FALSE;
+}
+
+static void
+selection_done_cb (GtkMenuShell *menu_shell, GroupApplet *applet)
+{
+        gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (applet->button),
+                                      FALSE);
+
+        if (applet->stale) {
+                drop_menu (applet);
+                return;
+        }
+
+        applet->drop_id = g_timeout_add_seconds (DROP_TIMEOUT,
+                                                 (GSourceFunc) drop_menu,
+                                                 applet);
+}
+
+/* The desktop entries changed, the menu is rebuilt when next opened */
+static void
+entries_changed_cb (GroupApplet *applet)
+{
+        if (applet->menu == NULL)
+                return;
+
+        if (gtk_widget_get_visible (applet->menu)) {
+                applet->stale = TRUE;
+                return;
+        }
+
+        if (applet->drop_id) {
+                g_source_remove (applet->drop_id);
+                applet->drop_id = 0;
+        }
+
+        drop_menu (applet);
+}
+
+static void
+position_menu (GtkMenu  *menu,
+               int      *x,
+               int      *y,
+               gboolean *push_in,
+               gpointer  user_data)
+{
+        GroupApplet *applet = user_data;
+        GtkAllocation allocation;
+
+        gdk_window_get_origin (gtk_widget_get_window (applet->button), x, y);
+        gtk_widget_get_allocation (applet->button, &allocation);
+
+        *x += allocation.x;
+        *y += allocation.height;
+        *push_in = TRUE;
+}
+
+static void
+toggled_cb (GtkToggleButton *button, GroupApplet *applet)
+{
+        if (!gtk_toggle_button_get_active (button))
+                return;
+
+        if (applet->drop_id) {
+                g_source_remove (applet->drop_id);
+                applet->drop_id = 0;
+        }
+
+        if (applet->menu == NULL) {
+                build_menu (applet);
+                g_signal_connect (applet->menu, "selection-done",
+                                  G_CALLBACK (selection_done_cb), applet);
+        }
+
+        gtk_menu_popup (GTK_MENU (applet->menu), NULL, NULL,
+                        position_menu, applet,
+                        0, gtk_get_current_event_time ());
+}
+
+G_MODULE_EXPORT GtkWidget *
+mb_panel_applet_create (const char    *id,
+                        GtkOrientation orientation)
+{
+        GroupApplet *applet;
+        GPtrArray *ids;
+        char **options, **option;
+        const char *icon = DEFAULT_ICON;
+
+        applet = g_slice_new0 (GroupApplet);
+        ids = g_ptr_array_new ();
+
+        /* The ID is a ':' separated list of desktop entries, or of options:
+         * "category=NAME" shows a category instead of a list, "columns=N"
+         * lays the entries out in a grid, and "icon=NAME" sets the icon of
+         * the button */
+        options = g_strsplit (id ? id : "", ":", -1);
+        for (option = options; *option; option++) {
+                if (g_str_has_prefix (*option, "category="))
+                        applet->category = g_strdup (*option + strlen ("category="));
+                else if (g_str_has_prefix (*option, "columns="))
+                        applet->columns = MAX (0, atoi (*option + strlen ("columns=")));
+                else if (g_str_has_prefix (*option, "icon="))
+                        icon = *option + strlen ("icon=");
+                else if (**option)
+                        g_ptr_array_add (ids, g_strdup (*option));
+        }
+
+        if (ids->len) {
+                g_ptr_array_add (ids, NULL);
+                applet->ids = (char **) g_ptr_array_free (ids, FALSE);
+        } else {
+                g_ptr_array_free (ids, TRUE);
+        }
+
+        applet->button = gtk_toggle_button_new ();
+        gtk_widget_set_name (applet->button, "MatchboxPanelLauncherGroup");
+        gtk_button_set_relief (GTK_BUTTON (applet->button), GTK_RELIEF_NONE);
+        gtk_container_add (GTK_CONTAINER (applet->button),
+                           mb_panel_scaling_image2_new (orientation, icon));
+
+        g_strfreev (options);
+
+        g_signal_connect (applet->button, "toggled",
+                          G_CALLBACK (toggled_cb), applet);
+
+        applet->monitor_id =
+                mb_panel_desktop_add_monitor ((MBPanelDesktopFunc)
+                                              entries_changed_cb,
+                                              applet);
+        g_object_weak_ref (G_OBJECT (applet->button),
+                           (GWeakNotify) group_applet_free, applet);
+
+        gtk_widget_show_all (applet->button);
+
+        return applet->button;
+}
@@ -7,120 +7,40 @@
  */
 
 #include <config.h>
-#include <unistd.h>
 #include <string.h>
 #include <gtk/gtk.h>
-#include <gdk/gdkx.h>
 #include <matchbox-panel/mb-panel.h>
 #include <matchbox-panel/mb-panel-scaling-image2.h>
 
-#ifdef USE_LIBSN
-  #define SN_API_NOT_YET_FROZEN 1
-  #include <libsn/sn.h>
-#endif
-
 typedef struct {
+        GtkWidget *event_box;
         MBPanelScalingImage2 *image;
 
         gboolean button_down;
 
         gboolean use_sn;
 
+        char *desktop_id;
         char *name;
+        char *exec;
         char **argv;
+
+        guint monitor_id;
 } LauncherApplet;
 
 static void
 launcher_applet_free (LauncherApplet *applet)
 {
+        mb_panel_desktop_remove_monitor (applet->monitor_id);
+
+        g_free (applet->desktop_id);
         g_free (applet->name);
+        g_free (applet->exec);
         g_strfreev (applet->argv);
 
         g_slice_free (LauncherApplet, applet);
 }
 
-/* Convert command line to argv array, stripping % conversions on the way */
-#define MAX_ARGS 255
-
-static char **
-exec_to_argv (const char *exec)
-{
-	const char *p;
-        char *buf, *bufp, **argv;
-        int nargs;
-        gboolean escape, single_quote, double_quote;
-
-        argv = g_new (char *, MAX_ARGS + 1);
-        buf = g_alloca (strlen (exec) + 1);
-        bufp = buf;
-        nargs = 0;
-        escape = single_quote = double_quote = FALSE;
-
-	for (p = exec; *p; p++) {
-                if (escape) {
-                        *bufp++ = *p;
-
-                        escape = FALSE;
-                } else {
-                        switch (*p) {
-                        case '\\':
-                                escape = TRUE;
-                                
-                                break;
-                        case '%':
-                                /* Strip '%' conversions */
-                                if (p[1] && p[1] == '%')
-                                        *bufp++ = *p;
-
-                                p++;
-
-                                break;
-                        case '\'':
-                                if (double_quote)
-                                        *bufp++ = *p;
-                                else
-                                        single_quote = !single_quote;
-
-                                break;
-                        case '\"':
-                                if (single_quote)
-                                        *bufp++ = *p;
-                                else
-                                        double_quote = !double_quote;
-
-                                break;
-                        case ' ':
-                                if (single_quote || double_quote)
-                                        *bufp++ = *p;
-                                else {
-                                        *bufp = 0;
-
-                                        if (nargs < MAX_ARGS)
-                                                argv[nargs++] = g_strdup (buf);
-
-                                        bufp = buf;
-                                }
-
-                                break;
-                        default:
-                                *bufp++ = *p;
-                                break;
-                        }
-                }
-	}
-
-        if (bufp != buf) {
-                *bufp = 0;
-
-                if (nargs < MAX_ARGS)
-	                argv[nargs++] = g_strdup (buf);
-        }
-
-        argv[nargs] = NULL;
-
-        return argv;
-}
-
 /* Button pressed on event box */
 static gboolean
 button_press_event_cb (GtkWidget      *event_box,
@@ -142,11 +62,7 @@ button_release_event_cb (GtkWidget      *event_box,
                          LauncherApplet *applet)
 {
         int x, y;
-        pid_t child_pid = 0;
         GtkAllocation allocation;
-#ifdef USE_LIBSN
-        SnLauncherContext *context;
-#endif
 
         if (event->button != 1 || !applet->button_down)
                 return TRUE;
@@ -168,55 +84,8 @@ button_release_event_cb (GtkWidget      *event_box,
             y > allocation.y + allocation.height)
                 return TRUE;
 
-#ifdef USE_LIBSN
-        context = NULL;
-
-        if (applet->use_sn) {
-                SnDisplay *sn_dpy;
-                Display *display;
-                int screen;
-
-                display = gdk_x11_display_get_xdisplay
-                              (gtk_widget_get_display (GTK_WIDGET (event_box)));
-                sn_dpy = sn_display_new (display, NULL, NULL);
-
-                screen = gdk_screen_get_number
-                              (gtk_widget_get_screen (GTK_WIDGET (event_box)));
-                context = sn_launcher_context_new (sn_dpy, screen);
-                sn_display_unref (sn_dpy);
-          
-                sn_launcher_context_set_name (context, applet->name);
-                sn_launcher_context_set_binary_name (context,
-                                                     applet->argv[0]);
-          
-                sn_launcher_context_initiate (context,
-                                              "matchbox-panel",
-                                              applet->argv[0],
-                                              CurrentTime);
-        }
-#endif
-
-        switch ((child_pid = fork ())) {
-        case -1:
-                g_warning ("Fork failed");
-                break;
-        case 0:
-#ifdef USE_LIBSN
-                if (applet->use_sn)
-                        sn_launcher_context_setup_child_process (context);
-#endif
-                execvp (applet->argv[0], applet->argv);
-
-                g_warning ("Failed to execvp() %s", applet->argv[0]);
-                _exit (1);
-
-                break;
-        }
-
-#ifdef USE_LIBSN
-        if (applet->use_sn)
-                sn_launcher_context_unref (context);
-#endif
+        mb_panel_launch (event_box, applet->desktop_id, applet->name,
+                         applet->argv, applet->use_sn);
 
         return TRUE;
 }
@@ -233,122 +102,104 @@ grab_notify_cb (GtkWidget      *widget,
         }
 }
 
+/* The desktop entries changed, update whatever changed in ours */
+static void
+entries_changed_cb (LauncherApplet *applet)
+{
+        const MBPanelDesktopEntry *entry;
+
+        entry = mb_panel_desktop_entry_lookup (applet->desktop_id);
+
+        /* Hide the launcher while its application is not installed */
+        if (!entry || !entry->icon || entry->icon[0] == 0 ||
+            !entry->exec || entry->exec[0] == 0) {
+                gtk_widget_hide (applet->event_box);
+
+                return;
+        }
+
+        applet->use_sn = entry->startup_notify;
+
+        if (g_strcmp0 (entry->name, applet->name) != 0) {
+                g_free (applet->name);
+                applet->name = g_strdup (entry->name);
+        }
+
+        if (strcmp (entry->exec, applet->exec) != 0) {
+                g_free (applet->exec);
+                applet->exec = g_strdup (entry->exec);
+
+                g_strfreev (applet->argv);
+                applet->argv = mb_panel_launch_exec_to_argv (entry->exec);
+        }
+
+        /* Keep the loaded icon unless it is another one */
+        if (strcmp (entry->icon,
+                    mb_panel_scaling_image2_get_icon (applet->image)) != 0)
+                mb_panel_scaling_image2_set_icon (applet->image, entry->icon);
+
+        gtk_widget_show (applet->event_box);
+}
+
 G_MODULE_EXPORT GtkWidget *
 mb_panel_applet_create (const char    *id,
                         GtkOrientation orientation)
 {
-        char *filename;
-        GKeyFile *key_file;
+        const MBPanelDesktopEntry *entry;
         GtkWidget *event_box, *image;
-        GError *error;
-        char *icon, *exec, *name;
-        gboolean use_sn;
         LauncherApplet *applet;
         
         /* Try to find a .desktop file for @id */
-        key_file = g_key_file_new ();
-
-        filename = g_strdup_printf ("applications/%s.desktop", id);
-        error = NULL;
-        if (!g_key_file_load_from_data_dirs (key_file,
-                                             filename,
-                                             NULL,
-                                             G_KEY_FILE_NONE,
-                                             &error)) {
-                /* An error occured */
-                g_warning ("%s", error->message);
-                
-                g_error_free (error);
-
-                g_free (filename);
-                g_key_file_free (key_file);
+        entry = mb_panel_desktop_entry_lookup (id);
+        if (!entry) {
+                g_warning ("Cannot find applications/%s.desktop", id);
 
                 return NULL;
         }
 
-        g_free (filename);
-
-        /* Found and opened keyfile. Read the values we want. */
-
         /* Icon */
-        error = NULL;
-        icon = g_key_file_get_string (key_file,
-                                      "Desktop Entry",
-                                      "Icon",
-                                      &error);
-        icon = icon ? g_strstrip (icon) : NULL;
-        if (!icon || icon[0] == 0) {
-                if (error) {
-                        g_warning ("%s", error->message);
-
-                        g_error_free (error);
-                } else
-                        g_warning ("No icon specified");
-
-                g_key_file_free (key_file);
+        if (!entry->icon || entry->icon[0] == 0) {
+                g_warning ("No icon specified");
 
                 return NULL;
         }
 
         /* Exec */
-        error = NULL;
-        exec = g_key_file_get_string (key_file,
-                                      "Desktop Entry",
-                                      "Exec",
-                                      &error);
-        exec = exec ? g_strstrip (exec) : NULL;
-        if (!exec || exec[0] == 0) {
-                if (error) {
-                        g_warning ("%s", error->message);
-
-                        g_error_free (error);
-                } else
-                        g_warning ("No exec specified");
-
-                g_free (icon);
-                g_key_file_free (key_file);
+        if (!entry->exec || entry->exec[0] == 0) {
+                g_warning ("No exec specified");
 
                 return NULL;
         }
 
-        /* Name */
-        name = g_key_file_get_string (key_file,
-                                      "Desktop Entry",
-                                      "Name",
-                                      NULL);
-
-        /* StartupNotify */
-        use_sn = g_key_file_get_boolean (key_file,
-                                         "Desktop Entry",
-                                         "StartupNotify",
-                                         NULL);
-        
-        /* Close key file */
-        g_key_file_free (key_file);
-
         /* Create widgets */
         event_box = gtk_event_box_new ();
 
         gtk_widget_set_name (event_box, "MatchboxPanelLauncher");
 
-        image = mb_panel_scaling_image2_new (orientation, icon);
-        g_free (icon);
+        image = mb_panel_scaling_image2_new (orientation, entry->icon);
 
         gtk_container_add (GTK_CONTAINER (event_box), image);
 
         /* Set up applet structure */
         applet = g_slice_new0 (LauncherApplet);
 
+        applet->event_box = event_box;
         applet->image = MB_PANEL_SCALING_IMAGE2 (image);
         
         applet->button_down = FALSE;
 
-        applet->use_sn = use_sn;
+        applet->use_sn = entry->startup_notify;
+
+        applet->desktop_id = g_strdup (id);
+        applet->name = g_strdup (entry->name);
 
-        applet->name = name;
+        applet->exec = g_strdup (entry->exec);
+        applet->argv = mb_panel_launch_exec_to_argv (entry->exec);
 
-        applet->argv = exec_to_argv (exec);
-        g_free (exec);
+        applet->monitor_id =
+                mb_panel_desktop_add_monitor ((MBPanelDesktopFunc)
+                                              entries_changed_cb,
+                                              applet);
 
         g_object_weak_ref (G_OBJECT (event_box),
                            (GWeakNotify) launcher_applet_free,
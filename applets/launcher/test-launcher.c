@@ -0,0 +1,173 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+
+/*
+ * Licensed under the GPL v2 or greater.
+ *
+ * Creates a launcher for a desktop entry in a private data directory and
+ * checks that it follows the entry when it is rewritten and removed.
+ */
+
+#include <config.h>
+#include <glib/gstdio.h>
+#include <gtk/gtk.h>
+#include <matchbox-panel/mb-panel.h>
+#include <matchbox-panel/mb-panel-scaling-image2.h>
+
+/* How long to wait for the panel to notice a change, in seconds */
+#define WAIT_TIMEOUT 5
+
+static char *tmp_dir, *desktop_file;
+static gboolean have_display;
+
+static void
+write_entry (const char *icon, const char *exec)
+{
+        char *contents;
+
+        contents = g_strdup_printf ("[Desktop Entry]\n"
+                                    "Type=Application\n"
+                                    "Name=Test\n"
+                                    "Icon=%s\n"
+                                    "Exec=%s\n",
+                                    icon, exec);
+        g_assert (g_file_set_contents (desktop_file, contents, -1, NULL));
+        g_free (contents);
+}
+
+static const char *
+get_icon (GtkWidget *launcher)
+{
+        GtkWidget *image = gtk_bin_get_child (GTK_BIN (launcher));
+
+        return mb_panel_scaling_image2_get_icon (MB_PANEL_SCALING_IMAGE2 (image));
+}
+
+static gboolean
+icon_is (GtkWidget *launcher, gconstpointer icon)
+{
+        return g_strcmp0 (get_icon (launcher), icon) == 0;
+}
+
+static gboolean
+is_hidden (GtkWidget *launcher, gconstpointer data)
+{
+        return !gtk_widget_get_visible (launcher);
+}
+
+/* Run the main loop until @func returns TRUE or the wait times out */
+static gboolean
+wait_for (gboolean (* func) (GtkWidget *, gconstpointer),
+          GtkWidget *launcher,
+          gconstpointer data)
+{
+        gint64 deadline;
+
+        deadline = g_get_monotonic_time () + WAIT_TIMEOUT * G_USEC_PER_SEC;
+
+        while (!func (launcher, data)) {
+                if (g_get_monotonic_time () > deadline)
+                        return FALSE;
+
+                g_main_context_iteration (NULL, FALSE);
+                g_usleep (10000);
+        }
+
+        return TRUE;
+}
+
+static void
+test_reload (void)
+{
+        GtkWidget *launcher;
+
+        if (!have_display) {
+                g_test_skip ("No display");
+                return;
+        }
+
+        write_entry ("icon-one", "true");
+
+        launcher = mb_panel_applet_create ("test", GTK_ORIENTATION_HORIZONTAL);
+        g_assert (launcher != NULL);
+        g_object_ref_sink (launcher);
+
+        g_assert_cmpstr (get_icon (launcher), ==, "icon-one");
+
+        /* Rewriting the entry in place updates the launcher */
+        write_entry ("icon-two", "false");
+        g_assert (wait_for (icon_is, launcher, "icon-two"));
+        g_assert (gtk_widget_get_visible (launcher));
+
+        /* Removing it hides the launcher, adding it back shows it */
+        g_assert_cmpint (g_remove (desktop_file), ==, 0);
+        g_assert (wait_for (is_hidden, launcher, NULL));
+
+        write_entry ("icon-three", "true");
+        g_assert (wait_for (icon_is, launcher, "icon-three"));
+        g_assert (gtk_widget_get_visible (launcher));
+
+        /* Tearing it down removes its monitor */
+        gtk_widget_destroy (launcher);
+        g_object_unref (launcher);
+}
+
+static void
+remove_tree (const char *path)
+{
+        const char *name;
+        char *child;
+        GDir *dir;
+
+        dir = g_dir_open (path, 0, NULL);
+        if (dir) {
+                while ((name = g_dir_read_name (dir))) {
+                        child = g_build_filename (path, name, NULL);
+                        remove_tree (child);
+                        g_free (child);
+                }
+                g_dir_close (dir);
+        }
+
+        g_remove (path);
+}
+
+int
+main (int argc, char **argv)
+{
+        char *path;
+        int ret;
+
+        /* The directories are only looked up once, so set them first */
+        tmp_dir = g_dir_make_tmp ("test-launcher-XXXXXX", NULL);
+        g_assert (tmp_dir != NULL);
+
+        path = g_build_filename (tmp_dir, "data", NULL);
+        g_setenv ("XDG_DATA_HOME", path, TRUE);
+        g_free (path);
+
+        path = g_build_filename (tmp_dir, "system", NULL);
+        g_setenv ("XDG_DATA_DIRS", path, TRUE);
+        g_free (path);
+
+        path = g_build_filename (tmp_dir, "cache", NULL);
+        g_setenv ("XDG_CACHE_HOME", path, TRUE);
+        g_free (path);
+
+        path = g_build_filename (tmp_dir, "data", "applications", NULL);
+        g_mkdir_with_parents (path, 0700);
+        desktop_file = g_build_filename (path, "test.desktop", NULL);
+        g_free (path);
+
+        g_test_init (&argc, &argv, NULL);
+        have_display = gtk_init_check (&argc, &argv);
+
+        g_test_add_func ("/launcher/reload", test_reload);
+
+        ret = g_test_run ();
+
+        remove_tree (tmp_dir);
+        g_free (desktop_file);
+        g_free (tmp_dir);
+
+        return ret;
+}
@@ -7,112 +7,389 @@
  */
 
 #include <config.h>
+#include <string.h>
 #include <gtk/gtk.h>
 #include <matchbox-panel/mb-panel.h>
+#include <matchbox-panel/mb-panel-scaling-image2.h>
 #include "notify-store.h"
 #include "mb-notification.h"
 
+/* The most notifications shown at once, the others are counted in a "+N more"
+   label */
+#define MAX_WIDGETS 5
+
+/* How many closed notification widgets are kept for reuse */
+#define POOL_SIZE MAX_WIDGETS
+
+/* How many closed notifications the history menu shows */
+#define HISTORY_MENU_SIZE 20
+
+typedef struct {
+  MbNotifyStore *store;
+  GtkWidget *window;
+  /* The notification widgets */
+  GtkWidget *box;
+  GtkWidget *more;
+  /* ID to the notification's widget in the box */
+  GHashTable *widgets;
+  /* Unused widgets */
+  GQueue pool;
+  guint update_id;
+  /* Where the window was last put */
+  GdkRectangle geometry;
+  /* The history button in the panel, if enabled */
+  GtkWidget *button;
+} NotifyApplet;
+
 static void
-reposition (GtkWindow *window)
+reposition (NotifyApplet *applet)
 {
+  GtkWindow *window = GTK_WINDOW (applet->window);
   GtkRequisition req;
   GdkScreen *screen;
+  GdkRectangle monitor, geometry;
 
+  gtk_widget_get_preferred_size (GTK_WIDGET (window), &req, NULL);
+
+  if (req.height == 0) {
+    gtk_widget_hide (applet->window);
+    memset (&applet->geometry, 0, sizeof (applet->geometry));
+    return;
+  }
+
+  /* Go in the bottom right corner of the primary monitor */
   screen = gtk_window_get_screen (window);
+  gdk_screen_get_monitor_geometry (screen,
+                                   gdk_screen_get_primary_monitor (screen),
+                                   &monitor);
 
-  gtk_widget_get_preferred_size (GTK_WIDGET (window), &req, NULL);
+  geometry.width = req.width;
+  geometry.height = req.height;
+  geometry.x = monitor.x + monitor.width - req.width;
+  geometry.y = monitor.y + monitor.height - req.height;
 
-  if (req.height) {
-    gtk_window_resize (window, req.width, req.height);
-    /* TODO: get the primary monitor and then use
-       gdk_screen_get_monitor_geometry() to get the geometry of the primary
-       display, not the overall screen. */
-    gtk_window_move (window,
-                     gdk_screen_get_width (screen) - req.width,
-                     gdk_screen_get_height (screen) - req.height);
-    gtk_widget_show ((GtkWidget*)window);
-  } else {
-    gtk_widget_hide ((GtkWidget*)window);
+  /* Moving and resizing means a round trip through the window manager, so
+     only do it if something changed */
+  if (!gdk_rectangle_equal (&geometry, &applet->geometry)) {
+    gtk_window_resize (window, geometry.width, geometry.height);
+    gtk_window_move (window, geometry.x, geometry.y);
+    applet->geometry = geometry;
   }
+
+  gtk_widget_show (applet->window);
 }
 
-static gint
-id_compare (gconstpointer a, gconstpointer b)
+static void
+on_closed (MbNotification *notification, MbNotifyStore *store)
 {
-  MbNotification *notification = MB_NOTIFICATION (a);
-  guint find_id = GPOINTER_TO_INT (b);
-  return mb_notification_get_id (notification) - find_id;
+  mb_notify_store_close (store, mb_notification_get_id (notification), ClosedDismissed);
 }
 
+/* Take a widget from the pool, or create one if it is empty. Returns a new
+   reference. */
 static GtkWidget *
-find_widget (GtkContainer *container, guint32 id)
+get_widget (NotifyApplet *applet)
 {
-  GList *children, *l;
   GtkWidget *w;
 
-  children = gtk_container_get_children (container);
-  l = g_list_find_custom (children, GINT_TO_POINTER (id), id_compare);
-  w = l ? l->data : NULL;
-  g_list_free (children);
+  w = g_queue_pop_head (&applet->pool);
+  if (w)
+    return w;
+
+  w = g_object_ref_sink (mb_notification_new ());
+  g_signal_connect (w, "closed", G_CALLBACK (on_closed), applet->store);
+  gtk_widget_show_all (w);
   return w;
 }
 
+/* Remove a widget from the box, keeping it for later if the pool has room */
 static void
-on_closed (MbNotification *notification, MbNotifyStore *store)
+release_widget (NotifyApplet *applet, GtkWidget *w)
 {
-  mb_notify_store_close (store, mb_notification_get_id (notification), ClosedDismissed);
+  if (applet->pool.length < POOL_SIZE)
+    g_queue_push_head (&applet->pool, g_object_ref (w));
+
+  gtk_container_remove (GTK_CONTAINER (applet->box), w);
 }
 
 static void
-on_notification_added (MbNotifyStore *store, Notification *notification, GtkWindow *window)
+notify_applet_free (NotifyApplet *applet)
 {
-  GtkWidget *box, *w;
-
-  box  = gtk_bin_get_child (GTK_BIN (window));
-  w = find_widget ((GtkContainer*)box, notification->id);
-  if (!w) {
-    w = mb_notification_new ();
-    g_signal_connect (w, "closed", G_CALLBACK (on_closed), store);
-    gtk_widget_show_all (w);
-    gtk_box_pack_start (GTK_BOX (box), w, FALSE, FALSE, 0);
+  GtkWidget *w;
+
+  while ((w = g_queue_pop_head (&applet->pool))) {
+    gtk_widget_destroy (w);
+    g_object_unref (w);
   }
-  mb_notification_update (MB_NOTIFICATION (w), notification);
+  g_hash_table_destroy (applet->widgets);
+  g_free (applet);
+}
+
+/* Show widgets for the first MAX_WIDGETS notifications of the store and
+   count the others in the "more" label. The store is already in display
+   order, so this only ever looks at a bounded number of notifications. */
+static void
+update_widgets (NotifyApplet *applet)
+{
+  Notification *visible[MAX_WIDGETS];
+  GHashTableIter iter;
+  gpointer key, value;
+  GList *l;
+  guint n_visible, i, n_more;
 
-  reposition (window);
+  for (l = mb_notify_store_get_notifications (applet->store), n_visible = 0;
+       l && n_visible < MAX_WIDGETS; l = l->next)
+    visible[n_visible++] = l->data;
+
+  /* Remove the widgets of notifications which closed or were pushed out */
+  g_hash_table_iter_init (&iter, applet->widgets);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    guint id = GPOINTER_TO_UINT (key);
+
+    for (i = 0; i < n_visible; i++)
+      if (visible[i]->id == id)
+        break;
+
+    if (i == n_visible) {
+      g_hash_table_iter_remove (&iter);
+      release_widget (applet, value);
+    }
+  }
+
+  for (i = 0; i < n_visible; i++) {
+    GtkWidget *w;
+
+    w = g_hash_table_lookup (applet->widgets, GUINT_TO_POINTER (visible[i]->id));
+    if (!w) {
+      w = get_widget (applet);
+      mb_notification_update (MB_NOTIFICATION (w), visible[i]);
+      mb_notify_store_shown (applet->store, visible[i]);
+      gtk_box_pack_start (GTK_BOX (applet->box), w, FALSE, FALSE, 0);
+      g_object_unref (w);
+      g_hash_table_insert (applet->widgets,
+                           GUINT_TO_POINTER (visible[i]->id), w);
+    }
+    gtk_box_reorder_child (GTK_BOX (applet->box), w, i);
+  }
+
+  n_more = mb_notify_store_get_length (applet->store) - n_visible;
+  if (n_more) {
+    char *s;
+
+    s = g_strdup_printf ("+%u more", n_more);
+    gtk_label_set_text (GTK_LABEL (applet->more), s);
+    g_free (s);
+    gtk_widget_show (applet->more);
+  } else {
+    gtk_widget_hide (applet->more);
+  }
+}
+
+static gboolean
+update_idle (NotifyApplet *applet)
+{
+  applet->update_id = 0;
+
+  update_widgets (applet);
+  reposition (applet);
+
+  return FALSE;
 }
 
+/* Notifications arrive and close in bursts, so update the window once the
+   main loop is idle instead of for every one of them */
 static void
-on_notification_closed (MbNotifyStore *store, guint id, guint reason, GtkWindow *window)
+queue_update (NotifyApplet *applet)
 {
-  GtkWidget *box, *w;
+  if (applet->update_id == 0)
+    applet->update_id = g_idle_add ((GSourceFunc)update_idle, applet);
+}
 
-  box  = gtk_bin_get_child (GTK_BIN (window));
-  w = find_widget ((GtkContainer*)box, id);
-  if (w)
-    gtk_container_remove (GTK_CONTAINER (box), w);
+static void
+on_notification_added (MbNotifyStore *store, Notification *notification, NotifyApplet *applet)
+{
+  GtkWidget *w;
 
-  reposition (window);
+  /* A replaced notification is updated straight away, new ones get a widget
+     when the window is updated */
+  w = g_hash_table_lookup (applet->widgets, GUINT_TO_POINTER (notification->id));
+  if (w) {
+    mb_notification_update (MB_NOTIFICATION (w), notification);
+    mb_notify_store_shown (store, notification);
+  }
+
+  /* Critical notifications go on screen before the next frame instead of
+     waiting for the main loop to be idle */
+  if (notification->urgency == UrgencyCritical) {
+    if (applet->update_id)
+      g_source_remove (applet->update_id);
+    update_idle (applet);
+  } else {
+    queue_update (applet);
+  }
+}
+
+static void
+on_notification_closed (MbNotifyStore *store, guint id, guint reason, NotifyApplet *applet)
+{
+  queue_update (applet);
+}
+
+static void
+on_monitors_changed (GdkScreen *screen, NotifyApplet *applet)
+{
+  memset (&applet->geometry, 0, sizeof (applet->geometry));
+  queue_update (applet);
+}
+
+/* History menu was deactivated */
+static void
+history_selection_done_cb (GtkMenuShell *menu_shell, NotifyApplet *applet)
+{
+  gtk_widget_destroy (GTK_WIDGET (menu_shell));
+
+  gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (applet->button), FALSE);
+}
+
+static void
+position_history (GtkMenu *menu, int *x, int *y, gboolean *push_in,
+                  gpointer user_data)
+{
+  NotifyApplet *applet = user_data;
+  GtkAllocation allocation;
+
+  gdk_window_get_origin (gtk_widget_get_window (applet->button), x, y);
+  gtk_widget_get_allocation (applet->button, &allocation);
+
+  *x += allocation.x;
+  *y += allocation.height;
+  *push_in = TRUE;
+}
+
+/* The history is only read when the menu is opened */
+static void
+history_toggled_cb (GtkToggleButton *button, NotifyApplet *applet)
+{
+  MbNotifyHistory *history;
+  GtkWidget *menu, *item;
+  guint i, length;
+
+  if (!gtk_toggle_button_get_active (button))
+    return;
+
+  menu = gtk_menu_new ();
+  g_signal_connect (menu, "selection-done",
+                    G_CALLBACK (history_selection_done_cb), applet);
+
+  history = mb_notify_store_get_history (applet->store);
+  length = history ? mb_notify_history_get_length (history) : 0;
+
+  for (i = 0; i < MIN (length, HISTORY_MENU_SIZE); i++) {
+    const MbNotifyHistoryEntry *entry;
+    GDateTime *time;
+    char *when, *s;
+
+    entry = mb_notify_history_get (history, i);
+
+    time = g_date_time_new_from_unix_local (entry->time / G_USEC_PER_SEC);
+    when = g_date_time_format (time, "%H:%M");
+    g_date_time_unref (time);
+
+    s = g_markup_printf_escaped ("<b>%s</b>\n<small>%s %s</small>",
+                                 entry->summary, entry->app_name, when);
+    g_free (when);
+
+    item = gtk_menu_item_new_with_label (NULL);
+    gtk_label_set_markup (GTK_LABEL (gtk_bin_get_child (GTK_BIN (item))), s);
+    g_free (s);
+
+    gtk_menu_shell_append (GTK_MENU_SHELL (menu), item);
+  }
+
+  if (length == 0) {
+    item = gtk_menu_item_new_with_label ("No notifications");
+    gtk_widget_set_sensitive (item, FALSE);
+    gtk_menu_shell_append (GTK_MENU_SHELL (menu), item);
+  }
+
+  gtk_widget_show_all (menu);
+
+  gtk_menu_popup (GTK_MENU (menu), NULL, NULL,
+                  position_history, applet,
+                  0, gtk_get_current_event_time ());
 }
 
 G_MODULE_EXPORT GtkWidget *
 mb_panel_applet_create (const char *id, GtkOrientation orientation)
 {
-  GtkWidget *window, *box;
+  NotifyApplet *applet;
+  GtkWidget *window, *vbox;
   MbNotifyStore *notify;
+  char **options, **option;
+  gboolean show_history = FALSE;
+
+  applet = g_new0 (NotifyApplet, 1);
+  applet->widgets = g_hash_table_new (NULL, NULL);
+  g_queue_init (&applet->pool);
 
   window = gtk_window_new (GTK_WINDOW_POPUP);
   gtk_widget_set_name (window, "MbNotificationBox");
   gtk_window_set_gravity (GTK_WINDOW (window), GDK_GRAVITY_SOUTH_EAST);
+  g_object_set_data_full (G_OBJECT (window), "applet", applet,
+                          (GDestroyNotify)notify_applet_free);
+  applet->window = window;
+
+  vbox = gtk_vbox_new (FALSE, 0);
+  gtk_container_add (GTK_CONTAINER (window), vbox);
+
+  applet->box = gtk_vbox_new (TRUE, 0);
+  gtk_box_pack_start (GTK_BOX (vbox), applet->box, FALSE, FALSE, 0);
+
+  applet->more = gtk_label_new (NULL);
+  gtk_widget_set_name (applet->more, "MbNotificationMore");
+  gtk_box_pack_start (GTK_BOX (vbox), applet->more, FALSE, FALSE, 0);
 
-  box = gtk_vbox_new (TRUE, 0);
-  gtk_container_add (GTK_CONTAINER (window), box);
-  gtk_widget_show_all (window);
+  gtk_widget_show (applet->box);
+  gtk_widget_show (vbox);
+  gtk_widget_show (window);
 
   notify = mb_notify_store_new ();
-  g_signal_connect (notify, "notification-added", G_CALLBACK (on_notification_added), window);
-  g_signal_connect (notify, "notification-closed", G_CALLBACK (on_notification_closed), window);
+  applet->store = notify;
+
+  /* The ID is a list of options separated by colons: "urgency" or "app"
+     select the order notifications are displayed in, and "history" adds a
+     button with the recently closed notifications to the panel */
+  options = g_strsplit (id ? id : "", ":", -1);
+  for (option = options; *option; option++) {
+    if (strcmp (*option, "urgency") == 0)
+      mb_notify_store_set_order (notify, OrderUrgency);
+    else if (strcmp (*option, "app") == 0)
+      mb_notify_store_set_order (notify, OrderApp);
+    else if (strcmp (*option, "history") == 0)
+      show_history = TRUE;
+  }
+  g_strfreev (options);
+
+  g_signal_connect (notify, "notification-added", G_CALLBACK (on_notification_added), applet);
+  g_signal_connect (notify, "notification-closed", G_CALLBACK (on_notification_closed), applet);
+
+  g_signal_connect (gtk_window_get_screen (GTK_WINDOW (window)), "monitors-changed",
+                    G_CALLBACK (on_monitors_changed), applet);
+
+  reposition (applet);
+
+  if (!show_history)
+    return gtk_hbox_new (FALSE, 0);
 
-  reposition (GTK_WINDOW (window));
+  applet->button = gtk_toggle_button_new ();
+  gtk_button_set_relief (GTK_BUTTON (applet->button), GTK_RELIEF_NONE);
+  gtk_widget_set_name (applet->button, "MatchboxPanelNotificationHistory");
+  gtk_container_add (GTK_CONTAINER (applet->button),
+                     mb_panel_scaling_image2_new (orientation,
+                                                  "document-open-recent"));
+  g_signal_connect (applet->button, "toggled",
+                    G_CALLBACK (history_toggled_cb), applet);
+  gtk_widget_show_all (applet->button);
 
-  return gtk_hbox_new (FALSE, 0);
+  return applet->button;
 }
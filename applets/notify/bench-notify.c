@@ -0,0 +1,386 @@
+/*
+ * Licensed under the GPL v2 or greater.
+ *
+ * Throughput and latency benchmark for the notify applet. Runs the applet on
+ * a private session bus and drives it with Notify and CloseNotification
+ * calls from a separate connection, then reports the call rate, the time
+ * from a call to the notification being drawn, and how long the main loop
+ * stalled. Needs an X server, "make bench" runs it under Xvfb.
+ */
+
+#include <config.h>
+#include <stdlib.h>
+#include <string.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include <gtk/gtk.h>
+#include <matchbox-panel/mb-panel.h>
+#include "mb-notification.h"
+
+#define NOTIFICATIONS_NAME "org.freedesktop.Notifications"
+#define NOTIFICATIONS_PATH "/org/freedesktop/Notifications"
+#define NOTIFICATIONS_INTERFACE "org.freedesktop.Notifications"
+#define STATS_INTERFACE "org.matchbox_project.Notifications"
+
+/* How often the main loop is sampled for stalls, in milliseconds */
+#define STALL_INTERVAL 5
+
+static char *mode = "steady";
+static int count = 1000;
+static int rate = 200;
+static int burst = 100;
+static int apps = 1;
+static gboolean close_calls = FALSE;
+
+static GOptionEntry entries[] = {
+  { "mode", 'm', 0, G_OPTION_ARG_STRING, &mode,
+    "Load to drive: steady, burst or replace", "MODE" },
+  { "count", 'n', 0, G_OPTION_ARG_INT, &count,
+    "Number of Notify calls", "N" },
+  { "rate", 'r', 0, G_OPTION_ARG_INT, &rate,
+    "Calls per second in steady mode", "N" },
+  { "burst", 'b', 0, G_OPTION_ARG_INT, &burst,
+    "Calls per second, all at once, in burst mode", "N" },
+  { "apps", 'a', 0, G_OPTION_ARG_INT, &apps,
+    "Number of application names to send as", "N" },
+  { "close", 'c', 0, G_OPTION_ARG_NONE, &close_calls,
+    "Close every notification as soon as it was sent", NULL },
+  { NULL }
+};
+
+typedef struct {
+  GMainLoop *loop;
+  GDBusConnection *client;
+  GtkWidget *box;
+  int sent, replied, failed;
+  guint replace_id;
+  gint64 start, end;
+  /* ID to the time of the last call which showed it, as a gint64 * */
+  GHashTable *pending;
+  GArray *latencies;
+  /* Main loop stalls */
+  gint64 last_tick;
+  gint64 stall_total, stall_max;
+} Bench;
+
+typedef struct {
+  Bench *bench;
+  gint64 sent;
+} Call;
+
+static void
+on_notify_reply (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+  Call *call = user_data;
+  Bench *bench = call->bench;
+  GVariant *reply;
+  GError *error = NULL;
+  gint64 *sent;
+  guint id;
+
+  reply = g_dbus_connection_call_finish (bench->client, result, &error);
+  bench->replied++;
+
+  if (reply == NULL) {
+    bench->failed++;
+    g_error_free (error);
+  } else {
+    g_variant_get (reply, "(u)", &id);
+    g_variant_unref (reply);
+
+    if (bench->replace_id == 0 && strcmp (mode, "replace") == 0)
+      bench->replace_id = id;
+
+    /* A later call replacing this one takes over the latency */
+    sent = g_new (gint64, 1);
+    *sent = call->sent;
+    g_hash_table_insert (bench->pending, GUINT_TO_POINTER (id), sent);
+
+    if (close_calls)
+      g_dbus_connection_call (bench->client, NOTIFICATIONS_NAME,
+                              NOTIFICATIONS_PATH, NOTIFICATIONS_INTERFACE,
+                              "CloseNotification", g_variant_new ("(u)", id),
+                              NULL, G_DBUS_CALL_FLAGS_NONE, -1,
+                              NULL, NULL, NULL);
+  }
+
+  g_slice_free (Call, call);
+
+  if (bench->replied == count) {
+    bench->end = g_get_monotonic_time ();
+    g_main_loop_quit (bench->loop);
+  }
+}
+
+static void
+send_notify (Bench *bench)
+{
+  char *app_name, *summary;
+  Call *call;
+
+  app_name = g_strdup_printf ("bench-%d", bench->sent % MAX (apps, 1));
+  summary = g_strdup_printf ("Notification %d", bench->sent);
+
+  call = g_slice_new (Call);
+  call->bench = bench;
+  call->sent = g_get_monotonic_time ();
+
+  g_dbus_connection_call (bench->client, NOTIFICATIONS_NAME,
+                          NOTIFICATIONS_PATH, NOTIFICATIONS_INTERFACE,
+                          "Notify",
+                          g_variant_new ("(susssasa{sv}i)", app_name,
+                                         bench->replace_id, "", summary,
+                                         "Benchmark", NULL, NULL, -1),
+                          G_VARIANT_TYPE ("(u)"), G_DBUS_CALL_FLAGS_NONE, -1,
+                          NULL, on_notify_reply, call);
+
+  bench->sent++;
+
+  g_free (app_name);
+  g_free (summary);
+}
+
+static gboolean
+steady_cb (Bench *bench)
+{
+  send_notify (bench);
+
+  return bench->sent < count;
+}
+
+static gboolean
+burst_cb (Bench *bench)
+{
+  int i;
+
+  for (i = 0; i < burst && bench->sent < count; i++)
+    send_notify (bench);
+
+  return bench->sent < count;
+}
+
+static gboolean
+replace_cb (Bench *bench)
+{
+  /* Wait for the first notification before replacing it */
+  if (bench->sent == 1 && bench->replace_id == 0)
+    return TRUE;
+
+  send_notify (bench);
+
+  return bench->sent < count;
+}
+
+/* Every notification drawn for the first time since a call showed it gives
+   a latency */
+static gboolean
+on_draw (GtkWidget *widget, cairo_t *cr, Bench *bench)
+{
+  GList *children, *l;
+  gint64 now, *sent;
+
+  now = g_get_monotonic_time ();
+
+  children = gtk_container_get_children (GTK_CONTAINER (bench->box));
+  for (l = children; l; l = l->next) {
+    guint id = mb_notification_get_id (l->data);
+
+    sent = g_hash_table_lookup (bench->pending, GUINT_TO_POINTER (id));
+    if (sent) {
+      gint64 latency = now - *sent;
+      g_array_append_val (bench->latencies, latency);
+      g_hash_table_remove (bench->pending, GUINT_TO_POINTER (id));
+    }
+  }
+  g_list_free (children);
+
+  return FALSE;
+}
+
+static gboolean
+stall_cb (Bench *bench)
+{
+  gint64 now, late;
+
+  now = g_get_monotonic_time ();
+  late = now - bench->last_tick - STALL_INTERVAL * 1000;
+  if (late > 0) {
+    bench->stall_total += late;
+    bench->stall_max = MAX (bench->stall_max, late);
+  }
+  bench->last_tick = now;
+
+  return TRUE;
+}
+
+static gboolean
+find_box (Bench *bench)
+{
+  GList *windows, *l;
+
+  windows = gtk_window_list_toplevels ();
+  for (l = windows; l; l = l->next) {
+    if (g_strcmp0 (gtk_widget_get_name (l->data), "MbNotificationBox") == 0) {
+      GList *children;
+
+      g_signal_connect_after (l->data, "draw", G_CALLBACK (on_draw), bench);
+
+      /* The window holds a box with the notifications and the "more" label */
+      children = gtk_container_get_children
+        (GTK_CONTAINER (gtk_bin_get_child (GTK_BIN (l->data))));
+      bench->box = children->data;
+      g_list_free (children);
+    }
+  }
+  g_list_free (windows);
+
+  return bench->box != NULL;
+}
+
+static gint
+compare_latency (gconstpointer a, gconstpointer b)
+{
+  gint64 la = *(const gint64 *)a, lb = *(const gint64 *)b;
+
+  return (la > lb) - (la < lb);
+}
+
+static double
+percentile (GArray *latencies, int p)
+{
+  if (latencies->len == 0)
+    return 0.0;
+
+  return g_array_index (latencies, gint64,
+                        MIN (latencies->len - 1, latencies->len * p / 100)) / 1000.0;
+}
+
+static void
+on_name_appeared (GDBusConnection *connection, const gchar *name,
+                  const gchar *owner, gpointer user_data)
+{
+  g_main_loop_quit (user_data);
+}
+
+static gboolean
+drain_cb (GMainLoop *loop)
+{
+  g_main_loop_quit (loop);
+  return FALSE;
+}
+
+int
+main (int argc, char **argv)
+{
+  GOptionContext *context;
+  GError *error = NULL;
+  GTestDBus *bus;
+  Bench bench = { 0 };
+  GVariant *reply;
+  guint watch_id, received, dropped, merged;
+  char *runtime_dir, *filename;
+  double elapsed;
+
+  context = g_option_context_new ("- notification daemon benchmark");
+  g_option_context_add_main_entries (context, entries, NULL);
+  g_option_context_add_group (context, gtk_get_option_group (TRUE));
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_printerr ("%s\n", error->message);
+    return 1;
+  }
+  g_option_context_free (context);
+
+  if (strcmp (mode, "steady") && strcmp (mode, "burst") && strcmp (mode, "replace")) {
+    g_printerr ("Unknown mode %s\n", mode);
+    return 1;
+  }
+
+  /* Keep the history away from the real one */
+  runtime_dir = g_dir_make_tmp ("bench-notify-XXXXXX", NULL);
+  g_setenv ("XDG_RUNTIME_DIR", runtime_dir, TRUE);
+
+  bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (bus);
+
+  bench.loop = g_main_loop_new (NULL, FALSE);
+  bench.pending = g_hash_table_new_full (NULL, NULL, NULL, g_free);
+  bench.latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+  /* The applet creates the store and the notification window */
+  g_object_ref_sink (mb_panel_applet_create (NULL, GTK_ORIENTATION_HORIZONTAL));
+  if (!find_box (&bench)) {
+    g_printerr ("Cannot find the notification window\n");
+    return 1;
+  }
+
+  /* A separate connection, so the calls really go through the bus */
+  bench.client = g_dbus_connection_new_for_address_sync
+    (g_test_dbus_get_bus_address (bus),
+     G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+     G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+     NULL, NULL, &error);
+  if (bench.client == NULL) {
+    g_printerr ("Cannot connect to the bus: %s\n", error->message);
+    return 1;
+  }
+
+  watch_id = g_bus_watch_name_on_connection (bench.client, NOTIFICATIONS_NAME,
+                                             G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                             on_name_appeared, NULL,
+                                             bench.loop, NULL);
+  g_main_loop_run (bench.loop);
+  g_bus_unwatch_name (watch_id);
+
+  bench.last_tick = g_get_monotonic_time ();
+  g_timeout_add (STALL_INTERVAL, (GSourceFunc)stall_cb, &bench);
+
+  bench.start = g_get_monotonic_time ();
+  if (strcmp (mode, "steady") == 0)
+    g_timeout_add (MAX (1, 1000 / MAX (rate, 1)), (GSourceFunc)steady_cb, &bench);
+  else if (strcmp (mode, "burst") == 0)
+    g_timeout_add (1000, (GSourceFunc)burst_cb, &bench);
+  else
+    g_idle_add ((GSourceFunc)replace_cb, &bench);
+
+  g_main_loop_run (bench.loop);
+
+  /* Let the last notifications be drawn */
+  g_timeout_add (200, (GSourceFunc)drain_cb, bench.loop);
+  g_main_loop_run (bench.loop);
+
+  reply = g_dbus_connection_call_sync (bench.client, NOTIFICATIONS_NAME,
+                                       NOTIFICATIONS_PATH, STATS_INTERFACE,
+                                       "GetStats", NULL, G_VARIANT_TYPE ("(uuu)"),
+                                       G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL);
+  received = dropped = merged = 0;
+  if (reply) {
+    g_variant_get (reply, "(uuu)", &received, &dropped, &merged);
+    g_variant_unref (reply);
+  }
+
+  g_array_sort (bench.latencies, compare_latency);
+  elapsed = (bench.end - bench.start) / (double)G_USEC_PER_SEC;
+
+  g_print ("mode %s, %d calls from %d applications%s\n", mode, count,
+           MAX (apps, 1), close_calls ? ", closing each" : "");
+  g_print ("calls/sec:     %.1f (%d failed)\n",
+           elapsed > 0 ? bench.replied / elapsed : 0.0, bench.failed);
+  g_print ("visible:       %u of %d (%u dropped, %u merged)\n",
+           bench.latencies->len, count, dropped, merged);
+  g_print ("latency p50:   %.2f ms\n", percentile (bench.latencies, 50));
+  g_print ("latency p99:   %.2f ms\n", percentile (bench.latencies, 99));
+  g_print ("stall total:   %.2f ms\n", bench.stall_total / 1000.0);
+  g_print ("stall max:     %.2f ms\n", bench.stall_max / 1000.0);
+
+  g_object_unref (bench.client);
+  g_test_dbus_down (bus);
+  g_object_unref (bus);
+
+  filename = g_build_filename (runtime_dir, "matchbox-panel-notifications", NULL);
+  g_unlink (filename);
+  g_rmdir (runtime_dir);
+  g_free (filename);
+  g_free (runtime_dir);
+
+  return 0;
+}
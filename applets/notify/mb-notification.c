@@ -103,7 +103,9 @@ mb_notification_update (MbNotification *notification, Notification *n)
 
   priv->id = n->id;
 
-  if (n->icon_name) {
+  if (n->image) {
+    gtk_image_set_from_surface (GTK_IMAGE (priv->image), n->image);
+  } else if (n->icon_name) {
     gtk_image_set_from_icon_name (GTK_IMAGE (priv->image),
                                   n->icon_name, GTK_ICON_SIZE_DIALOG);
   } else {
@@ -111,8 +113,12 @@ mb_notification_update (MbNotification *notification, Notification *n)
     gtk_image_clear (GTK_IMAGE (priv->image));
   }
 
-  s = g_strdup_printf ("<big><b>%s</b></big>\n"
-                       "\n%s", n->summary, n->body ?: NULL);
+  if (n->count > 1)
+    s = g_strdup_printf ("<big><b>%s</b></big> (%u)\n"
+                         "\n%s", n->summary, n->count, n->body ?: NULL);
+  else
+    s = g_strdup_printf ("<big><b>%s</b></big>\n"
+                         "\n%s", n->summary, n->body ?: NULL);
   gtk_label_set_markup (GTK_LABEL (priv->label), s);
   g_free (s);
 }
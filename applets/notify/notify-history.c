@@ -0,0 +1,168 @@
+/*
+ * Licensed under the GPL v2 or greater.
+ *
+ * History of closed notifications, kept in a fixed-size ring of fixed-size
+ * entries in a memory-mapped file. Appending is a copy into the mapping, so
+ * it costs the same however long the history is and never allocates or
+ * syncs, and the file outlives the panel.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "notify-history.h"
+
+#define HISTORY_MAGIC 0x484e424d /* MBNH */
+#define HISTORY_VERSION 1
+#define HISTORY_LENGTH 256
+
+typedef struct {
+  guint32 magic;
+  guint32 version;
+  guint32 length;
+  guint32 entry_size;
+  /* How many entries were ever appended, the next one goes in
+     head % length */
+  guint32 head;
+  guint32 padding;
+} HistoryHeader;
+
+struct _MbNotifyHistory {
+  HistoryHeader *header;
+  MbNotifyHistoryEntry *entries;
+  gsize size;
+};
+
+/* Copy a string into a fixed-size field without leaving half a character at
+   the end */
+static void
+copy_string (char *dest, const char *src, gsize size)
+{
+  const gchar *end;
+
+  g_strlcpy (dest, src ? src : "", size);
+
+  if (!g_utf8_validate (dest, -1, &end))
+    *(char *)end = '\0';
+}
+
+/* Open the history file, by default in the user's runtime directory. The
+   file is reset if it was written with another layout. */
+MbNotifyHistory *
+mb_notify_history_open (const char *filename)
+{
+  MbNotifyHistory *history;
+  char *default_filename = NULL;
+  struct stat st;
+  gsize size;
+  void *map;
+  int fd;
+
+  if (filename == NULL)
+    filename = default_filename =
+      g_build_filename (g_get_user_runtime_dir (),
+                        "matchbox-panel-notifications", NULL);
+
+  size = sizeof (HistoryHeader) + HISTORY_LENGTH * sizeof (MbNotifyHistoryEntry);
+
+  fd = open (filename, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd == -1) {
+    g_warning ("Cannot open %s: %s", filename, g_strerror (errno));
+    g_free (default_filename);
+    return NULL;
+  }
+
+  if (fstat (fd, &st) == -1 || (gsize)st.st_size != size) {
+    if (ftruncate (fd, 0) == -1 || ftruncate (fd, size) == -1) {
+      g_warning ("Cannot resize %s: %s", filename, g_strerror (errno));
+      close (fd);
+      g_free (default_filename);
+      return NULL;
+    }
+  }
+
+  map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED) {
+    g_warning ("Cannot map %s: %s", filename, g_strerror (errno));
+    g_free (default_filename);
+    return NULL;
+  }
+
+  g_free (default_filename);
+
+  history = g_slice_new (MbNotifyHistory);
+  history->header = map;
+  history->entries = (MbNotifyHistoryEntry *)(history->header + 1);
+  history->size = size;
+
+  if (history->header->magic != HISTORY_MAGIC ||
+      history->header->version != HISTORY_VERSION ||
+      history->header->length != HISTORY_LENGTH ||
+      history->header->entry_size != sizeof (MbNotifyHistoryEntry)) {
+    memset (map, 0, size);
+    history->header->magic = HISTORY_MAGIC;
+    history->header->version = HISTORY_VERSION;
+    history->header->length = HISTORY_LENGTH;
+    history->header->entry_size = sizeof (MbNotifyHistoryEntry);
+  }
+
+  return history;
+}
+
+void
+mb_notify_history_close (MbNotifyHistory *history)
+{
+  if (history == NULL)
+    return;
+
+  munmap (history->header, history->size);
+  g_slice_free (MbNotifyHistory, history);
+}
+
+void
+mb_notify_history_append (MbNotifyHistory *history,
+                          guint id, guint urgency, guint reason,
+                          const char *app_name,
+                          const char *summary,
+                          const char *body)
+{
+  MbNotifyHistoryEntry *entry;
+
+  g_return_if_fail (history != NULL);
+
+  entry = &history->entries[history->header->head % HISTORY_LENGTH];
+
+  entry->time = g_get_real_time ();
+  entry->id = id;
+  entry->urgency = urgency;
+  entry->reason = reason;
+  copy_string (entry->app_name, app_name, sizeof (entry->app_name));
+  copy_string (entry->summary, summary, sizeof (entry->summary));
+  copy_string (entry->body, body, sizeof (entry->body));
+
+  /* Only count the entry once it is complete */
+  history->header->head++;
+}
+
+guint
+mb_notify_history_get_length (MbNotifyHistory *history)
+{
+  g_return_val_if_fail (history != NULL, 0);
+
+  return MIN (history->header->head, HISTORY_LENGTH);
+}
+
+/* Get the nth most recent entry, 0 being the last one appended */
+const MbNotifyHistoryEntry *
+mb_notify_history_get (MbNotifyHistory *history, guint n)
+{
+  g_return_val_if_fail (history != NULL, NULL);
+  g_return_val_if_fail (n < mb_notify_history_get_length (history), NULL);
+
+  return &history->entries[(history->header->head - 1 - n) % HISTORY_LENGTH];
+}
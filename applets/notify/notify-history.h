@@ -0,0 +1,40 @@
+#ifndef _MB_NOTIFY_HISTORY
+#define _MB_NOTIFY_HISTORY
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _MbNotifyHistory MbNotifyHistory;
+
+/* An entry in the history file. The strings are nul-terminated and
+   truncated to fit. */
+typedef struct {
+  /* Real time the notification closed at, in microseconds */
+  gint64 time;
+  guint32 id;
+  guint8 urgency;
+  guint8 reason;
+  guint8 padding[2];
+  char app_name[48];
+  char summary[128];
+  char body[320];
+} MbNotifyHistoryEntry;
+
+MbNotifyHistory *mb_notify_history_open (const char *filename);
+
+void mb_notify_history_close (MbNotifyHistory *history);
+
+void mb_notify_history_append (MbNotifyHistory *history,
+                               guint id, guint urgency, guint reason,
+                               const char *app_name,
+                               const char *summary,
+                               const char *body);
+
+guint mb_notify_history_get_length (MbNotifyHistory *history);
+
+const MbNotifyHistoryEntry *mb_notify_history_get (MbNotifyHistory *history, guint n);
+
+G_END_DECLS
+
+#endif /* _MB_NOTIFY_HISTORY */
@@ -0,0 +1,252 @@
+/*
+ * Licensed under the GPL v2 or greater.
+ *
+ * Decoding of the image-data and image-path hints. Decoded images are kept
+ * in a small cache keyed by their content, so an application which keeps
+ * sending the same image only has it decoded once.
+ */
+
+#include <config.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#include <gdk/gdk.h>
+#include "notify-image.h"
+
+#define CACHE_SIZE 16
+
+/* Key to cairo_surface_t */
+static GHashTable *cache;
+/* The keys, most recently used first */
+static GQueue cache_order = G_QUEUE_INIT;
+
+static cairo_surface_t *
+cache_lookup (const char *key)
+{
+  cairo_surface_t *surface;
+  GList *l;
+
+  if (cache == NULL)
+    return NULL;
+
+  surface = g_hash_table_lookup (cache, key);
+  if (surface == NULL)
+    return NULL;
+
+  l = g_queue_find_custom (&cache_order, key, (GCompareFunc)strcmp);
+  g_queue_unlink (&cache_order, l);
+  g_queue_push_head_link (&cache_order, l);
+
+  return cairo_surface_reference (surface);
+}
+
+static void
+cache_insert (const char *key, cairo_surface_t *surface)
+{
+  char *k;
+
+  if (cache == NULL)
+    cache = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                   g_free, (GDestroyNotify)cairo_surface_destroy);
+
+  if (cache_order.length >= CACHE_SIZE) {
+    /* The hash table owns the key */
+    k = g_queue_pop_tail (&cache_order);
+    g_hash_table_remove (cache, k);
+  }
+
+  k = g_strdup (key);
+  g_hash_table_insert (cache, k, cairo_surface_reference (surface));
+  g_queue_push_head (&cache_order, k);
+}
+
+/* Scale the surface down if it is bigger than MB_NOTIFY_IMAGE_SIZE, taking
+   ownership of it */
+static cairo_surface_t *
+limit_size (cairo_surface_t *surface)
+{
+  cairo_surface_t *scaled;
+  cairo_t *cr;
+  int width, height;
+  double scale;
+
+  width = cairo_image_surface_get_width (surface);
+  height = cairo_image_surface_get_height (surface);
+
+  if (width <= MB_NOTIFY_IMAGE_SIZE && height <= MB_NOTIFY_IMAGE_SIZE)
+    return surface;
+
+  scale = (double)MB_NOTIFY_IMAGE_SIZE / MAX (width, height);
+
+  scaled = cairo_image_surface_create (cairo_image_surface_get_format (surface),
+                                       MAX (1, width * scale),
+                                       MAX (1, height * scale));
+  cr = cairo_create (scaled);
+  cairo_scale (cr, scale, scale);
+  cairo_set_source_surface (cr, surface, 0, 0);
+  cairo_pattern_set_filter (cairo_get_source (cr), CAIRO_FILTER_GOOD);
+  cairo_paint (cr);
+  cairo_destroy (cr);
+
+  cairo_surface_destroy (surface);
+
+  return scaled;
+}
+
+/* Convert the non-premultiplied RGB(A) bytes of the hint straight into the
+   premultiplied native-endian pixels of a cairo image surface */
+static cairo_surface_t *
+decode_data (int width, int height, int rowstride, gboolean has_alpha,
+             int n_channels, const guchar *data)
+{
+  cairo_surface_t *surface;
+  guchar *pixels;
+  int stride, x, y;
+
+  surface = cairo_image_surface_create (has_alpha ? CAIRO_FORMAT_ARGB32 : CAIRO_FORMAT_RGB24,
+                                        width, height);
+  if (cairo_surface_status (surface) != CAIRO_STATUS_SUCCESS) {
+    cairo_surface_destroy (surface);
+    return NULL;
+  }
+
+  cairo_surface_flush (surface);
+  pixels = cairo_image_surface_get_data (surface);
+  stride = cairo_image_surface_get_stride (surface);
+
+  for (y = 0; y < height; y++) {
+    const guchar *src = data + y * rowstride;
+    guint32 *dest = (guint32 *)(pixels + y * stride);
+
+    for (x = 0; x < width; x++, src += n_channels) {
+      guint r = src[0], g = src[1], b = src[2], a = 0xff;
+
+      if (has_alpha) {
+        a = src[3];
+        r = (r * a + 127) / 255;
+        g = (g * a + 127) / 255;
+        b = (b * a + 127) / 255;
+      }
+
+      dest[x] = (a << 24) | (r << 16) | (g << 8) | b;
+    }
+  }
+
+  cairo_surface_mark_dirty (surface);
+
+  return limit_size (surface);
+}
+
+/* Decode an image-data hint, of type (iiibiiay). Returns a new reference to
+   the image, or NULL if the hint is invalid. */
+cairo_surface_t *
+mb_notify_image_from_data (GVariant *image_data)
+{
+  int width, height, rowstride, bits_per_sample, n_channels;
+  gboolean has_alpha;
+  GVariant *bytes;
+  const guchar *data;
+  gsize len;
+  char *checksum, *key;
+  cairo_surface_t *surface;
+
+  if (!g_variant_is_of_type (image_data, G_VARIANT_TYPE ("(iiibiiay)")))
+    return NULL;
+
+  g_variant_get (image_data, "(iiibii@ay)", &width, &height, &rowstride,
+                 &has_alpha, &bits_per_sample, &n_channels, &bytes);
+  data = g_variant_get_fixed_array (bytes, &len, 1);
+
+  if (width <= 0 || height <= 0 || bits_per_sample != 8 ||
+      n_channels != (has_alpha ? 4 : 3) ||
+      rowstride < width * n_channels ||
+      len < (gsize)(height - 1) * rowstride + width * n_channels) {
+    g_variant_unref (bytes);
+    return NULL;
+  }
+
+  /* Hashing is far cheaper than converting the pixels */
+  checksum = g_compute_checksum_for_data (G_CHECKSUM_MD5, data, len);
+  key = g_strdup_printf ("data:%dx%d:%d:%d:%s", width, height, rowstride,
+                         has_alpha, checksum);
+  g_free (checksum);
+
+  surface = cache_lookup (key);
+  if (surface == NULL) {
+    surface = decode_data (width, height, rowstride, has_alpha, n_channels, data);
+    if (surface)
+      cache_insert (key, surface);
+  }
+
+  g_free (key);
+  g_variant_unref (bytes);
+
+  return surface;
+}
+
+/* Load an image-path hint. Returns a new reference to the image, or NULL if
+   the path isn't a file name or URI, in which case it names an icon. */
+cairo_surface_t *
+mb_notify_image_from_path (const char *path)
+{
+  GStatBuf st;
+  GdkPixbuf *pixbuf;
+  GError *error = NULL;
+  cairo_surface_t *surface = NULL;
+  cairo_t *cr;
+  char *filename, *key;
+
+  if (g_str_has_prefix (path, "file://"))
+    filename = g_filename_from_uri (path, NULL, NULL);
+  else if (g_path_is_absolute (path))
+    filename = g_strdup (path);
+  else
+    return NULL;
+
+  if (filename == NULL || g_stat (filename, &st) != 0) {
+    g_free (filename);
+    return NULL;
+  }
+
+  /* The file might be rewritten with another image */
+  key = g_strdup_printf ("path:%s:%ld:%ld", filename,
+                         (long)st.st_mtime, (long)st.st_size);
+
+  surface = cache_lookup (key);
+  if (surface == NULL) {
+    pixbuf = gdk_pixbuf_new_from_file_at_size (filename,
+                                               MB_NOTIFY_IMAGE_SIZE,
+                                               MB_NOTIFY_IMAGE_SIZE,
+                                               &error);
+    if (pixbuf) {
+      surface = cairo_image_surface_create (CAIRO_FORMAT_ARGB32,
+                                            gdk_pixbuf_get_width (pixbuf),
+                                            gdk_pixbuf_get_height (pixbuf));
+      cr = cairo_create (surface);
+      gdk_cairo_set_source_pixbuf (cr, pixbuf, 0, 0);
+      cairo_paint (cr);
+      cairo_destroy (cr);
+      g_object_unref (pixbuf);
+
+      cache_insert (key, surface);
+    } else {
+      g_warning ("Cannot load image %s: %s", filename, error->message);
+      g_error_free (error);
+    }
+  }
+
+  g_free (key);
+  g_free (filename);
+
+  return surface;
+}
+
+void
+mb_notify_image_clear_cache (void)
+{
+  if (cache == NULL)
+    return;
+
+  g_queue_clear (&cache_order);
+  g_hash_table_destroy (cache);
+  cache = NULL;
+}
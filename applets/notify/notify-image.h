@@ -0,0 +1,20 @@
+#ifndef _MB_NOTIFY_IMAGE
+#define _MB_NOTIFY_IMAGE
+
+#include <gio/gio.h>
+#include <cairo.h>
+
+G_BEGIN_DECLS
+
+/* The largest image shown, bigger ones are scaled down */
+#define MB_NOTIFY_IMAGE_SIZE 48
+
+cairo_surface_t *mb_notify_image_from_data (GVariant *image_data);
+
+cairo_surface_t *mb_notify_image_from_path (const char *path);
+
+void mb_notify_image_clear_cache (void);
+
+G_END_DECLS
+
+#endif /* _MB_NOTIFY_IMAGE */
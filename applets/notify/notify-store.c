@@ -7,11 +7,11 @@
  */
 
 #include <config.h>
+#include <string.h>
 
 #include "notify-store.h"
-#include <dbus/dbus-glib.h>
-#include <dbus/dbus-glib-bindings.h>
-#include <gtk/gtk.h>
+#include "notify-image.h"
+#include <gio/gio.h>
 #include "marshal.h"
 
 G_DEFINE_TYPE (MbNotifyStore, mb_notify_store, G_TYPE_OBJECT);
@@ -29,15 +29,120 @@ static guint signals[N_SIGNALS];
 
 #define DEFAULT_TIMEOUT 3000
 
+#define NOTIFICATIONS_NAME "org.freedesktop.Notifications"
+#define NOTIFICATIONS_PATH "/org/freedesktop/Notifications"
+#define NOTIFICATIONS_INTERFACE "org.freedesktop.Notifications"
+#define STATS_INTERFACE "org.matchbox_project.Notifications"
+
+static const char introspection_xml[] =
+  "<node>"
+  "  <interface name='" NOTIFICATIONS_INTERFACE "'>"
+  "    <method name='Notify'>"
+  "      <arg type='s' name='app_name' direction='in'/>"
+  "      <arg type='u' name='id' direction='in'/>"
+  "      <arg type='s' name='icon' direction='in'/>"
+  "      <arg type='s' name='summary' direction='in'/>"
+  "      <arg type='s' name='body' direction='in'/>"
+  "      <arg type='as' name='actions' direction='in'/>"
+  "      <arg type='a{sv}' name='hints' direction='in'/>"
+  "      <arg type='i' name='timeout' direction='in'/>"
+  "      <arg type='u' name='return_id' direction='out'/>"
+  "    </method>"
+  "    <method name='CloseNotification'>"
+  "      <arg type='u' name='id' direction='in'/>"
+  "    </method>"
+  "    <method name='GetCapabilities'>"
+  "      <arg type='as' name='caps' direction='out'/>"
+  "    </method>"
+  "    <method name='GetServerInformation'>"
+  "      <arg type='s' name='name' direction='out'/>"
+  "      <arg type='s' name='vendor' direction='out'/>"
+  "      <arg type='s' name='version' direction='out'/>"
+  "      <arg type='s' name='spec_version' direction='out'/>"
+  "    </method>"
+  "    <signal name='NotificationClosed'>"
+  "      <arg type='u' name='id'/>"
+  "      <arg type='u' name='reason'/>"
+  "    </signal>"
+  "  </interface>"
+  "  <interface name='" STATS_INTERFACE "'>"
+  "    <method name='GetStats'>"
+  "      <arg type='u' name='received' direction='out'/>"
+  "      <arg type='u' name='dropped' direction='out'/>"
+  "      <arg type='u' name='merged' direction='out'/>"
+  "    </method>"
+  "    <method name='GetLatencies'>"
+  "      <arg type='a(yuxx)' name='latencies' direction='out'/>"
+  "    </method>"
+  "  </interface>"
+  "</node>";
+
+static GDBusNodeInfo *introspection_data;
+
+/* Each application can send a burst of RATE_LIMIT_BURST new notifications,
+   then one every RATE_LIMIT_INTERVAL milliseconds. */
+#define RATE_LIMIT_BURST 10
+#define RATE_LIMIT_INTERVAL 1000
+
+/* The most applications whose state is kept. Idle ones are forgotten when
+   the table is full, and if none is idle new applications are refused until
+   one is, so that varying the application name neither gets around the rate
+   limit nor uses memory without bound. */
+#define MAX_APPS 64
+
+/* Low urgency notifications are deferred when there are this many already:
+   they wait behind the others, and only start to expire once shown */
+#define LOW_URGENCY_LOAD 20
+
+/* Past this many, new low urgency notifications are dropped, as deferring
+   them would otherwise let the queue grow without bound */
+#define LOW_URGENCY_LIMIT (2 * LOW_URGENCY_LOAD)
+
+/* Expiry times are rounded up to a multiple of this, in milliseconds, so
+   that notifications which expire at about the same time are closed
+   together */
+#define EXPIRY_TICK 100
+
 typedef struct {
-  guint next_id;
-  GList *notifications;
-} MbNotifyStorePrivate;
+  /* Token bucket for new notifications */
+  gdouble tokens;
+  gint64 last_refill;
+  /* The last notification, which identical ones are merged into */
+  guint last_id;
+} AppState;
 
 typedef struct {
-  MbNotifyStore *notify;
-  guint id;
-} TimeoutData;
+  guint next_id;
+  /* ID to Notification */
+  GHashTable *notifications;
+  /* The notifications in display order, linked through Notification.link */
+  GQueue queue;
+  MbNotifyStoreOrder order;
+  /* The last notification of each group in the queue, so that inserting
+     keeps the groups together without walking the queue */
+  GList *urgency_tails[UrgencyCritical + 1];
+  GHashTable *app_tails;
+  /* Application name to AppState */
+  GHashTable *apps;
+  guint n_received;
+  guint n_dropped;
+  guint n_merged;
+  /* Min-heap of the notifications which expire, by expiry time */
+  GPtrArray *expiry_heap;
+  guint expiry_source;
+  gint64 expiry_deadline;
+  gboolean expiring;
+  /* Time from Notify to the notification being shown, per urgency */
+  struct {
+    guint count;
+    gint64 total;
+    gint64 max;
+  } latency[UrgencyCritical + 1];
+  MbNotifyHistory *history;
+  GDBusConnection *connection;
+  guint owner_id;
+  guint registration_ids[2];
+} MbNotifyStorePrivate;
 
 static guint
 get_next_id (MbNotifyStore *notify)
@@ -50,36 +155,398 @@ get_next_id (MbNotifyStore *notify)
 static gboolean
 find_notification (MbNotifyStore *notify, guint id, Notification **found)
 {
-  /* TODO: should this return a GList*? */
   MbNotifyStorePrivate *priv = GET_PRIVATE (notify);
-  GList *l;
 
-  for (l = priv->notifications; l ; l = l->next) {
-    Notification *notification = l->data;
-    if (notification->id == id) {
-      *found = notification;
-      return TRUE;
-    }
-  }
-  
-  return FALSE;
+  *found = g_hash_table_lookup (priv->notifications, GUINT_TO_POINTER (id));
+
+  return *found != NULL;
 }
 
 static void
 free_notification (Notification *n)
 {
+  g_free (n->app_name);
   g_free (n->summary);
   g_free (n->body);
   g_free (n->icon_name);
-  g_source_remove (n->timeout_id);
+  if (n->image)
+    cairo_surface_destroy (n->image);
   g_slice_free (Notification, n);
 }
 
+/* An application is idle when its bucket has refilled and its last
+   notification is gone, forgetting it then changes nothing */
+static gboolean
+app_is_idle (gpointer key, gpointer value, gpointer user_data)
+{
+  MbNotifyStorePrivate *priv = user_data;
+  AppState *app = value;
+  gdouble tokens;
+
+  tokens = app->tokens + (g_get_monotonic_time () - app->last_refill)
+    / (RATE_LIMIT_INTERVAL * 1000.0);
+
+  return tokens >= RATE_LIMIT_BURST &&
+    !g_hash_table_contains (priv->notifications, GUINT_TO_POINTER (app->last_id));
+}
+
+/* Returns NULL if too many applications are busy to track another one */
+static AppState *
+get_app_state (MbNotifyStorePrivate *priv, const char *app_name)
+{
+  AppState *app;
+
+  app = g_hash_table_lookup (priv->apps, app_name);
+  if (app == NULL) {
+    if (g_hash_table_size (priv->apps) >= MAX_APPS &&
+        g_hash_table_foreach_remove (priv->apps, app_is_idle, priv) == 0)
+      return NULL;
+
+    app = g_slice_new0 (AppState);
+    app->tokens = RATE_LIMIT_BURST;
+    app->last_refill = g_get_monotonic_time ();
+    g_hash_table_insert (priv->apps, g_strdup (app_name), app);
+  }
+
+  return app;
+}
+
+static void
+free_app_state (AppState *app)
+{
+  g_slice_free (AppState, app);
+}
+
+/* Take a token from the application's bucket, returning FALSE if it is
+   sending too fast */
 static gboolean
-notification_timeout (TimeoutData *data)
+app_admit (AppState *app)
+{
+  gint64 now;
+
+  now = g_get_monotonic_time ();
+  app->tokens = MIN (RATE_LIMIT_BURST,
+                     app->tokens + (now - app->last_refill)
+                     / (RATE_LIMIT_INTERVAL * 1000.0));
+  app->last_refill = now;
+
+  if (app->tokens < 1.0)
+    return FALSE;
+
+  app->tokens -= 1.0;
+  return TRUE;
+}
+
+static MbNotifyStoreUrgency
+get_urgency (GVariant *hints)
+{
+  GVariant *value;
+  gint urgency;
+
+  value = g_variant_lookup_value (hints, "urgency", NULL);
+  if (value == NULL)
+    return UrgencyNormal;
+
+  if (g_variant_is_of_type (value, G_VARIANT_TYPE_BYTE))
+    urgency = g_variant_get_byte (value);
+  else if (g_variant_is_of_type (value, G_VARIANT_TYPE_INT32))
+    urgency = g_variant_get_int32 (value);
+  else if (g_variant_is_of_type (value, G_VARIANT_TYPE_UINT32))
+    urgency = MIN (g_variant_get_uint32 (value), UrgencyCritical);
+  else
+    urgency = UrgencyNormal;
+
+  g_variant_unref (value);
+
+  return CLAMP (urgency, UrgencyLow, UrgencyCritical);
+}
+
+static GVariant *
+lookup_hint (GVariant *hints, const char *name, const char *old_name,
+             const GVariantType *type)
+{
+  GVariant *value;
+
+  value = g_variant_lookup_value (hints, name, type);
+  if (value == NULL && old_name)
+    value = g_variant_lookup_value (hints, old_name, type);
+
+  return value;
+}
+
+/* Use the image-data hint, or the image-path one, over the application
+   icon. The older names from version 1.1 of the spec are accepted too. */
+static void
+set_image (Notification *n, GVariant *hints)
+{
+  GVariant *value;
+  const char *path;
+
+  value = lookup_hint (hints, "image-data", "image_data",
+                       G_VARIANT_TYPE ("(iiibiiay)"));
+  if (value == NULL)
+    value = g_variant_lookup_value (hints, "icon_data",
+                                    G_VARIANT_TYPE ("(iiibiiay)"));
+  if (value) {
+    n->image = mb_notify_image_from_data (value);
+    g_variant_unref (value);
+    if (n->image)
+      return;
+  }
+
+  value = lookup_hint (hints, "image-path", "image_path", G_VARIANT_TYPE_STRING);
+  if (value) {
+    path = g_variant_get_string (value, NULL);
+
+    /* The path can also be an icon name */
+    if (g_path_is_absolute (path) || g_str_has_prefix (path, "file://")) {
+      n->image = mb_notify_image_from_path (path);
+    } else if (path[0]) {
+      g_free (n->icon_name);
+      n->icon_name = g_strdup (path);
+    }
+
+    g_variant_unref (value);
+  }
+}
+
+static void
+queue_insert_after (GQueue *queue, GList *sibling, GList *link)
 {
-  mb_notify_store_close (data->notify, data->id, ClosedExpired);
-  g_slice_free (TimeoutData, data);
+  link->prev = sibling;
+  link->next = sibling->next;
+  if (sibling->next)
+    sibling->next->prev = link;
+  else
+    queue->tail = link;
+  sibling->next = link;
+  queue->length++;
+}
+
+/* Insert the notification at the end of its group. Critical notifications
+   always come first and low urgency ones last, the order only applies within
+   an urgency level. */
+static void
+queue_insert (MbNotifyStorePrivate *priv, Notification *n)
+{
+  GList *sibling = NULL;
+  gboolean by_app;
+  int i;
+
+  n->link.data = n;
+
+  by_app = priv->order == OrderApp && n->urgency == UrgencyNormal;
+
+  /* Applications are in the order they first notified */
+  if (by_app)
+    sibling = g_hash_table_lookup (priv->app_tails, n->app_name);
+
+  /* Go after the same or the next more urgent level, or at the head if there
+     is none */
+  for (i = n->urgency; i <= UrgencyCritical && sibling == NULL; i++)
+    sibling = priv->urgency_tails[i];
+
+  if (sibling)
+    queue_insert_after (&priv->queue, sibling, &n->link);
+  else
+    g_queue_push_head_link (&priv->queue, &n->link);
+
+  if (n->link.next == NULL ||
+      ((Notification *)n->link.next->data)->urgency != n->urgency)
+    priv->urgency_tails[n->urgency] = &n->link;
+
+  if (by_app)
+    g_hash_table_replace (priv->app_tails, n->app_name, &n->link);
+}
+
+static void
+queue_remove (MbNotifyStorePrivate *priv, Notification *n)
+{
+  Notification *prev = n->link.prev ? n->link.prev->data : NULL;
+
+  if (priv->urgency_tails[n->urgency] == &n->link)
+    priv->urgency_tails[n->urgency] =
+      (prev && prev->urgency == n->urgency) ? &prev->link : NULL;
+
+  if (priv->order == OrderApp && n->urgency == UrgencyNormal &&
+      g_hash_table_lookup (priv->app_tails, n->app_name) == &n->link) {
+    if (prev && prev->urgency == UrgencyNormal &&
+        strcmp (prev->app_name, n->app_name) == 0)
+      g_hash_table_replace (priv->app_tails, prev->app_name, &prev->link);
+    else
+      g_hash_table_remove (priv->app_tails, n->app_name);
+  }
+
+  g_queue_unlink (&priv->queue, &n->link);
+}
+
+static gint
+id_compare (gconstpointer a, gconstpointer b)
+{
+  const Notification *na = a, *nb = b;
+  return (na->id > nb->id) - (na->id < nb->id);
+}
+
+/*
+ * Expiry. All the notifications which expire are kept in a binary min-heap
+ * and a single timeout is armed for the earliest one.
+ */
+
+static inline Notification *
+heap_get (GPtrArray *heap, guint i)
+{
+  return g_ptr_array_index (heap, i);
+}
+
+static inline void
+heap_set (GPtrArray *heap, guint i, Notification *n)
+{
+  g_ptr_array_index (heap, i) = n;
+  n->heap_index = i;
+}
+
+static void
+heap_sift_up (GPtrArray *heap, guint i)
+{
+  Notification *n = heap_get (heap, i);
+
+  while (i > 0) {
+    guint parent = (i - 1) / 2;
+
+    if (heap_get (heap, parent)->expires <= n->expires)
+      break;
+
+    heap_set (heap, i, heap_get (heap, parent));
+    i = parent;
+  }
+
+  heap_set (heap, i, n);
+}
+
+static void
+heap_sift_down (GPtrArray *heap, guint i)
+{
+  Notification *n = heap_get (heap, i);
+
+  for (;;) {
+    guint child = 2 * i + 1;
+
+    if (child >= heap->len)
+      break;
+    if (child + 1 < heap->len &&
+        heap_get (heap, child + 1)->expires < heap_get (heap, child)->expires)
+      child++;
+    if (n->expires <= heap_get (heap, child)->expires)
+      break;
+
+    heap_set (heap, i, heap_get (heap, child));
+    i = child;
+  }
+
+  heap_set (heap, i, n);
+}
+
+static void
+heap_remove (GPtrArray *heap, Notification *n)
+{
+  guint i = n->heap_index;
+  Notification *last;
+
+  last = g_ptr_array_index (heap, heap->len - 1);
+  g_ptr_array_set_size (heap, heap->len - 1);
+
+  if (last != n) {
+    heap_set (heap, i, last);
+    heap_sift_up (heap, i);
+    heap_sift_down (heap, last->heap_index);
+  }
+}
+
+static gboolean expiry_timeout (MbNotifyStore *notify);
+
+/* Arm the timeout for the earliest expiry, if it changed */
+static void
+expiry_schedule (MbNotifyStore *notify)
+{
+  MbNotifyStorePrivate *priv = GET_PRIVATE (notify);
+  gint64 deadline, now;
+
+  /* Wait until all of the due notifications have been closed */
+  if (priv->expiring)
+    return;
+
+  deadline = priv->expiry_heap->len ? heap_get (priv->expiry_heap, 0)->expires : 0;
+
+  if (priv->expiry_source && deadline == priv->expiry_deadline)
+    return;
+
+  if (priv->expiry_source) {
+    g_source_remove (priv->expiry_source);
+    priv->expiry_source = 0;
+  }
+
+  priv->expiry_deadline = deadline;
+  if (deadline == 0)
+    return;
+
+  now = g_get_monotonic_time ();
+  priv->expiry_source = g_timeout_add (deadline > now ? (deadline - now + 999) / 1000 : 0,
+                                       (GSourceFunc)expiry_timeout, notify);
+}
+
+static void
+expiry_add (MbNotifyStore *notify, Notification *n, gint timeout)
+{
+  MbNotifyStorePrivate *priv = GET_PRIVATE (notify);
+  gint64 expires;
+
+  expires = g_get_monotonic_time () + (gint64)timeout * 1000;
+  /* Round up to the next tick */
+  expires += EXPIRY_TICK * 1000 - 1;
+  expires -= expires % (EXPIRY_TICK * 1000);
+
+  n->expires = expires;
+  g_ptr_array_add (priv->expiry_heap, n);
+  heap_set (priv->expiry_heap, priv->expiry_heap->len - 1, n);
+  heap_sift_up (priv->expiry_heap, n->heap_index);
+
+  expiry_schedule (notify);
+}
+
+static void
+expiry_remove (MbNotifyStore *notify, Notification *n)
+{
+  MbNotifyStorePrivate *priv = GET_PRIVATE (notify);
+
+  if (n->expires == 0)
+    return;
+
+  heap_remove (priv->expiry_heap, n);
+  n->expires = 0;
+
+  expiry_schedule (notify);
+}
+
+static gboolean
+expiry_timeout (MbNotifyStore *notify)
+{
+  MbNotifyStorePrivate *priv = GET_PRIVATE (notify);
+  gint64 now;
+
+  priv->expiry_source = 0;
+
+  /* Close everything which is due in one go */
+  priv->expiring = TRUE;
+  now = g_get_monotonic_time ();
+  while (priv->expiry_heap->len &&
+         heap_get (priv->expiry_heap, 0)->expires <= now) {
+    mb_notify_store_close (notify, heap_get (priv->expiry_heap, 0)->id,
+                           ClosedExpired);
+  }
+  priv->expiring = FALSE;
+
+  expiry_schedule (notify);
+
   return FALSE;
 }
 
@@ -88,96 +555,243 @@ notification_timeout (TimeoutData *data)
  * Notification Manager implementation.
  */
 
-/* TODO: make this async so we can store the sender, and then target the
-   NotificationClosed signal? */
-static gboolean
+static guint
 notification_manager_notify (MbNotifyStore *notify,
                              const gchar *app_name, const guint id,
                              const gchar *icon, const gchar *summary,
-                             const gchar *body,
-                             const gchar **actions, GHashTable *hints,
-                             gint timeout, guint *new_id, GError *error)
+                             const gchar *body, GVariant *hints,
+                             gint timeout)
 {
   MbNotifyStorePrivate *priv = GET_PRIVATE (notify);
   Notification *notification;
+  MbNotifyStoreUrgency urgency;
+  AppState *app;
+  gboolean found, deferred;
 
-  /* TODO: Sanity check the required arguments */
-  
-  if (find_notification (notify, id, &notification)) {
+  urgency = get_urgency (hints);
+  deferred = urgency == UrgencyLow && priv->queue.length >= LOW_URGENCY_LOAD;
+
+  priv->n_received++;
+  app = get_app_state (priv, app_name);
+
+  /* Critical notifications are never merged or rate limited */
+  found = find_notification (notify, id, &notification);
+  if (found) {
+    notification->count = 1;
+  } else if (urgency != UrgencyCritical && app && app->last_id &&
+             find_notification (notify, app->last_id, &notification) &&
+             notification->urgency == urgency &&
+             g_strcmp0 (notification->summary, summary) == 0) {
+    /* The same as the application's last notification, so replace that and
+       count the repeats instead of adding another one. Only at the same
+       urgency, so nothing merges into a critical notification. */
+    notification->count++;
+    priv->n_merged++;
+    found = TRUE;
+  } else if (urgency == UrgencyLow && priv->queue.length >= LOW_URGENCY_LIMIT) {
+    priv->n_dropped++;
+    return get_next_id (notify);
+  } else if (urgency != UrgencyCritical && (app == NULL || !app_admit (app))) {
+    /* Drop it, but still give the client an ID */
+    priv->n_dropped++;
+    return get_next_id (notify);
+  }
+
+  if (found) {
     /* Found an existing notification, clear it */
     g_free (notification->summary);
     g_free (notification->body);
     g_free (notification->icon_name);
+    if (notification->image) {
+      cairo_surface_destroy (notification->image);
+      notification->image = NULL;
+    }
+    expiry_remove (notify, notification);
+    notification->deferred_timeout = 0;
+
+    /* Replacing keeps the position, unless it moved to another group */
+    if (urgency != notification->urgency ||
+        strcmp (app_name, notification->app_name) != 0) {
+      queue_remove (priv, notification);
+      g_free (notification->app_name);
+      notification->app_name = g_strdup (app_name);
+      notification->urgency = urgency;
+      queue_insert (priv, notification);
+    }
   } else {
     /* This is a new notification, create a new structure and allocate an ID */
     notification = g_slice_new0 (Notification);
     notification->id = get_next_id (notify);
-    /* TODO: use _insert_sorted with some magic sorting algorithm */
-    priv->notifications = g_list_append (priv->notifications, notification);
+    notification->app_name = g_strdup (app_name);
+    notification->urgency = urgency;
+    notification->count = 1;
+    g_hash_table_insert (priv->notifications,
+                         GUINT_TO_POINTER (notification->id), notification);
+    queue_insert (priv, notification);
   }
 
   notification->summary = g_strdup (summary);
   notification->body = g_strdup (body);
-  notification->icon_name = g_strdup (icon);
+  /* D-Bus strings can't be NULL, so no icon is an empty string */
+  notification->icon_name = icon[0] ? g_strdup (icon) : NULL;
+  set_image (notification, hints);
+
+  if (app)
+    app->last_id = notification->id;
+  notification->notified = g_get_monotonic_time ();
 
-  /* A timeout of -1 means implementation defined */
+  /* A timeout of -1 means implementation defined, critical notifications
+     stay until they are dismissed */
   if (timeout == -1)
-    timeout = DEFAULT_TIMEOUT;
+    timeout = urgency == UrgencyCritical ? 0 : DEFAULT_TIMEOUT;
   
-  if (timeout) {
-    /* This struct is a bit annoying, maybe add a store pointer to the
-       Notification struct? */
-    TimeoutData *data;
-    data = g_slice_new (TimeoutData);
-    data->notify = notify;
-    data->id = notification->id;
-    notification->timeout_id = g_timeout_add
-      (timeout, (GSourceFunc)notification_timeout, data);
-  }
+  if (timeout > 0 && deferred)
+    notification->deferred_timeout = timeout;
+  else if (timeout > 0)
+    expiry_add (notify, notification, timeout);
   
   g_signal_emit (notify, signals[NOTIFICATION_ADDED], 0, notification);
   
-  *new_id = notification->id;
-  return TRUE;
+  return notification->id;
 }
 
-static gboolean
-notification_manager_close_notification (MbNotifyStore *notify, guint id, GError **error)
+static void
+handle_method_call (GDBusConnection *connection,
+                    const gchar *sender,
+                    const gchar *object_path,
+                    const gchar *interface_name,
+                    const gchar *method_name,
+                    GVariant *parameters,
+                    GDBusMethodInvocation *invocation,
+                    gpointer user_data)
 {
-  if (mb_notify_store_close (notify, id, ClosedProgramatically)) {
-    return TRUE;
-  } else {
-    g_set_error (error, g_quark_from_static_string("NotifyStore"), 0, "Unknown notification ID %d", id);
-    return FALSE;
+  MbNotifyStore *notify = MB_NOTIFY_STORE (user_data);
+
+  if (g_strcmp0 (method_name, "Notify") == 0) {
+    const gchar *app_name, *icon, *summary, *body;
+    GVariant *hints;
+    guint id;
+    gint timeout;
+
+    /* Borrow the strings and the hints from the message instead of copying
+       them, the actions aren't supported */
+    g_variant_get (parameters, "(&su&s&s&sas@a{sv}i)",
+                   &app_name, &id, &icon, &summary, &body,
+                   NULL, &hints, &timeout);
+
+    id = notification_manager_notify (notify, app_name, id, icon, summary,
+                                      body, hints, timeout);
+    g_variant_unref (hints);
+
+    g_dbus_method_invocation_return_value (invocation,
+                                           g_variant_new ("(u)", id));
+  } else if (g_strcmp0 (method_name, "CloseNotification") == 0) {
+    guint id;
+
+    g_variant_get (parameters, "(u)", &id);
+
+    if (mb_notify_store_close (notify, id, ClosedProgramatically))
+      g_dbus_method_invocation_return_value (invocation, NULL);
+    else
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                                             G_DBUS_ERROR_INVALID_ARGS,
+                                             "Unknown notification ID %u", id);
+  } else if (g_strcmp0 (method_name, "GetCapabilities") == 0) {
+    /* The image hints don't have a capability, the spec version in
+       GetServerInformation says that they are supported */
+    static const gchar *caps[] = {
+      "body",
+      "body-markup",
+      "icon-static",
+    };
+
+    g_dbus_method_invocation_return_value
+      (invocation, g_variant_new ("(@as)",
+                                  g_variant_new_strv (caps, G_N_ELEMENTS (caps))));
+  } else if (g_strcmp0 (method_name, "GetServerInformation") == 0) {
+    g_dbus_method_invocation_return_value
+      (invocation, g_variant_new ("(ssss)",
+                                  "Matchbox Panel Notification Manager",
+                                  "OpenedHand",
+                                  VERSION,
+                                  "1.2"));
+  } else if (g_strcmp0 (method_name, "GetStats") == 0) {
+    guint received, dropped, merged;
+
+    mb_notify_store_get_stats (notify, &received, &dropped, &merged);
+
+    g_dbus_method_invocation_return_value
+      (invocation, g_variant_new ("(uuu)", received, dropped, merged));
+  } else if (g_strcmp0 (method_name, "GetLatencies") == 0) {
+    GVariantBuilder builder;
+    guint urgency, count;
+    gint64 mean, max;
+
+    /* Urgency, how many were shown, mean and max latency in microseconds */
+    g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(yuxx)"));
+    for (urgency = UrgencyLow; urgency <= UrgencyCritical; urgency++) {
+      mb_notify_store_get_latency (notify, urgency, &count, &mean, &max);
+      g_variant_builder_add (&builder, "(yuxx)", urgency, count, mean, max);
+    }
+
+    g_dbus_method_invocation_return_value
+      (invocation, g_variant_new ("(a(yuxx))", &builder));
   }
 }
 
-static gboolean
-notification_manager_get_capabilities (MbNotifyStore *notify, gchar ***caps, GError *error)
+static const GDBusInterfaceVTable interface_vtable = {
+  handle_method_call,
+  NULL,
+  NULL
+};
+
+static void
+on_bus_acquired (GDBusConnection *connection, const gchar *name, gpointer user_data)
 {
-  *caps = g_new0 (gchar *, 4);
-  
-  (*caps)[0] = g_strdup ("body");
-  (*caps)[1] = g_strdup ("body-markup");
-  (*caps)[2] = g_strdup ("icon-static");
-  (*caps)[3] = NULL;
-  
-  return TRUE;
+  MbNotifyStore *self = MB_NOTIFY_STORE (user_data);
+  MbNotifyStorePrivate *priv = GET_PRIVATE (self);
+  GError *error = NULL;
+  guint i;
+
+  priv->connection = g_object_ref (connection);
+
+  for (i = 0; i < G_N_ELEMENTS (priv->registration_ids); i++) {
+    priv->registration_ids[i] = g_dbus_connection_register_object
+      (connection, NOTIFICATIONS_PATH,
+       introspection_data->interfaces[i],
+       &interface_vtable, self, NULL, &error);
+
+    if (priv->registration_ids[i] == 0) {
+      g_warning ("Cannot register object: %s", error->message);
+      g_clear_error (&error);
+    }
+  }
 }
 
-static gboolean
-notification_manager_get_server_information (MbNotifyStore *notify,
-                                             gchar **name,
-                                             gchar **vendor,
-                                             gchar **version,
-                                             gchar **spec_version,
-                                             GError *error)
-{
-  *name = g_strdup ("Matchbox Panel Notification Manager");
-  *vendor = g_strdup ("OpenedHand");
-  *version = g_strdup (VERSION);
-  *spec_version = g_strdup ("1.0");
-  return TRUE;
+static void
+on_name_lost (GDBusConnection *connection, const gchar *name, gpointer user_data)
+{
+  if (connection == NULL)
+    g_warning ("Cannot connect to DBus");
+  else
+    g_printerr ("Notification manager already running, not taking over\n");
+}
+
+static void
+connect_to_dbus (MbNotifyStore *self)
+{
+  MbNotifyStorePrivate *priv = GET_PRIVATE (self);
+
+  /* Owning the name is asynchronous, so creating the store never blocks on
+     the bus. If another notification manager has the name then this one
+     waits in the queue for it. */
+  priv->owner_id = g_bus_own_name (G_BUS_TYPE_SESSION,
+                                   NOTIFICATIONS_NAME,
+                                   G_BUS_NAME_OWNER_FLAGS_NONE,
+                                   on_bus_acquired,
+                                   NULL,
+                                   on_name_lost,
+                                   self, NULL);
 }
 
 
@@ -190,13 +804,35 @@ mb_notify_store_finalize (GObject *object)
 {
   MbNotifyStorePrivate *priv = GET_PRIVATE (object);
 
-  g_list_foreach (priv->notifications, (GFunc)free_notification, NULL);
-  g_list_free (priv->notifications);
-  
+  Notification *n;
+
+  while ((n = g_queue_peek_head (&priv->queue))) {
+    g_queue_unlink (&priv->queue, &n->link);
+    free_notification (n);
+  }
+  g_hash_table_destroy (priv->notifications);
+  g_hash_table_destroy (priv->app_tails);
+  g_hash_table_destroy (priv->apps);
+  g_ptr_array_free (priv->expiry_heap, TRUE);
+  if (priv->expiry_source)
+    g_source_remove (priv->expiry_source);
+
+  mb_notify_history_close (priv->history);
+
+  g_bus_unown_name (priv->owner_id);
+  if (priv->connection) {
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS (priv->registration_ids); i++)
+      if (priv->registration_ids[i])
+        g_dbus_connection_unregister_object (priv->connection,
+                                             priv->registration_ids[i]);
+    g_object_unref (priv->connection);
+  }
+
   G_OBJECT_CLASS (mb_notify_store_parent_class)->finalize (object);
 }
 
-#include "notification-manager-glue.h"
 static void
 mb_notify_store_class_init (MbNotifyStoreClass *klass)
 {
@@ -223,52 +859,24 @@ mb_notify_store_class_init (MbNotifyStoreClass *klass)
                   NULL, NULL,
                   mb_marshal_VOID__UINT_UINT,
                   G_TYPE_NONE, 2, G_TYPE_UINT, G_TYPE_UINT);
-  
-  dbus_g_object_type_install_info (G_TYPE_FROM_CLASS (klass),
-                                   &dbus_glib_notification_manager_object_info);
-}
-
-static void
-connect_to_dbus (MbNotifyStore *self)
-{
-  DBusGConnection *connection;
-  DBusGProxy *bus_proxy;
-  GError *error = NULL;
-  guint32 request_name_ret;
 
-  connection = dbus_g_bus_get (DBUS_BUS_SESSION, &error);
-  if (!connection) {
-    g_warning ("Cannot connect to DBus: %s", error->message);
-    g_error_free (error);
-    return;
-  }
-
-  bus_proxy = dbus_g_proxy_new_for_name (connection,
-                                         DBUS_SERVICE_DBUS,
-                                         DBUS_PATH_DBUS,
-                                         DBUS_INTERFACE_DBUS);
-  
-  if (!org_freedesktop_DBus_request_name (bus_proxy, "org.freedesktop.Notifications",
-                                          DBUS_NAME_FLAG_DO_NOT_QUEUE,
-                                          &request_name_ret, &error)) {
-    g_warning ("Cannot request name: %s", error->message);
-    g_error_free (error);
-    return;
-  }
-  
-  if (request_name_ret == DBUS_REQUEST_NAME_REPLY_EXISTS) {
-    g_printerr ("Notification manager already running, not taking over\n");
-    return;
-  }
-  
-  dbus_g_connection_register_g_object (connection,
-                                       "/org/freedesktop/Notifications",
-                                       G_OBJECT (self));
+  introspection_data = g_dbus_node_info_new_for_xml (introspection_xml, NULL);
+  g_assert (introspection_data != NULL);
 }
 
 static void
 mb_notify_store_init (MbNotifyStore *self)
 {
+  MbNotifyStorePrivate *priv = GET_PRIVATE (self);
+
+  priv->notifications = g_hash_table_new (NULL, NULL);
+  g_queue_init (&priv->queue);
+  priv->app_tails = g_hash_table_new (g_str_hash, g_str_equal);
+  priv->apps = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                      g_free, (GDestroyNotify)free_app_state);
+  priv->expiry_heap = g_ptr_array_new ();
+  priv->history = mb_notify_history_open (NULL);
+
   connect_to_dbus (self);
 }
 
@@ -285,11 +893,151 @@ mb_notify_store_close (MbNotifyStore *notify, guint id, MbNotifyStoreCloseReason
   Notification *notification;
 
   if (find_notification (notify, id, &notification)) {
-    priv->notifications = g_list_remove (priv->notifications, notification);
+    g_hash_table_remove (priv->notifications, GUINT_TO_POINTER (id));
+    queue_remove (priv, notification);
+    expiry_remove (notify, notification);
+    if (priv->history)
+      mb_notify_history_append (priv->history, notification->id,
+                                notification->urgency, reason,
+                                notification->app_name,
+                                notification->summary,
+                                notification->body);
     free_notification (notification);
     g_signal_emit (notify, signals[NOTIFICATION_CLOSED], 0, id, reason);
+
+    if (priv->connection)
+      g_dbus_connection_emit_signal (priv->connection, NULL,
+                                     NOTIFICATIONS_PATH,
+                                     NOTIFICATIONS_INTERFACE,
+                                     "NotificationClosed",
+                                     g_variant_new ("(uu)", id, reason),
+                                     NULL);
     return TRUE;
   } else {
     return FALSE;
   }
 }
+
+/* Changing the order sorts the existing notifications again, but doesn't
+   emit any signals. IDs are allocated in order so they give the arrival
+   order. */
+void
+mb_notify_store_set_order (MbNotifyStore *notify, MbNotifyStoreOrder order)
+{
+  MbNotifyStorePrivate *priv = GET_PRIVATE (notify);
+  GList *notifications, *l;
+
+  if (priv->order == order)
+    return;
+
+  notifications = g_list_sort (g_list_copy (priv->queue.head), id_compare);
+
+  g_queue_init (&priv->queue);
+  memset (priv->urgency_tails, 0, sizeof (priv->urgency_tails));
+  g_hash_table_remove_all (priv->app_tails);
+  priv->order = order;
+
+  for (l = notifications; l; l = l->next) {
+    Notification *n = l->data;
+    n->link.prev = n->link.next = NULL;
+    queue_insert (priv, n);
+  }
+
+  g_list_free (notifications);
+}
+
+Notification *
+mb_notify_store_lookup (MbNotifyStore *notify, guint id)
+{
+  Notification *notification;
+
+  return find_notification (notify, id, &notification) ? notification : NULL;
+}
+
+/* The notifications in display order. The list is owned by the store. */
+GList *
+mb_notify_store_get_notifications (MbNotifyStore *notify)
+{
+  MbNotifyStorePrivate *priv = GET_PRIVATE (notify);
+
+  return priv->queue.head;
+}
+
+guint
+mb_notify_store_get_length (MbNotifyStore *notify)
+{
+  MbNotifyStorePrivate *priv = GET_PRIVATE (notify);
+
+  return priv->queue.length;
+}
+
+/* How many notifications were received, dropped because the application was
+   sending too fast, and merged into an identical one */
+void
+mb_notify_store_get_stats (MbNotifyStore *notify,
+                           guint *received, guint *dropped, guint *merged)
+{
+  MbNotifyStorePrivate *priv = GET_PRIVATE (notify);
+
+  if (received)
+    *received = priv->n_received;
+  if (dropped)
+    *dropped = priv->n_dropped;
+  if (merged)
+    *merged = priv->n_merged;
+}
+
+/* The history of closed notifications, or NULL if it couldn't be opened */
+MbNotifyHistory *
+mb_notify_store_get_history (MbNotifyStore *notify)
+{
+  MbNotifyStorePrivate *priv = GET_PRIVATE (notify);
+
+  return priv->history;
+}
+
+/* Called by the view when it shows a notification, to measure the time
+   from Notify to the notification being visible and to start the expiry of
+   deferred notifications */
+void
+mb_notify_store_shown (MbNotifyStore *notify, Notification *notification)
+{
+  MbNotifyStorePrivate *priv = GET_PRIVATE (notify);
+  gint64 latency;
+
+  /* Deferred notifications only start to expire now */
+  if (notification->deferred_timeout) {
+    expiry_add (notify, notification, notification->deferred_timeout);
+    notification->deferred_timeout = 0;
+  }
+
+  if (notification->notified == 0)
+    return;
+
+  latency = g_get_monotonic_time () - notification->notified;
+  notification->notified = 0;
+
+  priv->latency[notification->urgency].count++;
+  priv->latency[notification->urgency].total += latency;
+  priv->latency[notification->urgency].max =
+    MAX (priv->latency[notification->urgency].max, latency);
+}
+
+/* How many notifications of the urgency were shown, and the mean and
+   maximum time it took, in microseconds */
+void
+mb_notify_store_get_latency (MbNotifyStore *notify, MbNotifyStoreUrgency urgency,
+                             guint *count, gint64 *mean, gint64 *max)
+{
+  MbNotifyStorePrivate *priv = GET_PRIVATE (notify);
+
+  g_return_if_fail (urgency <= UrgencyCritical);
+
+  if (count)
+    *count = priv->latency[urgency].count;
+  if (mean)
+    *mean = priv->latency[urgency].count ?
+      priv->latency[urgency].total / priv->latency[urgency].count : 0;
+  if (max)
+    *max = priv->latency[urgency].max;
+}
@@ -2,6 +2,8 @@
 #define _MB_NOTIFY_STORE
 
 #include <glib-object.h>
+#include <cairo.h>
+#include "notify-history.h"
 
 G_BEGIN_DECLS
 
@@ -27,14 +29,44 @@ G_BEGIN_DECLS
   (G_TYPE_INSTANCE_GET_CLASS ((obj), \
   MB_TYPE_NOTIFY_STORE, MbNotifyStoreClass))
 
+typedef enum {
+  UrgencyLow,
+  UrgencyNormal,
+  UrgencyCritical,
+} MbNotifyStoreUrgency;
+
 typedef struct {
   guint id;
+  char *app_name;
   char *summary;
   char *body;
   char *icon_name;
-  guint timeout_id;
+  /* From the image-data or image-path hints, shown instead of the icon */
+  cairo_surface_t *image;
+  MbNotifyStoreUrgency urgency;
+  /* How many identical notifications were merged into this one */
+  guint count;
+  /* Monotonic time the notification expires at, or 0 */
+  gint64 expires;
+  /* Monotonic time of the Notify call, until it is shown */
+  gint64 notified;
+  /* private: the timeout of a deferred notification, until it is shown */
+  gint deferred_timeout;
+  /* private: the notification's node in the store's ordered queue */
+  GList link;
+  /* private: the notification's index in the store's expiry heap */
+  guint heap_index;
 } Notification;
 
+/* The order within an urgency level: critical notifications are always
+   first and low urgency ones last, so OrderUrgency is the same as
+   OrderArrival. */
+typedef enum {
+  OrderArrival,
+  OrderUrgency,
+  OrderApp,
+} MbNotifyStoreOrder;
+
 typedef enum {
   ClosedExpired = 1,
   ClosedDismissed,
@@ -58,6 +90,24 @@ MbNotifyStore* mb_notify_store_new (void);
 
 gboolean mb_notify_store_close (MbNotifyStore *notify, guint id, MbNotifyStoreCloseReason reason);
 
+void mb_notify_store_set_order (MbNotifyStore *notify, MbNotifyStoreOrder order);
+
+Notification *mb_notify_store_lookup (MbNotifyStore *notify, guint id);
+
+GList *mb_notify_store_get_notifications (MbNotifyStore *notify);
+
+guint mb_notify_store_get_length (MbNotifyStore *notify);
+
+void mb_notify_store_get_stats (MbNotifyStore *notify,
+                                guint *received, guint *dropped, guint *merged);
+
+MbNotifyHistory *mb_notify_store_get_history (MbNotifyStore *notify);
+
+void mb_notify_store_shown (MbNotifyStore *notify, Notification *notification);
+
+void mb_notify_store_get_latency (MbNotifyStore *notify, MbNotifyStoreUrgency urgency,
+                                  guint *count, gint64 *mean, gint64 *max);
+
 G_END_DECLS
 
 #endif /* _MB_NOTIFY_STORE */
@@ -0,0 +1,481 @@
+/*
+ * Licensed under the GPL v2 or greater.
+ *
+ * Runs the notification store on a private session bus and talks to it over
+ * D-Bus like a client would.
+ */
+
+#include <config.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+#include "notify-store.h"
+
+#define NOTIFICATIONS_NAME "org.freedesktop.Notifications"
+#define NOTIFICATIONS_PATH "/org/freedesktop/Notifications"
+#define NOTIFICATIONS_INTERFACE "org.freedesktop.Notifications"
+#define STATS_INTERFACE "org.matchbox_project.Notifications"
+
+static GDBusConnection *connection;
+
+typedef struct {
+  MbNotifyStore *store;
+  GMainLoop *loop;
+  GVariant *reply;
+  GError *error;
+  guint closed_id, closed_reason;
+} Fixture;
+
+static void
+on_name_appeared (GDBusConnection *connection, const gchar *name,
+                  const gchar *owner, gpointer user_data)
+{
+  Fixture *fixture = user_data;
+
+  g_main_loop_quit (fixture->loop);
+}
+
+static void
+fixture_setup (Fixture *fixture, gconstpointer data)
+{
+  guint watch_id;
+
+  fixture->loop = g_main_loop_new (NULL, FALSE);
+  fixture->store = mb_notify_store_new ();
+
+  /* The name is owned asynchronously */
+  watch_id = g_bus_watch_name_on_connection (connection, NOTIFICATIONS_NAME,
+                                             G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                             on_name_appeared, NULL,
+                                             fixture, NULL);
+  g_main_loop_run (fixture->loop);
+  g_bus_unwatch_name (watch_id);
+}
+
+static void
+fixture_teardown (Fixture *fixture, gconstpointer data)
+{
+  g_object_unref (fixture->store);
+  g_main_loop_unref (fixture->loop);
+}
+
+static void
+call_done (GObject *source, GAsyncResult *result, gpointer user_data)
+{
+  Fixture *fixture = user_data;
+
+  fixture->reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source),
+                                                  result, &fixture->error);
+  g_main_loop_quit (fixture->loop);
+}
+
+/* The store runs in this main loop, so the calls have to be asynchronous */
+static GVariant *
+call (Fixture *fixture, const char *interface, const char *method,
+      GVariant *parameters, GError **error)
+{
+  fixture->reply = NULL;
+  fixture->error = NULL;
+
+  g_dbus_connection_call (connection, NOTIFICATIONS_NAME, NOTIFICATIONS_PATH,
+                          interface, method, parameters, NULL,
+                          G_DBUS_CALL_FLAGS_NONE, -1, NULL,
+                          call_done, fixture);
+  g_main_loop_run (fixture->loop);
+
+  if (error)
+    *error = fixture->error;
+  else
+    g_assert_no_error (fixture->error);
+
+  return fixture->reply;
+}
+
+static guint
+notify (Fixture *fixture, const char *app_name, guint id, const char *summary,
+        GVariant *hints)
+{
+  GVariant *reply;
+  guint new_id;
+
+  if (hints == NULL)
+    hints = g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0);
+
+  reply = call (fixture, NOTIFICATIONS_INTERFACE, "Notify",
+                g_variant_new ("(susss@as@a{sv}i)", app_name, id, "",
+                               summary, "", g_variant_new_strv (NULL, 0),
+                               hints, 0),
+                NULL);
+  g_variant_get (reply, "(u)", &new_id);
+  g_variant_unref (reply);
+
+  return new_id;
+}
+
+static void
+on_notification_closed (GDBusConnection *connection, const gchar *sender,
+                        const gchar *path, const gchar *interface,
+                        const gchar *signal, GVariant *parameters,
+                        gpointer user_data)
+{
+  Fixture *fixture = user_data;
+
+  g_variant_get (parameters, "(uu)", &fixture->closed_id, &fixture->closed_reason);
+  g_main_loop_quit (fixture->loop);
+}
+
+static void
+test_server_information (Fixture *fixture, gconstpointer data)
+{
+  GVariant *reply;
+  const char *name, *spec_version;
+
+  reply = call (fixture, NOTIFICATIONS_INTERFACE, "GetServerInformation",
+                NULL, NULL);
+  g_variant_get (reply, "(&s&s&s&s)", &name, NULL, NULL, &spec_version);
+  g_assert_cmpstr (name, ==, "Matchbox Panel Notification Manager");
+  g_assert_cmpstr (spec_version, ==, "1.2");
+  g_variant_unref (reply);
+}
+
+static void
+test_notify_close (Fixture *fixture, gconstpointer data)
+{
+  Notification *notification;
+  GError *error = NULL;
+  guint id, subscription;
+
+  id = notify (fixture, "test", 0, "Hello", NULL);
+  g_assert_cmpuint (id, >, 0);
+
+  notification = mb_notify_store_lookup (fixture->store, id);
+  g_assert (notification != NULL);
+  g_assert_cmpstr (notification->summary, ==, "Hello");
+  g_assert (notification->icon_name == NULL);
+
+  /* Replacing keeps the ID */
+  g_assert_cmpuint (notify (fixture, "test", id, "World", NULL), ==, id);
+  g_assert_cmpuint (mb_notify_store_get_length (fixture->store), ==, 1);
+  g_assert_cmpstr (notification->summary, ==, "World");
+
+  subscription = g_dbus_connection_signal_subscribe
+    (connection, NULL, NOTIFICATIONS_INTERFACE, "NotificationClosed",
+     NOTIFICATIONS_PATH, NULL, G_DBUS_SIGNAL_FLAGS_NONE,
+     on_notification_closed, fixture, NULL);
+
+  g_variant_unref (call (fixture, NOTIFICATIONS_INTERFACE, "CloseNotification",
+                         g_variant_new ("(u)", id), NULL));
+  g_assert (mb_notify_store_lookup (fixture->store, id) == NULL);
+
+  /* Wait for the signal */
+  g_main_loop_run (fixture->loop);
+  g_assert_cmpuint (fixture->closed_id, ==, id);
+  g_assert_cmpuint (fixture->closed_reason, ==, ClosedProgramatically);
+
+  g_dbus_connection_signal_unsubscribe (connection, subscription);
+
+  call (fixture, NOTIFICATIONS_INTERFACE, "CloseNotification",
+        g_variant_new ("(u)", id), &error);
+  g_assert_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS);
+  g_error_free (error);
+}
+
+static void
+test_flood (Fixture *fixture, gconstpointer data)
+{
+  GVariant *reply;
+  guint received, dropped, merged;
+  guint i, id;
+
+  for (i = 0; i < 20; i++) {
+    char *summary = g_strdup_printf ("Message %u", i);
+    notify (fixture, "flood", 0, summary, NULL);
+    g_free (summary);
+  }
+
+  /* Identical summaries are merged, even over the limit */
+  id = notify (fixture, "flood", 0, "Message 9", NULL);
+  g_assert (mb_notify_store_lookup (fixture->store, id) != NULL);
+  g_assert_cmpuint (mb_notify_store_lookup (fixture->store, id)->count, ==, 2);
+
+  reply = call (fixture, STATS_INTERFACE, "GetStats", NULL, NULL);
+  g_variant_get (reply, "(uuu)", &received, &dropped, &merged);
+  g_variant_unref (reply);
+
+  g_assert_cmpuint (received, ==, 21);
+  g_assert_cmpuint (dropped, ==, 10);
+  g_assert_cmpuint (merged, ==, 1);
+  g_assert_cmpuint (mb_notify_store_get_length (fixture->store), ==, 10);
+}
+
+static void
+test_many_apps (Fixture *fixture, gconstpointer data)
+{
+  GVariant *reply;
+  guint received, dropped, merged;
+  guint i;
+
+  /* Varying the application name doesn't get around the rate limit once
+     the store tracks as many busy applications as it will */
+  for (i = 0; i < 100; i++) {
+    char *app_name = g_strdup_printf ("app %u", i);
+    notify (fixture, app_name, 0, "Message", NULL);
+    g_free (app_name);
+  }
+
+  reply = call (fixture, STATS_INTERFACE, "GetStats", NULL, NULL);
+  g_variant_get (reply, "(uuu)", &received, &dropped, &merged);
+  g_variant_unref (reply);
+
+  g_assert_cmpuint (received, ==, 100);
+  g_assert_cmpuint (dropped, ==, 36);
+  g_assert_cmpuint (mb_notify_store_get_length (fixture->store), ==, 64);
+}
+
+static GVariant *
+urgency_hints (MbNotifyStoreUrgency urgency)
+{
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{sv}", "urgency", g_variant_new_byte (urgency));
+  return g_variant_builder_end (&builder);
+}
+
+static void
+test_critical (Fixture *fixture, gconstpointer data)
+{
+  Notification *notification;
+  guint i, id;
+
+  for (i = 0; i < 20; i++) {
+    char *summary = g_strdup_printf ("Message %u", i);
+    notify (fixture, "flood", 0, summary, NULL);
+    g_free (summary);
+  }
+
+  /* Critical notifications get through a flood, aren't merged, and don't
+     expire */
+  for (i = 0; i < 2; i++) {
+    id = notify (fixture, "flood", 0, "Alert", urgency_hints (UrgencyCritical));
+    notification = mb_notify_store_lookup (fixture->store, id);
+    g_assert (notification != NULL);
+    g_assert_cmpuint (notification->count, ==, 1);
+    g_assert_cmpint (notification->expires, ==, 0);
+    g_assert (mb_notify_store_get_notifications (fixture->store)->data == notification ||
+              mb_notify_store_get_notifications (fixture->store)->next->data == notification);
+  }
+
+  /* Nor does anything else merge into them */
+  id = notify (fixture, "alerts", 0, "Alert", urgency_hints (UrgencyCritical));
+  g_assert_cmpuint (notify (fixture, "alerts", 0, "Alert", NULL), !=, id);
+  notification = mb_notify_store_lookup (fixture->store, id);
+  g_assert_cmpuint (notification->urgency, ==, UrgencyCritical);
+  g_assert_cmpuint (notification->count, ==, 1);
+
+  /* Low urgency ones go last */
+  id = notify (fixture, "other", 0, "Chatter", urgency_hints (UrgencyLow));
+  g_assert (g_list_last (mb_notify_store_get_notifications (fixture->store))->data ==
+            mb_notify_store_lookup (fixture->store, id));
+}
+
+static void
+test_low_deferred (Fixture *fixture, gconstpointer data)
+{
+  Notification *notification;
+  GVariant *reply;
+  guint i, id;
+
+  /* Two applications to get past the rate limit */
+  for (i = 0; i < 20; i++) {
+    char *summary = g_strdup_printf ("Message %u", i);
+    notify (fixture, i % 2 ? "odd" : "even", 0, summary, NULL);
+    g_free (summary);
+  }
+
+  /* Under load low urgency notifications wait at the end, and only start
+     to expire once shown */
+  reply = call (fixture, NOTIFICATIONS_INTERFACE, "Notify",
+                g_variant_new ("(susss@as@a{sv}i)", "other", 0, "",
+                               "Chatter", "", g_variant_new_strv (NULL, 0),
+                               urgency_hints (UrgencyLow), 5000),
+                NULL);
+  g_variant_get (reply, "(u)", &id);
+  g_variant_unref (reply);
+
+  notification = mb_notify_store_lookup (fixture->store, id);
+  g_assert (notification != NULL);
+  g_assert (g_list_last (mb_notify_store_get_notifications (fixture->store))->data ==
+            notification);
+  g_assert_cmpint (notification->expires, ==, 0);
+
+  mb_notify_store_shown (fixture->store, notification);
+  g_assert_cmpint (notification->expires, !=, 0);
+}
+
+static void
+test_low_bounded (Fixture *fixture, gconstpointer data)
+{
+  GVariant *reply;
+  guint received, dropped, merged;
+  guint i;
+
+  /* Deferred low urgency notifications don't pile up without bound, even
+     from applications within their rate limit */
+  for (i = 0; i < 100; i++) {
+    char *app_name = g_strdup_printf ("app %u", i / 10);
+    char *summary = g_strdup_printf ("Message %u", i);
+    notify (fixture, app_name, 0, summary, urgency_hints (UrgencyLow));
+    g_free (app_name);
+    g_free (summary);
+  }
+
+  reply = call (fixture, STATS_INTERFACE, "GetStats", NULL, NULL);
+  g_variant_get (reply, "(uuu)", &received, &dropped, &merged);
+  g_variant_unref (reply);
+
+  g_assert_cmpuint (received, ==, 100);
+  g_assert_cmpuint (dropped, ==, 60);
+  g_assert_cmpuint (mb_notify_store_get_length (fixture->store), ==, 40);
+}
+
+static void
+test_urgency_order (Fixture *fixture, gconstpointer data)
+{
+  GVariantBuilder builder;
+  Notification *head;
+  guint critical;
+
+  mb_notify_store_set_order (fixture->store, OrderUrgency);
+
+  notify (fixture, "test", 0, "Normal", NULL);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{sv}", "urgency",
+                         g_variant_new_byte (UrgencyCritical));
+  critical = notify (fixture, "other", 0, "Critical",
+                     g_variant_builder_end (&builder));
+
+  head = mb_notify_store_get_notifications (fixture->store)->data;
+  g_assert_cmpuint (head->id, ==, critical);
+  g_assert_cmpint (head->urgency, ==, UrgencyCritical);
+}
+
+static GVariant *
+image_hints (void)
+{
+  static const guchar pixels[] = {
+    0xff, 0x00, 0x00, 0xff,  0x00, 0xff, 0x00, 0x80,
+    0x00, 0x00, 0xff, 0x00,  0xff, 0xff, 0xff, 0xff,
+  };
+  GVariantBuilder builder;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{sv}", "image-data",
+                         g_variant_new ("(iiibii@ay)", 2, 2, 8, TRUE, 8, 4,
+                                        g_variant_new_fixed_array (G_VARIANT_TYPE_BYTE,
+                                                                   pixels, sizeof (pixels), 1)));
+  return g_variant_builder_end (&builder);
+}
+
+static void
+test_image_data (Fixture *fixture, gconstpointer data)
+{
+  Notification *first, *second;
+  guint32 *pixels;
+
+  first = mb_notify_store_lookup (fixture->store,
+                                  notify (fixture, "test", 0, "First", image_hints ()));
+  g_assert (first->image != NULL);
+  g_assert_cmpint (cairo_image_surface_get_width (first->image), ==, 2);
+  g_assert_cmpint (cairo_image_surface_get_format (first->image), ==, CAIRO_FORMAT_ARGB32);
+
+  /* Premultiplied ARGB */
+  pixels = (guint32 *)cairo_image_surface_get_data (first->image);
+  g_assert_cmphex (pixels[0], ==, 0xffff0000);
+  g_assert_cmphex (pixels[1], ==, 0x80008000);
+
+  /* The same image isn't decoded again */
+  second = mb_notify_store_lookup (fixture->store,
+                                   notify (fixture, "test", 0, "Second", image_hints ()));
+  g_assert (second->image == first->image);
+}
+
+static void
+test_history (Fixture *fixture, gconstpointer data)
+{
+  MbNotifyHistory *history;
+  const MbNotifyHistoryEntry *entry;
+  guint id, length;
+
+  history = mb_notify_store_get_history (fixture->store);
+  g_assert (history != NULL);
+  length = mb_notify_history_get_length (history);
+
+  id = notify (fixture, "test", 0, "Remember me", NULL);
+  g_assert_cmpuint (mb_notify_history_get_length (history), ==, length);
+
+  mb_notify_store_close (fixture->store, id, ClosedDismissed);
+  g_assert_cmpuint (mb_notify_history_get_length (history), ==, length + 1);
+
+  entry = mb_notify_history_get (history, 0);
+  g_assert_cmpuint (entry->id, ==, id);
+  g_assert_cmpuint (entry->reason, ==, ClosedDismissed);
+  g_assert_cmpstr (entry->app_name, ==, "test");
+  g_assert_cmpstr (entry->summary, ==, "Remember me");
+}
+
+int
+main (int argc, char **argv)
+{
+  GTestDBus *bus;
+  char *runtime_dir, *filename;
+  int ret;
+
+  g_test_init (&argc, &argv, NULL);
+
+  /* Keep the history away from the real one */
+  runtime_dir = g_dir_make_tmp ("test-notify-store-XXXXXX", NULL);
+  g_assert (runtime_dir != NULL);
+  g_setenv ("XDG_RUNTIME_DIR", runtime_dir, TRUE);
+
+  bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_up (bus);
+
+  connection = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, NULL);
+  g_assert (connection != NULL);
+
+  g_test_add ("/notify/server-information", Fixture, NULL,
+              fixture_setup, test_server_information, fixture_teardown);
+  g_test_add ("/notify/notify-close", Fixture, NULL,
+              fixture_setup, test_notify_close, fixture_teardown);
+  g_test_add ("/notify/flood", Fixture, NULL,
+              fixture_setup, test_flood, fixture_teardown);
+  g_test_add ("/notify/many-apps", Fixture, NULL,
+              fixture_setup, test_many_apps, fixture_teardown);
+  g_test_add ("/notify/critical", Fixture, NULL,
+              fixture_setup, test_critical, fixture_teardown);
+  g_test_add ("/notify/low-deferred", Fixture, NULL,
+              fixture_setup, test_low_deferred, fixture_teardown);
+  g_test_add ("/notify/low-bounded", Fixture, NULL,
+              fixture_setup, test_low_bounded, fixture_teardown);
+  g_test_add ("/notify/urgency-order", Fixture, NULL,
+              fixture_setup, test_urgency_order, fixture_teardown);
+  g_test_add ("/notify/image-data", Fixture, NULL,
+              fixture_setup, test_image_data, fixture_teardown);
+  g_test_add ("/notify/history", Fixture, NULL,
+              fixture_setup, test_history, fixture_teardown);
+
+  ret = g_test_run ();
+
+  g_object_unref (connection);
+  g_test_dbus_down (bus);
+  g_object_unref (bus);
+
+  filename = g_build_filename (runtime_dir, "matchbox-panel-notifications", NULL);
+  g_unlink (filename);
+  g_rmdir (runtime_dir);
+  g_free (filename);
+  g_free (runtime_dir);
+
+  return ret;
+}
@@ -20,23 +20,13 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
 
-#include <dbus/dbus-glib.h>
-
-#include <X11/Xlib.h>
-#include <X11/Xutil.h>
+#include <gio/gio.h>
 
 #include <glib.h>
-#include <gdk/gdkx.h>
-#include <gdk/gdk.h>
 #include <gtk/gtk.h>
 
-#define SN_API_NOT_YET_FROZEN 1
-#include <libsn/sn.h>
-
 #include <string.h>
-#include "marshal.h"
 
 #include <matchbox-panel/mb-panel.h>
 
@@ -45,261 +35,348 @@
 typedef struct LaunchItem {
   char *id;
   char *name;
-  time_t when;
-  guint timeout_id;
+  /* Monotonic time the launch is given up on */
+  gint64 when;
 } LaunchItem;
 
 typedef struct {
-  GdkWindow *root_window;
-  SnDisplay *sn_display;
-  SnMonitorContext *sn_context;
-  GList *launch_list;
-  DBusGProxy *proxy;
+  guint monitor_id;
+  /* The launches, oldest first. They all get the same timeout, so this is
+     also the order they expire in. */
+  GQueue launches;
+  guint expire_id;
+  GDBusProxy *proxy;
+  GCancellable *cancellable;
   guint notify_id;
+  /* The summary last sent, or NULL if the notification is hidden */
+  char *summary;
+  /* Updates are made once per main loop iteration, and wait for the
+     previous Notify call to return */
+  guint update_id;
+  gboolean in_flight;
+  gboolean pending;
 } StartupApplet;
 
-static GdkFilterReturn filter_func (GdkXEvent *gdk_xevent,
-                                    GdkEvent *event, StartupApplet *applet);
-
-static gboolean timeout (StartupApplet *applet);
+static void queue_update (StartupApplet *applet);
 
 /*
  * Notify code
  */
 
 static void
-notify_done (DBusGProxy *proxy, DBusGProxyCall *call, void *user_data)
+notify_done (GObject *source, GAsyncResult *result, gpointer user_data)
 {
   StartupApplet *applet = user_data;
+  GVariant *reply;
   GError *error = NULL;
 
-  dbus_g_proxy_end_call (proxy, call, &error, G_TYPE_UINT, &applet->notify_id, G_TYPE_INVALID);
-  if (error) {
-    g_printerr ("Cannot send notification: %s", error->message);
+  reply = g_dbus_proxy_call_finish (G_DBUS_PROXY (source), result, &error);
+  if (reply) {
+    g_variant_get (reply, "(u)", &applet->notify_id);
+    g_variant_unref (reply);
+  } else {
+    /* The applet is gone if the call was cancelled */
+    if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+      g_error_free (error);
+      return;
+    }
+
+    g_printerr ("Cannot send notification: %s\n", error->message);
     g_error_free (error);
+
+    /* Send it again on the next update */
+    g_free (applet->summary);
+    applet->summary = NULL;
+  }
+
+  applet->in_flight = FALSE;
+  if (applet->pending) {
+    applet->pending = FALSE;
+    queue_update (applet);
   }
 }
 
-static void
+static gboolean
 notify_send (StartupApplet *applet, const char *summary)
 {
-  dbus_g_proxy_begin_call (applet->proxy, "Notify",
-                           notify_done, applet, NULL,
-                           G_TYPE_STRING, "matchbox-panel",
-                           G_TYPE_UINT, applet->notify_id,
-                           G_TYPE_STRING, "application-x-executable",
-                           G_TYPE_STRING, summary,
-                           G_TYPE_STRING, NULL, /* body */
-                           G_TYPE_STRV, NULL, /* actions */
-                           dbus_g_type_get_map("GHashTable", G_TYPE_STRING, G_TYPE_VALUE), g_hash_table_new (NULL, NULL), /* Hints */
-                           G_TYPE_INT, 10 * 1000, /* timeout */
-                           G_TYPE_INVALID);
+  if (applet->proxy == NULL)
+    return FALSE;
+
+  g_dbus_proxy_call (applet->proxy, "Notify",
+                     g_variant_new ("(susssasa{sv}i)",
+                                    "matchbox-panel",
+                                    applet->notify_id,
+                                    "application-x-executable",
+                                    summary,
+                                    "", /* body */
+                                    NULL, /* actions */
+                                    NULL, /* hints */
+                                    0 /* timeout, closed when done */),
+                     G_DBUS_CALL_FLAGS_NONE, -1, applet->cancellable,
+                     notify_done, applet);
+
+  applet->in_flight = TRUE;
+
+  return TRUE;
+}
+
+static void
+free_item (LaunchItem *item)
+{
+  g_return_if_fail (item != NULL);
+  
+  g_free (item->id);
+  g_free (item->name);
+  g_free (item);
 }
 
 /* Destroy applet */
 static void
 startup_applet_free (StartupApplet *applet)
 {
-  gdk_window_remove_filter (applet->root_window,
-                            (GdkFilterFunc) filter_func, applet);
-  g_object_unref (applet->proxy);
+  if (applet->monitor_id)
+    mb_panel_startup_remove_monitor (applet->monitor_id);
+  g_cancellable_cancel (applet->cancellable);
+  g_object_unref (applet->cancellable);
+  if (applet->expire_id)
+    g_source_remove (applet->expire_id);
+  if (applet->update_id)
+    g_source_remove (applet->update_id);
+  g_free (applet->summary);
+  g_queue_foreach (&applet->launches, (GFunc) free_item, NULL);
+  g_queue_clear (&applet->launches);
+  if (applet->proxy) {
+    g_signal_handlers_disconnect_by_data (applet->proxy, applet);
+    g_object_unref (applet->proxy);
+  }
   g_slice_free (StartupApplet, applet);
 }
 
 static void
-update_notify (StartupApplet *applet)
+hide_notify (StartupApplet *applet)
 {
-  LaunchItem *item;
-  char *msg;
+  if (applet->notify_id && applet->proxy) {
+    g_dbus_proxy_call (applet->proxy, "CloseNotification",
+                       g_variant_new ("(u)", applet->notify_id),
+                       G_DBUS_CALL_FLAGS_NONE, -1, NULL, NULL, NULL);
+    /* Unset this here just in case the close signal never arrives.  Not that
+       notification-daemon doesn't respect the specification or anything... */
+    applet->notify_id = 0;
+  }
 
-  g_return_if_fail (applet->launch_list != NULL);
+  g_free (applet->summary);
+  applet->summary = NULL;
+}
 
-  item = applet->launch_list->data;
-  
-  msg = g_strdup_printf ("Starting %s...", item->name);
-  
-  notify_send (applet, msg);
-  
-  g_free (msg);
+/* The launch shown is the most recent one, which is the one given up on
+   last */
+static char *
+get_summary (StartupApplet *applet)
+{
+  LaunchItem *latest;
+
+  latest = g_queue_peek_tail (&applet->launches);
+
+  return latest ? g_strdup_printf ("Starting %s...", latest->name) : NULL;
+}
+
+static gboolean
+update_idle (StartupApplet *applet)
+{
+  char *summary;
+
+  applet->update_id = 0;
+
+  /* Don't pile up calls if the notification daemon is slow */
+  if (applet->in_flight) {
+    applet->pending = TRUE;
+    return FALSE;
+  }
+
+  summary = get_summary (applet);
+
+  if (summary == NULL) {
+    hide_notify (applet);
+  } else if (g_strcmp0 (summary, applet->summary) != 0 &&
+             notify_send (applet, summary)) {
+    g_free (applet->summary);
+    applet->summary = summary;
+    summary = NULL;
+  }
+
+  g_free (summary);
+
+  return FALSE;
 }
 
 static void
-hide_notify (StartupApplet *applet)
+queue_update (StartupApplet *applet)
 {
-  if (applet->notify_id) {
-    dbus_g_proxy_call_no_reply (applet->proxy, "CloseNotification",
-                                G_TYPE_UINT, applet->notify_id,
-                                G_TYPE_INVALID);
-    /* Unset this here just in case the close signal never arrives.  Not that
-       notification-daemon doesn't respect the specification or anything... */
-    applet->notify_id = 0;
+  if (applet->update_id == 0)
+    applet->update_id = g_idle_add ((GSourceFunc) update_idle, applet);
+}
+
+static gboolean expire (StartupApplet *applet);
+
+/* Arm the timer for the oldest launch */
+static void
+schedule_expire (StartupApplet *applet)
+{
+  LaunchItem *first;
+  gint64 delay;
+
+  if (applet->expire_id) {
+    g_source_remove (applet->expire_id);
+    applet->expire_id = 0;
   }
+
+  if (applet->launches.length == 0)
+    return;
+
+  first = g_queue_peek_head (&applet->launches);
+  delay = MAX (0, first->when - g_get_monotonic_time ());
+
+  applet->expire_id = g_timeout_add ((delay + 999) / 1000,
+                                     (GSourceFunc) expire, applet);
 }
 
-static LaunchItem *
-new_item (StartupApplet *applet, const char *id, const char *name)
+/* Give up on every launch which is past its deadline */
+static gboolean
+expire (StartupApplet *applet)
 {
   LaunchItem *item;
+  gint64 now;
+
+  applet->expire_id = 0;
+  now = g_get_monotonic_time ();
+
+  while ((item = g_queue_peek_head (&applet->launches)) &&
+         item->when <= now) {
+    g_queue_pop_head (&applet->launches);
+    free_item (item);
+  }
+
+  schedule_expire (applet);
+  queue_update (applet);
+
+  return FALSE;
+}
 
-  g_return_val_if_fail (applet != NULL, NULL);
-  g_return_val_if_fail (id != NULL, NULL);
-  g_return_val_if_fail (name != NULL, NULL);
+static void
+add_item (StartupApplet *applet, const char *id, const char *name)
+{
+  LaunchItem *item;
+
+  g_return_if_fail (id != NULL);
+  g_return_if_fail (name != NULL);
   
   item = g_new0 (LaunchItem, 1);
   item->id = g_strdup (id);
   item->name = g_strdup (name);
-  
-  item->when = time (NULL) + TIMEOUT;
-  
-  /* TODO: keep track of the earliest timeout and only wake up then */
-#if GLIB_CHECK_VERSION(2, 14, 0)
-  item->timeout_id = g_timeout_add_seconds (2, (GSourceFunc) timeout, applet);
-#else
-  item->timeout_id = g_timeout_add (2, (GSourceFunc) timeout, applet);
-#endif 
-  
-  return item;
+  item->when = g_get_monotonic_time () + TIMEOUT * G_USEC_PER_SEC;
+
+  g_queue_push_tail (&applet->launches, item);
+
+  /* Later launches expire after the ones already queued */
+  if (applet->launches.length == 1)
+    schedule_expire (applet);
 }
 
 static void
-free_item (LaunchItem *item)
+remove_item (StartupApplet *applet, const char *id)
 {
-  g_return_if_fail (item != NULL);
-  
-  g_source_remove (item->timeout_id);
-  g_free (item->id);
-  g_free (item->name);
-  g_free (item);
+  LaunchItem *item;
+  GList *l;
+
+  for (l = applet->launches.head; l; l = l->next) {
+    item = l->data;
+    if (strcmp (item->id, id) == 0) {
+      gboolean first = l == applet->launches.head;
+
+      g_queue_delete_link (&applet->launches, l);
+      free_item (item);
+
+      if (first)
+        schedule_expire (applet);
+      break;
+    }
+  }
 }
 
 static void
-monitor_event_func (SnMonitorEvent *event, gpointer user_data)
+monitor_event_func (const MBPanelStartupEvent *event, gpointer user_data)
 {
-  SnStartupSequence *sequence;
-  const char *id, *name;
   StartupApplet *applet = (StartupApplet *) user_data;
   
-  sequence = sn_monitor_event_get_startup_sequence (event);
-  id = sn_startup_sequence_get_id (sequence);
-  name = sn_startup_sequence_get_name (sequence);
-  
-  switch (sn_monitor_event_get_type (event)) {
-  case SN_MONITOR_EVENT_INITIATED:
-    {
-      LaunchItem *item;
-      item = new_item (applet, id, name);
-      applet->launch_list = g_list_prepend (applet->launch_list, item);
-      update_notify (applet);
-    }
+  switch (event->type) {
+  case MB_PANEL_STARTUP_INITIATED:
+    add_item (applet, event->id, event->name);
+    queue_update (applet);
     break;
 
-  case SN_MONITOR_EVENT_COMPLETED:
-  case SN_MONITOR_EVENT_CANCELED:
-    {
-      GList *l;
-      
-      for (l = applet->launch_list; l; l = l->next) {
-        LaunchItem *item = l->data;
-        if (!strcmp (item->id, id)) {
-          applet->launch_list = g_list_delete_link (applet->launch_list, l);
-          free_item (item);
-          break;
-        }
-      }
-      
-      if (applet->launch_list)
-        update_notify (applet);
-      else
-        hide_notify (applet);
-    }
+  case MB_PANEL_STARTUP_COMPLETED:
+  case MB_PANEL_STARTUP_CANCELED:
+    remove_item (applet, event->id);
+    queue_update (applet);
     break;
 
-  case SN_MONITOR_EVENT_CHANGED:
+  case MB_PANEL_STARTUP_CHANGED:
     /* TODO */
     break;
   }
 }
 
-static gboolean
-timeout (StartupApplet *applet)
+static void
+signal_cb (GDBusProxy *proxy, const gchar *sender_name, const gchar *signal_name,
+           GVariant *parameters, StartupApplet *applet)
 {
-  time_t t;
-  GList *l;
-  
-  if (!applet->notify_id)
-    return TRUE;
-  
-  t = time (NULL);
-  
-  /* handle launchee timeouts */
-  for (l = applet->launch_list; l; l = l->next) {
-    LaunchItem *item = l->data;
-    if ((item->when - t) <= 0) {
-      applet->launch_list = g_list_delete_link (applet->launch_list, l);
-      free_item (item);
-      break;
-    }
-  }
-  
-  if (applet->launch_list) {
-    update_notify (applet);
-    return TRUE;
-  } else {
-    hide_notify (applet);
-    return TRUE;
-  }
-  
-  return TRUE;
-}
+  guint id, reason;
 
-static GdkFilterReturn
-filter_func (GdkXEvent *gdk_xevent, GdkEvent *event, StartupApplet *applet)
-{
-  XEvent *xevent = (XEvent *) gdk_xevent;
-  
-  sn_display_process_event (applet->sn_display, xevent);
-  
-  return GDK_FILTER_CONTINUE;
-}
+  if (g_strcmp0 (signal_name, "NotificationClosed") != 0)
+    return;
 
-static void
-close_cb (DBusGProxy *proxy, guint id, guint reason, StartupApplet *applet)
-{
-  applet->notify_id = 0;
+  g_variant_get (parameters, "(uu)", &id, &reason);
+  if (id == applet->notify_id)
+    applet->notify_id = 0;
 }
 
-static gboolean
-init_notify (StartupApplet *applet)
+static void
+proxy_ready (GObject *source, GAsyncResult *result, gpointer user_data)
 {
-  DBusGConnection *bus;
+  StartupApplet *applet = user_data;
+  GDBusProxy *proxy;
   GError *error = NULL;
 
-  bus = dbus_g_bus_get (DBUS_BUS_SESSION, &error);
-  if (error) {
-    g_printerr ("Cannot get DBus connection: %s\n", error->message);
+  proxy = g_dbus_proxy_new_for_bus_finish (result, &error);
+  if (proxy == NULL) {
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_printerr ("Cannot get DBus connection: %s\n", error->message);
     g_error_free (error);
-    return FALSE;
+    return;
   }
 
-  applet->proxy = dbus_g_proxy_new_for_name (bus,
-                                             "org.freedesktop.Notifications",
-                                             "/org/freedesktop/Notifications",
-                                             "org.freedesktop.Notifications");
-  
-  dbus_g_object_register_marshaller(mb_marshal_VOID__UINT_UINT,
-                                    G_TYPE_NONE,
-                                    G_TYPE_UINT, G_TYPE_UINT, G_TYPE_INVALID);
+  applet->proxy = proxy;
+  g_signal_connect (proxy, "g-signal", G_CALLBACK (signal_cb), applet);
 
-  dbus_g_proxy_add_signal (applet->proxy, "NotificationClosed",
-                           G_TYPE_UINT, G_TYPE_UINT, G_TYPE_INVALID);
-  
-  dbus_g_proxy_connect_signal (applet->proxy, "NotificationClosed",
-                               G_CALLBACK (close_cb),
-                               applet, NULL);
-  
-  dbus_g_connection_unref (bus);
+  /* Show anything launched while connecting */
+  queue_update (applet);
+}
 
-  return TRUE;
+/* Connect to the notification manager without blocking, notifications are
+   dropped until it is ready */
+static void
+init_notify (StartupApplet *applet)
+{
+  applet->cancellable = g_cancellable_new ();
+
+  g_dbus_proxy_new_for_bus (G_BUS_TYPE_SESSION,
+                            G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
+                            NULL,
+                            "org.freedesktop.Notifications",
+                            "/org/freedesktop/Notifications",
+                            "org.freedesktop.Notifications",
+                            applet->cancellable,
+                            proxy_ready, applet);
 }
 
 static void
@@ -307,37 +384,12 @@ screen_changed_cb (GtkWidget     *widget,
                    GdkScreen     *old_screen,
                    StartupApplet *applet)
 {
-  GdkScreen *screen;
-  GdkDisplay *display;
-  Display *xdisplay;
-
-  if (applet->root_window) {
-    gdk_window_remove_filter (applet->root_window,
-                              (GdkFilterFunc) filter_func,
-                              applet);
-  }
-
-  screen = gtk_widget_get_screen (widget);
-  display = gdk_screen_get_display (screen);
-
-  xdisplay = GDK_DISPLAY_XDISPLAY (display);
-
-  applet->sn_display = sn_display_new (xdisplay, NULL, NULL);
+  if (applet->monitor_id)
+    mb_panel_startup_remove_monitor (applet->monitor_id);
 
-  applet->sn_context = sn_monitor_context_new (applet->sn_display,
-                                               gdk_screen_get_number (screen),
-                                               monitor_event_func,
-                                               applet, NULL);
-
-  /* We have to select for property events on at least one root window (but not
-   * all as INITIATE messages go to all root windows)
-   */
-  XSelectInput (xdisplay, DefaultRootWindow (xdisplay), PropertyChangeMask);
-
-  applet->root_window = gdk_x11_window_lookup_for_display
-    (display, DefaultRootWindow (xdisplay));
-
-  gdk_window_add_filter (applet->root_window, (GdkFilterFunc)filter_func, applet);
+  applet->monitor_id = mb_panel_startup_add_monitor (gtk_widget_get_screen (widget),
+                                                     monitor_event_func,
+                                                     applet);
 }
 
 G_MODULE_EXPORT GtkWidget *
@@ -347,16 +399,16 @@ mb_panel_applet_create (const char *id, GtkOrientation orientation)
   GtkWidget *widget;
 
   applet = g_slice_new0 (StartupApplet);
+  g_queue_init (&applet->launches);
 
   widget = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 0);
   g_object_weak_ref (G_OBJECT (widget), (GWeakNotify)startup_applet_free, applet);
 
-  if (init_notify (applet)) {
-          g_signal_connect (widget,
-                            "screen-changed",
-                            G_CALLBACK (screen_changed_cb),
-                            applet);
-  }
+  init_notify (applet);
+  g_signal_connect (widget,
+                    "screen-changed",
+                    G_CALLBACK (screen_changed_cb),
+                    applet);
 
   /* TODO: need to fix the panel to support invisible widgets */
   return widget;
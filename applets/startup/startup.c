@@ -23,229 +23,215 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
-
-#include <X11/Xlib.h>
-#include <X11/Xutil.h>
 
 #include <glib.h>
-#include <gdk/gdkx.h>
-#include <gdk/gdk.h>
 #include <gtk/gtk.h>
 
-#define SN_API_NOT_YET_FROZEN 1
-#include <libsn/sn.h>
-
 #include <string.h>
 #include <matchbox-panel/mb-panel.h>
 #include <matchbox-panel/mb-panel-scaling-image2.h>
 
 #define TIMEOUT 20
 #define HOURGLASS_PIXMAPS 8
+#define ANIMATION_INTERVAL 500
 
 typedef struct LaunchItem {
         char *id;
-        time_t when;
-        guint timeout_id;
+        /* Monotonic time the launch is given up on */
+        gint64 when;
 } LaunchItem;
 
 typedef struct {
         MBPanelScalingImage2 *image;
-        GdkWindow *root_window;
-        SnDisplay *sn_display;
-        SnMonitorContext *sn_context;
-        GList *launch_list;
+        guint monitor_id;
+        /* The launches, oldest first. They all get the same timeout, so this
+         * is also the order they expire in. */
+        GQueue launches;
+        guint expire_id;
+        guint animate_id;
         gboolean hourglass_shown;
         int hourglass_cur_frame_n;
 } StartupApplet;
 
-static GdkFilterReturn filter_func (GdkXEvent *gdk_xevent,
-                                    GdkEvent *event, StartupApplet *applet);
-
-static gboolean timeout (StartupApplet *applet);
+static void
+launch_item_free (LaunchItem *item)
+{
+        g_free (item->id);
+        g_slice_free (LaunchItem, item);
+}
 
 /* Destroy applet */
 static void
 startup_applet_free (StartupApplet *applet)
 {
-	/* TODO: this should be in unrealize */
-        gdk_window_remove_filter (applet->root_window,
-                                  (GdkFilterFunc) filter_func, applet);
+        if (applet->monitor_id)
+                mb_panel_startup_remove_monitor (applet->monitor_id);
+
+        if (applet->expire_id)
+                g_source_remove (applet->expire_id);
+        if (applet->animate_id)
+                g_source_remove (applet->animate_id);
+
+        g_queue_foreach (&applet->launches, (GFunc) launch_item_free, NULL);
+        g_queue_clear (&applet->launches);
+
         g_slice_free (StartupApplet, applet);
 }
 
-static void
-show_hourglass (StartupApplet *applet)
+static gboolean
+animate (StartupApplet *applet)
 {
-        gtk_widget_show (GTK_WIDGET (applet->image));
-        applet->hourglass_shown = TRUE;
+        char *icon;
+
+        applet->hourglass_cur_frame_n++;
+        if (applet->hourglass_cur_frame_n == HOURGLASS_PIXMAPS)
+                applet->hourglass_cur_frame_n = 0;
+
+        icon = g_strdup_printf ("%s/hourglass-%i.png", DATADIR,
+                                applet->hourglass_cur_frame_n);
+
+        mb_panel_scaling_image2_set_icon (applet->image, icon);
+
+        g_free (icon);
+
+        return TRUE;
 }
 
+/* Show the hourglass and animate it while anything is launching, with one
+ * timer however many launches there are */
 static void
-hide_hourglass (StartupApplet *applet)
+update_hourglass (StartupApplet *applet)
 {
-        gtk_widget_hide (GTK_WIDGET (applet->image));
-        applet->hourglass_shown = FALSE;
+        if (applet->launches.length && !applet->hourglass_shown) {
+                gtk_widget_show (GTK_WIDGET (applet->image));
+                applet->hourglass_shown = TRUE;
+                applet->animate_id = g_timeout_add (ANIMATION_INTERVAL,
+                                                    (GSourceFunc) animate,
+                                                    applet);
+        } else if (applet->launches.length == 0 && applet->hourglass_shown) {
+                gtk_widget_hide (GTK_WIDGET (applet->image));
+                applet->hourglass_shown = FALSE;
+                g_source_remove (applet->animate_id);
+                applet->animate_id = 0;
+        }
 }
 
+static gboolean expire (StartupApplet *applet);
+
+/* Arm the timer for the oldest launch */
 static void
-monitor_event_func (SnMonitorEvent *event, gpointer user_data)
+schedule_expire (StartupApplet *applet)
 {
-        SnStartupSequence *sequence;
-        const char *id;
-        time_t t;
-        StartupApplet *applet = (StartupApplet *) user_data;
+        LaunchItem *first;
+        gint64 delay;
 
-        sequence = sn_monitor_event_get_startup_sequence (event);
-        id = sn_startup_sequence_get_id (sequence);
-
-        switch (sn_monitor_event_get_type (event)) {
-        case SN_MONITOR_EVENT_INITIATED:
-                {
-                        /* Reset counter */
-                        applet->hourglass_cur_frame_n = 0;
-
-                        LaunchItem *item;
-                        item = malloc (sizeof (LaunchItem));
-
-                        /* Fillup list item with current launchee
-                         * informations */
-                        item->id = g_strdup (id);
-                        t = time (NULL);
-                        item->when = t + TIMEOUT;
-
-                        /* Set up a timeout that will be called every 0.5
-                         * seconds */
-                        item->timeout_id =
-                                g_timeout_add (500,
-                                               (GSourceFunc) timeout, 
-                                               applet);
-
-                        /* Add a new launch at the end of list */
-                        applet->launch_list =
-                                g_list_append (applet->launch_list,
-                                               (gpointer) item);
-
-                        if (!applet->hourglass_shown)
-                                show_hourglass (applet);
-                }
-                break;
-
-        case SN_MONITOR_EVENT_COMPLETED:
-        case SN_MONITOR_EVENT_CANCELED:
-                {
-                        GList *tmp = applet->launch_list;
-
-                        /* Find actual list item and free it*/
-                        while( tmp != NULL) {
-                                LaunchItem *item = (LaunchItem*) tmp->data;
-                                if (!strcmp (item->id, id)) {
-                                        applet->launch_list =
-                                                g_list_remove (tmp, item);
-                                        g_source_remove (item->timeout_id);
-                                        free (item->id);
-                                        free (item);
-
-                                        break;
-                                }
-                                tmp = tmp->next;
-                        }
-
-                        if (applet->launch_list == NULL &&
-                            applet->hourglass_shown)
-                                hide_hourglass (applet);
-                }
-                break;
-        default:
-                break;                /* Nothing */
+        if (applet->expire_id) {
+                g_source_remove (applet->expire_id);
+                applet->expire_id = 0;
         }
+
+        if (applet->launches.length == 0)
+                return;
+
+        first = g_queue_peek_head (&applet->launches);
+        delay = MAX (0, first->when - g_get_monotonic_time ());
+
+        applet->expire_id = g_timeout_add ((delay + 999) / 1000,
+                                           (GSourceFunc) expire, applet);
 }
 
+/* Give up on every launch which is past its deadline */
 static gboolean
-timeout (StartupApplet *applet)
+expire (StartupApplet *applet)
 {
-        time_t t;
-        char *icon;
-
-        if (!applet->hourglass_shown)
-                return TRUE;
+        LaunchItem *item;
+        gint64 now;
 
-        t = time (NULL);
-        GList *tmp = applet->launch_list;
+        applet->expire_id = 0;
+        now = g_get_monotonic_time ();
 
-        /* handle launchee timeouts */
-        while (tmp != NULL) {
-                GList *tmp_next = tmp->next;
-                LaunchItem *item = (LaunchItem *) tmp->data;
-                if ((item->when - t) <= 0) {
-                        applet->launch_list = g_list_delete_link (applet->launch_list, tmp);
-                        g_source_remove (item->timeout_id);
-                        free (item->id);
-                        free (item);
-
-                        break;
-                }
-                tmp = tmp_next;
+        while ((item = g_queue_peek_head (&applet->launches)) &&
+               item->when <= now) {
+                g_queue_pop_head (&applet->launches);
+                launch_item_free (item);
         }
 
-        if (applet->launch_list == NULL && applet->hourglass_shown) {
-                hide_hourglass (applet);
-                return TRUE;
-        }
+        schedule_expire (applet);
+        update_hourglass (applet);
 
-        applet->hourglass_cur_frame_n++;
-        if (applet->hourglass_cur_frame_n == 8)
-                applet->hourglass_cur_frame_n = 0;
+        return FALSE;
+}
 
-        icon = malloc (sizeof(DATADIR) + 16);
-        sprintf (icon, "%s/hourglass-%i.png", DATADIR,
-                 applet->hourglass_cur_frame_n);
+static void
+add_launch (StartupApplet *applet, const char *id)
+{
+        LaunchItem *item;
 
-        mb_panel_scaling_image2_set_icon (applet->image, icon);
+        item = g_slice_new (LaunchItem);
+        item->id = g_strdup (id);
+        item->when = g_get_monotonic_time () + TIMEOUT * G_USEC_PER_SEC;
 
-        free (icon);
+        g_queue_push_tail (&applet->launches, item);
 
-        return TRUE;
+        /* Later launches expire after the ones already queued */
+        if (applet->launches.length == 1)
+                schedule_expire (applet);
 }
 
-static GdkFilterReturn
-filter_func (GdkXEvent     *gdk_xevent,
-             GdkEvent      *event,
-             StartupApplet *applet)
+static void
+remove_launch (StartupApplet *applet, const char *id)
 {
-        XEvent *xevent;
-        xevent = (XEvent *) gdk_xevent;
+        LaunchItem *item;
+        GList *l;
 
-        sn_display_process_event (applet->sn_display, xevent);
+        for (l = applet->launches.head; l; l = l->next) {
+                item = l->data;
+                if (strcmp (item->id, id) == 0) {
+                        gboolean first = l == applet->launches.head;
 
-        return GDK_FILTER_CONTINUE;
+                        g_queue_delete_link (&applet->launches, l);
+                        launch_item_free (item);
+
+                        if (first)
+                                schedule_expire (applet);
+                        break;
+                }
+        }
 }
 
 static void
-on_realize (GtkWidget *widget, gpointer user_data)
+monitor_event_func (const MBPanelStartupEvent *event, gpointer user_data)
 {
-        StartupApplet *applet = user_data;
-        GdkDisplay *display;
-        GdkScreen *screen;
-        Display *xdisplay;
+        StartupApplet *applet = (StartupApplet *) user_data;
 
-        screen = gtk_widget_get_screen (widget);
-        display = gdk_screen_get_display (screen);
-        xdisplay = GDK_DISPLAY_XDISPLAY (display);
+        switch (event->type) {
+        case MB_PANEL_STARTUP_INITIATED:
+                /* Reset counter */
+                applet->hourglass_cur_frame_n = 0;
 
-        applet->root_window = gdk_screen_get_root_window (screen);
+                add_launch (applet, event->id);
+                update_hourglass (applet);
+                break;
 
-        applet->sn_display = sn_display_new (xdisplay, NULL, NULL);
-        applet->sn_context = sn_monitor_context_new (applet->sn_display,
-                                                     gdk_screen_get_number (screen),
-                                                     monitor_event_func,
-                                                     applet, NULL);
+        case MB_PANEL_STARTUP_COMPLETED:
+        case MB_PANEL_STARTUP_CANCELED:
+                remove_launch (applet, event->id);
+                update_hourglass (applet);
+                break;
+        default:
+                break;                /* Nothing */
+        }
+}
 
-        XSelectInput (xdisplay,
-                      GDK_WINDOW_XID (applet->root_window),
-                      PropertyChangeMask);
+static void
+on_realize (GtkWidget *widget, gpointer user_data)
+{
+        StartupApplet *applet = user_data;
 
-        gdk_window_add_filter (applet->root_window, (GdkFilterFunc)filter_func, applet);
+        if (applet->monitor_id == 0)
+                applet->monitor_id = mb_panel_startup_add_monitor
+                        (gtk_widget_get_screen (widget),
+                         monitor_event_func, applet);
 }
 
 G_MODULE_EXPORT GtkWidget *
@@ -257,7 +243,7 @@ mb_panel_applet_create (const char    *id,
         /* Create applet data structure */
         applet = g_slice_new0 (StartupApplet);
 
-        applet->launch_list = NULL;
+        g_queue_init (&applet->launches);
         applet->hourglass_shown = FALSE;
 
         /* Create image */
@@ -40,6 +40,13 @@ struct _NaFixedTipPrivate
 
 G_DEFINE_TYPE (NaFixedTip, na_fixed_tip, GTK_TYPE_WINDOW)
 
+static void na_fixed_tip_parent_size_allocated (GtkWidget     *parent,
+                                                GtkAllocation *allocation,
+                                                NaFixedTip    *fixedtip);
+static void na_fixed_tip_parent_screen_changed (GtkWidget     *parent,
+                                                GdkScreen     *new_screen,
+                                                NaFixedTip    *fixedtip);
+
 static gboolean
 button_press_handler (GtkWidget      *fixedtip,
                       GdkEventButton *event,
@@ -79,11 +86,24 @@ na_fixed_tip_draw (GtkWidget *widget, cairo_t *cr)
   return FALSE;
 }
 
+static void
+na_fixed_tip_dispose (GObject *object)
+{
+  NaFixedTip *fixedtip = NA_FIXED_TIP (object);
+
+  na_fixed_tip_set_parent (GTK_WIDGET (fixedtip), NULL,
+                           fixedtip->priv->orientation);
+
+  G_OBJECT_CLASS (na_fixed_tip_parent_class)->dispose (object);
+}
+
 static void
 na_fixed_tip_class_init (NaFixedTipClass *class)
 {
+  GObjectClass *gobject_class = G_OBJECT_CLASS (class);
   GtkWidgetClass *widget_class = GTK_WIDGET_CLASS (class);
 
+  gobject_class->dispose = na_fixed_tip_dispose;
   widget_class->draw = na_fixed_tip_draw;
 
   fixedtip_signals[CLICKED] =
@@ -141,6 +161,9 @@ na_fixed_tip_position (NaFixedTip *fixedtip)
   int             screen_width;
   int             screen_height;
 
+  if (fixedtip->priv->parent == NULL)
+    return;
+
   screen = gtk_widget_get_screen (fixedtip->priv->parent);
   parent_window = gtk_widget_get_window (fixedtip->priv->parent);
 
@@ -211,8 +234,6 @@ na_fixed_tip_new (GtkWidget      *parent,
                            "type", GTK_WINDOW_POPUP,
                            NULL);
 
-  fixedtip->priv->parent = parent;
-
 #if 0
   //FIXME: would be nice to be able to get the toplevel for the tip, but this
   //doesn't work
@@ -225,8 +246,45 @@ na_fixed_tip_new (GtkWidget      *parent,
     */
 #endif
 
+  na_fixed_tip_set_parent (GTK_WIDGET (fixedtip), parent, orientation);
+
+  return GTK_WIDGET (fixedtip);
+}
+
+/* Attach the tip to another widget, so that tip windows can be reused */
+void
+na_fixed_tip_set_parent (GtkWidget      *widget,
+                         GtkWidget      *parent,
+                         GtkOrientation  orientation)
+{
+  NaFixedTip *fixedtip;
+
+  g_return_if_fail (NA_IS_FIXED_TIP (widget));
+
+  fixedtip = NA_FIXED_TIP (widget);
+
+  if (fixedtip->priv->parent != NULL)
+    {
+      g_signal_handlers_disconnect_by_func (fixedtip->priv->parent,
+                                            na_fixed_tip_parent_size_allocated,
+                                            fixedtip);
+      g_signal_handlers_disconnect_by_func (fixedtip->priv->parent,
+                                            na_fixed_tip_parent_screen_changed,
+                                            fixedtip);
+      g_object_remove_weak_pointer (G_OBJECT (fixedtip->priv->parent),
+                                    (gpointer *) &fixedtip->priv->parent);
+    }
+
+  fixedtip->priv->parent = parent;
   fixedtip->priv->orientation = orientation;
 
+  if (parent == NULL)
+    return;
+
+  /* The parent may go away while the tip is sitting unused */
+  g_object_add_weak_pointer (G_OBJECT (parent),
+                             (gpointer *) &fixedtip->priv->parent);
+
   //FIXME: would be nice to move the tip when the notification area moves
   g_signal_connect_object (parent, "size-allocate",
                            G_CALLBACK (na_fixed_tip_parent_size_allocated),
@@ -236,8 +294,6 @@ na_fixed_tip_new (GtkWidget      *parent,
                            fixedtip, 0);
 
   na_fixed_tip_position (fixedtip);
-
-  return GTK_WIDGET (fixedtip);
 }
 
 void
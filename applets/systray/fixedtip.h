@@ -57,6 +57,10 @@ GType      na_fixed_tip_get_type (void);
 GtkWidget *na_fixed_tip_new (GtkWidget      *parent,
                              GtkOrientation  orientation);
 
+void       na_fixed_tip_set_parent (GtkWidget      *widget,
+                                    GtkWidget      *parent,
+                                    GtkOrientation  orientation);
+
 void       na_fixed_tip_set_markup (GtkWidget  *widget,
                                     const char *markup_text);
 
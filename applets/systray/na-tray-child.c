@@ -28,14 +28,90 @@
 #include <gdk/gdkx.h>
 #include <X11/Xatom.h>
 
+/* A composited plug that hasn't repainted this long after we asked it to is
+ * considered to have stopped responding */
+#define REPAINT_TIMEOUT (5 * G_USEC_PER_SEC)
+
 G_DEFINE_TYPE (NaTrayChild, na_tray_child, GTK_TYPE_SOCKET)
 
+static gboolean
+repaint_timeout_cb (gpointer data)
+{
+  NaTrayChild *child = data;
+
+  child->repaint_timeout_id = 0;
+  na_tray_child_check_health (child);
+
+  return FALSE;
+}
+
+static void
+na_tray_child_expect_repaint (NaTrayChild *child)
+{
+  /* We only see the repaints of composited plugs, the others draw straight
+   * to the screen */
+  if (!child->composited)
+    return;
+
+  if (child->repaint_requested == 0)
+    {
+      child->repaint_requested = g_get_monotonic_time ();
+      /* Check once the plug is late, a repaint cancels the check */
+      child->repaint_timeout_id = g_timeout_add (REPAINT_TIMEOUT / 1000 + 1,
+                                                 repaint_timeout_cb, child);
+    }
+  else
+    na_tray_child_check_health (child);
+}
+
 static void
 na_tray_child_finalize (GObject *object)
 {
+  NaTrayChild *child = NA_TRAY_CHILD (object);
+
+  if (child->repaint_timeout_id)
+    g_source_remove (child->repaint_timeout_id);
+
+  if (child->cache)
+    cairo_surface_destroy (child->cache);
+
   G_OBJECT_CLASS (na_tray_child_parent_class)->finalize (object);
 }
 
+static int
+get_damage_event_base (Display *xdisplay)
+{
+  static int event_base = -1;
+  int opcode, error_base;
+
+  if (event_base == -1 &&
+      !XQueryExtension (xdisplay, "DAMAGE", &opcode, &event_base, &error_base))
+    event_base = 0;
+
+  return event_base;
+}
+
+/* GDK turns damage on composited windows into invalidations of the parent,
+ * which doesn't tell us whether the icon itself changed. Watch the damage
+ * events to know when the cached surface is stale. */
+static GdkFilterReturn
+na_tray_child_damage_filter (GdkXEvent *xev,
+                             GdkEvent  *event,
+                             gpointer   data)
+{
+  XEvent *xevent = (XEvent *) xev;
+  NaTrayChild *child = data;
+  int event_base;
+
+  event_base = get_damage_event_base (xevent->xany.display);
+
+  /* XDamageNotify is the first damage event */
+  if (event_base != 0 && xevent->type == event_base)
+    child->cache_dirty = TRUE;
+
+  return GDK_FILTER_CONTINUE;
+}
+
 static void
 na_tray_child_realize (GtkWidget *widget)
 {
@@ -85,6 +161,58 @@ na_tray_child_realize (GtkWidget *widget)
    */
   gtk_widget_set_double_buffered (GTK_WIDGET (child),
                                   child->parent_relative_bg);
+
+  gdk_window_add_filter (window, na_tray_child_damage_filter, child);
+  child->cache_dirty = TRUE;
+}
+
+static void
+na_tray_child_unrealize (GtkWidget *widget)
+{
+  NaTrayChild *child = NA_TRAY_CHILD (widget);
+
+  gdk_window_remove_filter (gtk_widget_get_window (widget),
+                            na_tray_child_damage_filter, child);
+
+  if (child->cache)
+    {
+      cairo_surface_destroy (child->cache);
+      child->cache = NULL;
+    }
+
+  GTK_WIDGET_CLASS (na_tray_child_parent_class)->unrealize (widget);
+}
+
+/* In normalized mode the size the client asks for is ignored, so a
+ * misbehaving icon can't make the tray relayout */
+static void
+na_tray_child_get_preferred_width (GtkWidget *widget,
+                                   gint      *minimal_width,
+                                   gint      *natural_width)
+{
+  NaTrayChild *child = NA_TRAY_CHILD (widget);
+
+  if (child->normalized)
+    *minimal_width = *natural_width = child->normalized_size;
+  else
+    GTK_WIDGET_CLASS (na_tray_child_parent_class)->get_preferred_width (widget,
+                                                                        minimal_width,
+                                                                        natural_width);
+}
+
+static void
+na_tray_child_get_preferred_height (GtkWidget *widget,
+                                    gint      *minimal_height,
+                                    gint      *natural_height)
+{
+  NaTrayChild *child = NA_TRAY_CHILD (widget);
+
+  if (child->normalized)
+    *minimal_height = *natural_height = child->normalized_size;
+  else
+    GTK_WIDGET_CLASS (na_tray_child_parent_class)->get_preferred_height (widget,
+                                                                         minimal_height,
+                                                                         natural_height);
 }
 
 static void
@@ -161,6 +289,12 @@ na_tray_child_size_allocate (GtkWidget      *widget,
   GTK_WIDGET_CLASS (na_tray_child_parent_class)->size_allocate (widget,
                                                                 allocation);
 
+  if (resized)
+    {
+      child->cache_dirty = TRUE;
+      na_tray_child_expect_repaint (child);
+    }
+
   if ((moved || resized) && gtk_widget_get_mapped (widget))
     {
       if (na_tray_child_has_alpha (NA_TRAY_CHILD (widget)))
@@ -180,6 +314,10 @@ na_tray_child_draw (GtkWidget *widget,
                     cairo_t   *cr)
 {
   NaTrayChild *child = NA_TRAY_CHILD (widget);
+  GdkRectangle area;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
 
   if (na_tray_child_has_alpha (child))
     {
@@ -214,9 +352,29 @@ na_tray_child_draw (GtkWidget *widget,
                                           clip_rect.width, clip_rect.height);
     }
 
+  /* The tray paints and accounts composited children itself */
+  if (!na_tray_child_has_alpha (child) && !na_tray_child_is_normalized (child))
+    {
+      if (!gdk_cairo_get_clip_rectangle (cr, &area))
+        area.width = area.height = 0;
+      na_tray_child_record_draw (child, &area, g_get_monotonic_time () - start);
+    }
+
   return FALSE;
 }
 
+static void
+na_tray_child_plug_added (GtkSocket *socket)
+{
+  NaTrayChild *child = NA_TRAY_CHILD (socket);
+
+  if (child->dock_time != 0)
+    child->embed_latency = g_get_monotonic_time () - child->dock_time;
+
+  /* A healthy plug paints itself right after being embedded */
+  na_tray_child_expect_repaint (child);
+}
+
 static void
 na_tray_child_init (NaTrayChild *child)
 {
@@ -227,15 +385,21 @@ na_tray_child_class_init (NaTrayChildClass *klass)
 {
   GObjectClass *gobject_class;
   GtkWidgetClass *widget_class;
+  GtkSocketClass *socket_class;
 
   gobject_class = (GObjectClass *)klass;
   widget_class = (GtkWidgetClass *)klass;
+  socket_class = (GtkSocketClass *)klass;
 
   gobject_class->finalize = na_tray_child_finalize;
   widget_class->style_set = na_tray_child_style_set;
   widget_class->realize = na_tray_child_realize;
+  widget_class->unrealize = na_tray_child_unrealize;
+  widget_class->get_preferred_width = na_tray_child_get_preferred_width;
+  widget_class->get_preferred_height = na_tray_child_get_preferred_height;
   widget_class->size_allocate = na_tray_child_size_allocate;
   widget_class->draw = na_tray_child_draw;
+  socket_class->plug_added = na_tray_child_plug_added;
 }
 
 GtkWidget *
@@ -392,6 +556,164 @@ na_tray_child_set_composited (NaTrayChild *child,
                                composited);
 }
 
+/**
+ * na_tray_child_set_normalized;
+ * @child: a #NaTrayChild
+ * @size: the icon size in pixels, or 0 to turn normalization off
+ *
+ * Makes @child take exactly @size pixels square whatever the client asks
+ * for. When the display supports compositing, the child is also redirected
+ * offscreen and its contents are scaled into a cached surface, which the
+ * parent paints with na_tray_child_paint_normalized(). The cache is only
+ * refreshed when the icon is damaged.
+ */
+void
+na_tray_child_set_normalized (NaTrayChild *child,
+                              gint         size)
+{
+  GtkWidget *widget;
+  gboolean   normalized;
+
+  g_return_if_fail (NA_IS_TRAY_CHILD (child));
+
+  widget = GTK_WIDGET (child);
+  normalized = size > 0;
+
+  if (child->normalized == normalized && child->normalized_size == size)
+    return;
+
+  child->normalized = normalized;
+  child->normalized_size = MAX (size, 0);
+
+  gtk_widget_set_halign (widget, normalized ? GTK_ALIGN_CENTER : GTK_ALIGN_FILL);
+  gtk_widget_set_valign (widget, normalized ? GTK_ALIGN_CENTER : GTK_ALIGN_FILL);
+
+  if (normalized &&
+      gdk_display_supports_composite (gtk_widget_get_display (widget)))
+    na_tray_child_set_composited (child, TRUE);
+  else
+    na_tray_child_set_composited (child, child->has_alpha);
+
+  /* The size changed, start over with a new surface */
+  if (child->cache)
+    {
+      cairo_surface_destroy (child->cache);
+      child->cache = NULL;
+    }
+
+  gtk_widget_queue_resize (widget);
+}
+
+/**
+ * na_tray_child_is_normalized;
+ * @child: a #NaTrayChild
+ *
+ * Return value: %TRUE if the parent has to paint @child with
+ * na_tray_child_paint_normalized()
+ */
+gboolean
+na_tray_child_is_normalized (NaTrayChild *child)
+{
+  g_return_val_if_fail (NA_IS_TRAY_CHILD (child), FALSE);
+
+  return child->normalized && child->composited;
+}
+
+static void
+na_tray_child_update_cache (NaTrayChild *child)
+{
+  GdkWindow *window, *plug_window;
+  cairo_t *cr;
+  int size;
+  int x, y, width, height;
+  double scale;
+
+  window = gtk_widget_get_window (GTK_WIDGET (child));
+  plug_window = gtk_socket_get_plug_window (GTK_SOCKET (child));
+  size = child->normalized_size;
+
+  x = y = 0;
+  width = gdk_window_get_width (window);
+  height = gdk_window_get_height (window);
+
+  /* Clients with fixed size hints may keep a plug of another size than
+   * ours, scale whatever they drew to fit */
+  if (plug_window)
+    {
+      gdk_error_trap_push ();
+      gdk_window_get_geometry (plug_window, &x, &y, &width, &height);
+      gdk_error_trap_pop_ignored ();
+    }
+
+  cr = cairo_create (child->cache);
+
+  cairo_set_operator (cr, CAIRO_OPERATOR_SOURCE);
+  cairo_set_source_rgba (cr, 0, 0, 0, 0);
+  cairo_paint (cr);
+
+  if (width > 0 && height > 0)
+    {
+      scale = MIN ((double) size / width, (double) size / height);
+
+      cairo_translate (cr,
+                       (size - width * scale) / 2,
+                       (size - height * scale) / 2);
+      cairo_scale (cr, scale, scale);
+
+      gdk_cairo_set_source_window (cr, window, -x, -y);
+      cairo_pattern_set_filter (cairo_get_source (cr), CAIRO_FILTER_GOOD);
+      cairo_set_operator (cr, CAIRO_OPERATOR_OVER);
+      cairo_rectangle (cr, 0, 0, width, height);
+      cairo_fill (cr);
+    }
+
+  cairo_destroy (cr);
+
+  child->cache_dirty = FALSE;
+}
+
+/**
+ * na_tray_child_paint_normalized;
+ * @child: a normalized #NaTrayChild
+ * @cr: the cairo context of the parent
+ * @x: where to paint @child
+ * @y: where to paint @child
+ *
+ * Paints the cached surface of @child, refreshing it first if the icon was
+ * damaged since the last time.
+ */
+void
+na_tray_child_paint_normalized (NaTrayChild *child,
+                                cairo_t     *cr,
+                                gint         x,
+                                gint         y)
+{
+  GdkWindow *window;
+
+  g_return_if_fail (NA_IS_TRAY_CHILD (child));
+
+  window = gtk_widget_get_window (GTK_WIDGET (child));
+  if (window == NULL || child->normalized_size <= 0)
+    return;
+
+  if (child->cache == NULL)
+    {
+      child->cache = gdk_window_create_similar_surface (window,
+                                                        CAIRO_CONTENT_COLOR_ALPHA,
+                                                        child->normalized_size,
+                                                        child->normalized_size);
+      child->cache_dirty = TRUE;
+    }
+
+  if (child->cache_dirty)
+    na_tray_child_update_cache (child);
+
+  cairo_save (cr);
+  cairo_set_source_surface (cr, child->cache, x, y);
+  cairo_paint (cr);
+  cairo_restore (cr);
+}
+
 /* If we are faking transparency with a window-relative background, force a
  * redraw of the icon. This should be called if the background changes or if
  * the child is shifted with respect to the background.
@@ -524,3 +846,108 @@ na_tray_child_get_wm_class (NaTrayChild  *child,
                 res_class,
                 res_name);
 }
+
+/**
+ * na_tray_child_record_draw:
+ * @child: a #NaTrayChild
+ * @area: the area of @child that was repainted
+ * @elapsed: time spent painting, in microseconds
+ *
+ * Accounts a repaint of @child in its statistics.
+ */
+void
+na_tray_child_record_draw (NaTrayChild        *child,
+                           const GdkRectangle *area,
+                           gint64              elapsed)
+{
+  g_return_if_fail (NA_IS_TRAY_CHILD (child));
+
+  child->n_draws++;
+  child->damage_area += (guint64) MAX (area->width, 0) * MAX (area->height, 0);
+  child->draw_time += elapsed;
+
+  child->repaint_requested = 0;
+  child->unresponsive = FALSE;
+
+  if (child->repaint_timeout_id)
+    {
+      g_source_remove (child->repaint_timeout_id);
+      child->repaint_timeout_id = 0;
+    }
+}
+
+/**
+ * na_tray_child_check_health:
+ * @child: a #NaTrayChild
+ *
+ * Checks that the plug window still exists and, for composited children,
+ * that it repainted after it was last embedded or resized.
+ *
+ * Return value: %FALSE if the plug looks like it stopped responding
+ */
+gboolean
+na_tray_child_check_health (NaTrayChild *child)
+{
+  XWindowAttributes window_attributes;
+  GdkDisplay *display;
+  gboolean unresponsive;
+  int result;
+
+  g_return_val_if_fail (NA_IS_TRAY_CHILD (child), FALSE);
+
+  display = gtk_widget_get_display (GTK_WIDGET (child));
+
+  gdk_error_trap_push ();
+  result = XGetWindowAttributes (GDK_DISPLAY_XDISPLAY (display),
+                                 child->icon_window,
+                                 &window_attributes);
+  gdk_error_trap_pop_ignored ();
+
+  unresponsive = !result ||
+    (child->repaint_requested != 0 &&
+     g_get_monotonic_time () - child->repaint_requested > REPAINT_TIMEOUT);
+
+  if (unresponsive && !child->unresponsive)
+    {
+      char *res_class = NULL;
+
+      na_tray_child_get_wm_class (child, NULL, &res_class);
+      g_warning ("Tray icon %s (0x%lx) stopped responding",
+                 res_class ? res_class : "(unknown)", child->icon_window);
+      g_free (res_class);
+    }
+
+  child->unresponsive = unresponsive;
+
+  return !unresponsive;
+}
+
+/**
+ * na_tray_child_print_stats:
+ * @child: a #NaTrayChild
+ *
+ * Prints the embedding and drawing statistics of @child to stderr, keyed by
+ * its WM_CLASS.
+ */
+void
+na_tray_child_print_stats (NaTrayChild *child)
+{
+  char *res_class = NULL;
+
+  g_return_if_fail (NA_IS_TRAY_CHILD (child));
+
+  na_tray_child_check_health (child);
+  na_tray_child_get_wm_class (child, NULL, &res_class);
+
+  g_printerr ("%-24s 0x%08lx embed %7.1f ms  draws %6u  damage %10" G_GUINT64_FORMAT " px  "
+              "draw %7.1f ms%s\n",
+              res_class ? res_class : "(unknown)",
+              child->icon_window,
+              child->embed_latency / 1000.0,
+              child->n_draws,
+              child->damage_area,
+              child->draw_time / 1000.0,
+              child->unresponsive ? "  NOT RESPONDING" : "");
+
+  g_free (res_class);
+}
@@ -46,6 +46,23 @@ struct _NaTrayChild
   guint has_alpha : 1;
   guint composited : 1;
   guint parent_relative_bg : 1;
+  guint unresponsive : 1;
+  guint normalized : 1;
+  guint cache_dirty : 1;
+
+  /* Normalized mode: the icon is composited into a cached surface of
+   * normalized_size pixels square */
+  gint             normalized_size;
+  cairo_surface_t *cache;
+
+  /* Statistics, times are in microseconds */
+  gint64  dock_time;         /* when the dock request arrived */
+  gint64  embed_latency;     /* dock request to plug-added */
+  gint64  repaint_requested; /* when we started waiting for a repaint */
+  guint   repaint_timeout_id;
+  guint   n_draws;
+  guint64 damage_area;       /* in pixels */
+  gint64  draw_time;
 };
 
 struct _NaTrayChildClass
@@ -65,6 +82,18 @@ void            na_tray_child_force_redraw   (NaTrayChild  *child);
 void            na_tray_child_get_wm_class   (NaTrayChild  *child,
 					      char        **res_name,
 					      char        **res_class);
+void            na_tray_child_set_normalized (NaTrayChild  *child,
+                                              gint          size);
+gboolean        na_tray_child_is_normalized  (NaTrayChild  *child);
+void            na_tray_child_paint_normalized (NaTrayChild *child,
+                                                cairo_t     *cr,
+                                                gint         x,
+                                                gint         y);
+void            na_tray_child_record_draw    (NaTrayChild  *child,
+                                              const GdkRectangle *area,
+                                              gint64        elapsed);
+gboolean        na_tray_child_check_health   (NaTrayChild  *child);
+void            na_tray_child_print_stats    (NaTrayChild  *child);
 
 G_END_DECLS
 
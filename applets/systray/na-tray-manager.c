@@ -47,7 +47,8 @@ enum
 
 enum {
   PROP_0,
-  PROP_ORIENTATION
+  PROP_ORIENTATION,
+  PROP_N_PENDING
 };
 
 typedef struct
@@ -62,6 +63,14 @@ typedef struct
 #endif
 } PendingMessage;
 
+typedef struct
+{
+#ifdef GDK_WINDOWING_X11
+  Window window;
+#endif
+  gint64 time; /* when the dock request arrived */
+} PendingDock;
+
 static guint manager_signals[LAST_SIGNAL];
 
 #define SYSTEM_TRAY_REQUEST_DOCK    0
@@ -71,6 +80,11 @@ static guint manager_signals[LAST_SIGNAL];
 #define SYSTEM_TRAY_ORIENTATION_HORZ 0
 #define SYSTEM_TRAY_ORIENTATION_VERT 1
 
+/* Dock requests are embedded in batches so that a session start with lots of
+ * tray clients doesn't hammer the X server in one go. */
+#define DOCK_BATCH_SIZE     4
+#define DOCK_BATCH_INTERVAL 100 /* ms */
+
 #ifdef GDK_WINDOWING_X11
 static gboolean na_tray_manager_check_running_screen_x11 (GdkScreen *screen);
 #endif
@@ -95,6 +109,12 @@ na_tray_manager_init (NaTrayManager *manager)
   manager->invisible = NULL;
   manager->socket_table = g_hash_table_new (NULL, NULL);
 
+  g_queue_init (&manager->pending_docks);
+  manager->pending_table = g_hash_table_new (NULL, NULL);
+  manager->max_icons = 0;
+  manager->dock_source_id = 0;
+  manager->last_dock_batch = 0;
+
   manager->padding = 0;
   manager->icon_size = 0;
 
@@ -138,6 +158,17 @@ na_tray_manager_class_init (NaTrayManagerClass *klass)
 						      G_PARAM_STATIC_NAME |
 						      G_PARAM_STATIC_NICK |
 						      G_PARAM_STATIC_BLURB));
+
+  g_object_class_install_property (gobject_class,
+				   PROP_N_PENDING,
+				   g_param_spec_uint ("n-pending",
+						      "Pending icons",
+						      "Number of icons queued before being embedded",
+						      0, G_MAXUINT, 0,
+						      G_PARAM_READABLE |
+						      G_PARAM_STATIC_NAME |
+						      G_PARAM_STATIC_NICK |
+						      G_PARAM_STATIC_BLURB));
   
   manager_signals[TRAY_ICON_ADDED] =
     g_signal_new ("tray_icon_added",
@@ -204,6 +235,7 @@ na_tray_manager_finalize (GObject *object)
 
   g_list_free (manager->messages);
   g_hash_table_destroy (manager->socket_table);
+  g_hash_table_destroy (manager->pending_table);
   
   G_OBJECT_CLASS (na_tray_manager_parent_class)->finalize (object);
 }
@@ -240,6 +272,9 @@ na_tray_manager_get_property (GObject    *object,
     case PROP_ORIENTATION:
       g_value_set_enum (value, manager->orientation);
       break;
+    case PROP_N_PENDING:
+      g_value_set_uint (value, na_tray_manager_get_n_pending (manager));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -258,6 +293,8 @@ na_tray_manager_new (void)
 
 #ifdef GDK_WINDOWING_X11
 
+static void na_tray_manager_schedule_docks (NaTrayManager *manager);
+
 static gboolean
 na_tray_manager_plug_removed (GtkSocket       *socket,
 			      NaTrayManager   *manager)
@@ -268,28 +305,44 @@ na_tray_manager_plug_removed (GtkSocket       *socket,
                        GINT_TO_POINTER (child->icon_window));
   g_signal_emit (manager, manager_signals[TRAY_ICON_REMOVED], 0, child);
 
+  /* A slot may have been freed for a queued icon */
+  na_tray_manager_schedule_docks (manager);
+
   /* This destroys the socket. */
   return FALSE;
 }
 
+/* Sockets can also go away with their tray without the plug being removed
+ * first, don't leave them behind in the table */
 static void
-na_tray_manager_handle_dock_request (NaTrayManager       *manager,
-				     XClientMessageEvent *xevent)
+na_tray_manager_socket_destroyed (GtkWidget     *socket,
+                                  NaTrayManager *manager)
 {
-  Window icon_window = xevent->data.l[2];
-  GtkWidget *child;
+  NaTrayChild *child = NA_TRAY_CHILD (socket);
 
   if (g_hash_table_lookup (manager->socket_table,
-                           GINT_TO_POINTER (icon_window)))
-    {
-      /* We already got this notification earlier, ignore this one */
-      return;
-    }
+                           GINT_TO_POINTER (child->icon_window)) != socket)
+    return;
+
+  g_hash_table_remove (manager->socket_table,
+                       GINT_TO_POINTER (child->icon_window));
+
+  na_tray_manager_schedule_docks (manager);
+}
+
+static void
+na_tray_manager_embed_icon (NaTrayManager *manager,
+			    Window         icon_window,
+			    gint64         dock_time)
+{
+  GtkWidget *child;
 
   child = na_tray_child_new (manager->screen, icon_window);
   if (child == NULL) /* already gone or other error */
     return;
 
+  NA_TRAY_CHILD (child)->dock_time = dock_time;
+
   g_signal_emit (manager, manager_signals[TRAY_ICON_ADDED], 0,
 		 child);
 
@@ -316,9 +369,174 @@ na_tray_manager_handle_dock_request (NaTrayManager       *manager,
 
   g_hash_table_insert (manager->socket_table,
                        GINT_TO_POINTER (icon_window), child);
+  g_signal_connect_object (child, "destroy",
+                           G_CALLBACK (na_tray_manager_socket_destroyed),
+                           manager, 0);
   gtk_widget_show (child);
 }
 
+static gboolean
+na_tray_manager_can_embed (NaTrayManager *manager)
+{
+  return manager->max_icons == 0 ||
+         g_hash_table_size (manager->socket_table) < manager->max_icons;
+}
+
+static gboolean
+na_tray_manager_embed_next (NaTrayManager *manager)
+{
+  PendingDock *dock;
+
+  dock = g_queue_pop_head (&manager->pending_docks);
+  if (dock == NULL)
+    return FALSE;
+
+  g_hash_table_remove (manager->pending_table, GINT_TO_POINTER (dock->window));
+
+  na_tray_manager_embed_icon (manager, dock->window, dock->time);
+
+  g_slice_free (PendingDock, dock);
+
+  return TRUE;
+}
+
+static void
+na_tray_manager_clear_pending (NaTrayManager *manager)
+{
+  PendingDock *dock;
+
+  while ((dock = g_queue_pop_head (&manager->pending_docks)) != NULL)
+    g_slice_free (PendingDock, dock);
+
+  g_hash_table_remove_all (manager->pending_table);
+}
+
+static gint
+pending_dock_compare (gconstpointer a,
+                      gconstpointer b)
+{
+  const PendingDock *dock = a;
+
+  return dock->window == *(const Window *) b ? 0 : 1;
+}
+
+/* Queued icon windows are watched, so the ones which go away before they
+ * are embedded don't count as pending any more */
+static GdkFilterReturn
+na_tray_manager_pending_filter (GdkXEvent *xev,
+                                GdkEvent  *event,
+                                gpointer   data)
+{
+  XEvent        *xevent = (GdkXEvent *)xev;
+  NaTrayManager *manager = data;
+  Window         window;
+  GList         *link;
+
+  if (xevent->type != DestroyNotify)
+    return GDK_FILTER_CONTINUE;
+
+  window = xevent->xdestroywindow.window;
+  if (!g_hash_table_remove (manager->pending_table, GINT_TO_POINTER (window)))
+    return GDK_FILTER_CONTINUE;
+
+  link = g_queue_find_custom (&manager->pending_docks, &window,
+                              pending_dock_compare);
+  if (link != NULL)
+    {
+      g_slice_free (PendingDock, link->data);
+      g_queue_delete_link (&manager->pending_docks, link);
+    }
+
+  g_object_notify (G_OBJECT (manager), "n-pending");
+
+  return GDK_FILTER_CONTINUE;
+}
+
+static gboolean
+na_tray_manager_dock_batch (gpointer data)
+{
+  NaTrayManager *manager = data;
+  int            n;
+
+  manager->dock_source_id = 0;
+  manager->last_dock_batch = g_get_monotonic_time ();
+
+  /* Windows which went away while queued fail cheaply in
+   * na_tray_child_new(), so a dock/undock storm costs next to nothing */
+  for (n = 0; n < DOCK_BATCH_SIZE && na_tray_manager_can_embed (manager); n++)
+    {
+      if (!na_tray_manager_embed_next (manager))
+        break;
+    }
+
+  if (n > 0)
+    g_object_notify (G_OBJECT (manager), "n-pending");
+
+  na_tray_manager_schedule_docks (manager);
+
+  return FALSE;
+}
+
+static void
+na_tray_manager_schedule_docks (NaTrayManager *manager)
+{
+  gint64 elapsed;
+
+  if (manager->dock_source_id != 0 ||
+      g_queue_is_empty (&manager->pending_docks) ||
+      !na_tray_manager_can_embed (manager))
+    return;
+
+  elapsed = (g_get_monotonic_time () - manager->last_dock_batch) / 1000;
+
+  if (elapsed >= DOCK_BATCH_INTERVAL)
+    manager->dock_source_id = g_idle_add (na_tray_manager_dock_batch,
+                                          manager);
+  else
+    manager->dock_source_id = g_timeout_add (DOCK_BATCH_INTERVAL - elapsed,
+                                             na_tray_manager_dock_batch,
+                                             manager);
+}
+
+static void
+na_tray_manager_handle_dock_request (NaTrayManager       *manager,
+				     XClientMessageEvent *xevent)
+{
+  Window       icon_window = xevent->data.l[2];
+  PendingDock *dock;
+  GdkDisplay  *display;
+
+  if (icon_window == None ||
+      g_hash_table_lookup (manager->socket_table,
+                           GINT_TO_POINTER (icon_window)) ||
+      g_hash_table_contains (manager->pending_table,
+                             GINT_TO_POINTER (icon_window)))
+    {
+      /* We already got this notification earlier, ignore this one */
+      return;
+    }
+
+  /* Queue the icon, it gets embedded by the next batch if there is room for
+   * it, or when the tray asks for it with na_tray_manager_embed_pending() */
+  dock = g_slice_new (PendingDock);
+  dock->window = icon_window;
+  dock->time = g_get_monotonic_time ();
+
+  g_queue_push_tail (&manager->pending_docks, dock);
+  g_hash_table_add (manager->pending_table, GINT_TO_POINTER (icon_window));
+
+  /* Get a DestroyNotify if the window goes away while it waits */
+  display = gdk_screen_get_display (manager->screen);
+  gdk_x11_display_error_trap_push (display);
+  XSelectInput (GDK_DISPLAY_XDISPLAY (display), icon_window,
+                StructureNotifyMask);
+  gdk_x11_display_error_trap_pop_ignored (display);
+
+  g_object_notify (G_OBJECT (manager), "n-pending");
+
+  na_tray_manager_schedule_docks (manager);
+}
+
 static void
 pending_message_free (PendingMessage *message)
 {
@@ -483,7 +701,7 @@ na_tray_manager_window_filter (GdkXEvent *xev,
                xevent->xclient.data.l[1]    == SYSTEM_TRAY_BEGIN_MESSAGE)
         {
           na_tray_manager_handle_begin_message (manager,
-                                                (XClientMessageEvent *) event);
+                                                (XClientMessageEvent *) xevent);
           return GDK_FILTER_REMOVE;
         }
       /* _NET_SYSTEM_TRAY_OPCODE: SYSTEM_TRAY_CANCEL_MESSAGE */
@@ -491,14 +709,14 @@ na_tray_manager_window_filter (GdkXEvent *xev,
                xevent->xclient.data.l[1]    == SYSTEM_TRAY_CANCEL_MESSAGE)
         {
           na_tray_manager_handle_cancel_message (manager,
-                                                 (XClientMessageEvent *) event);
+                                                 (XClientMessageEvent *) xevent);
           return GDK_FILTER_REMOVE;
         }
       /* _NET_SYSTEM_TRAY_MESSAGE_DATA */
       else if (xevent->xclient.message_type == manager->message_data_atom)
         {
           na_tray_manager_handle_message_data (manager,
-                                               (XClientMessageEvent *) event);
+                                               (XClientMessageEvent *) xevent);
           return GDK_FILTER_REMOVE;
         }
     }
@@ -538,6 +756,13 @@ na_tray_manager_unmanage (NaTrayManager *manager)
   if (manager->invisible == NULL)
     return;
 
+  if (manager->dock_source_id != 0)
+    {
+      g_source_remove (manager->dock_source_id);
+      manager->dock_source_id = 0;
+    }
+  na_tray_manager_clear_pending (manager);
+
   invisible = manager->invisible;
   window = gtk_widget_get_window (invisible);
 
@@ -560,6 +785,8 @@ na_tray_manager_unmanage (NaTrayManager *manager)
 
   gdk_window_remove_filter (window,
                             na_tray_manager_window_filter, manager);  
+  gdk_window_remove_filter (NULL,
+                            na_tray_manager_pending_filter, manager);
 
   manager->invisible = NULL; /* prior to destroy for reentrancy paranoia */
   gtk_widget_destroy (invisible);
@@ -840,6 +1067,8 @@ na_tray_manager_manage_screen_x11 (NaTrayManager *manager,
 #endif
       gdk_window_add_filter (window,
                              na_tray_manager_window_filter, manager);
+      gdk_window_add_filter (NULL,
+                             na_tray_manager_pending_filter, manager);
       return TRUE;
     }
   else
@@ -981,3 +1210,66 @@ na_tray_manager_get_orientation (NaTrayManager *manager)
 
   return manager->orientation;
 }
+
+/**
+ * na_tray_manager_set_max_icons:
+ * @manager: a #NaTrayManager
+ * @max_icons: the maximum number of embedded icons, or 0 for no limit
+ *
+ * Limits how many icons are embedded at once. Icons docking beyond the limit
+ * are queued until a slot frees up or na_tray_manager_embed_pending() is
+ * called.
+ */
+void
+na_tray_manager_set_max_icons (NaTrayManager *manager,
+                               guint          max_icons)
+{
+  g_return_if_fail (NA_IS_TRAY_MANAGER (manager));
+
+  if (manager->max_icons == max_icons)
+    return;
+
+  manager->max_icons = max_icons;
+
+#ifdef GDK_WINDOWING_X11
+  na_tray_manager_schedule_docks (manager);
+#endif
+}
+
+guint
+na_tray_manager_get_n_pending (NaTrayManager *manager)
+{
+  g_return_val_if_fail (NA_IS_TRAY_MANAGER (manager), 0);
+
+  return g_queue_get_length (&manager->pending_docks);
+}
+
+/**
+ * na_tray_manager_embed_pending:
+ * @manager: a #NaTrayManager
+ *
+ * Embeds all the queued icons now, ignoring the icon limit.
+ */
+void
+na_tray_manager_embed_pending (NaTrayManager *manager)
+{
+#ifdef GDK_WINDOWING_X11
+  g_return_if_fail (NA_IS_TRAY_MANAGER (manager));
+
+  if (g_queue_is_empty (&manager->pending_docks))
+    return;
+
+  if (manager->dock_source_id != 0)
+    {
+      g_source_remove (manager->dock_source_id);
+      manager->dock_source_id = 0;
+    }
+
+  while (na_tray_manager_embed_next (manager))
+    ;
+
+  manager->last_dock_batch = g_get_monotonic_time ();
+
+  g_object_notify (G_OBJECT (manager), "n-pending");
+#endif
+}
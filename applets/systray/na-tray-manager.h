@@ -65,6 +65,13 @@ struct _NaTrayManager
 
   GList *messages;
   GHashTable *socket_table;
+
+  /* Dock requests waiting to be embedded, oldest first */
+  GQueue      pending_docks;
+  GHashTable *pending_table;
+  guint       max_icons;
+  guint       dock_source_id;
+  gint64      last_dock_batch;
 };
 
 struct _NaTrayManagerClass
@@ -107,6 +114,10 @@ void            na_tray_manager_set_colors      (NaTrayManager      *manager,
 						 GdkColor           *error,
 						 GdkColor           *warning,
 						 GdkColor           *success);
+void            na_tray_manager_set_max_icons   (NaTrayManager      *manager,
+						 guint               max_icons);
+guint           na_tray_manager_get_n_pending   (NaTrayManager      *manager);
+void            na_tray_manager_embed_pending   (NaTrayManager      *manager);
 
 
 G_END_DECLS
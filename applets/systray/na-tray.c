@@ -22,7 +22,10 @@
 #include <config.h>
 #include <string.h>
 
+#include <signal.h>
+#include <glib-unix.h>
 #include <gtk/gtk.h>
+#include <gdk/gdkx.h>
 
 #include "na-tray-manager.h"
 #include "fixedtip.h"
@@ -31,13 +34,23 @@
 
 #define ICON_SPACING 1
 #define MIN_BOX_SIZE 3
+#define DEFAULT_ICON_SIZE 24 /* until we know how thick the tray is */
 
+#define MAX_TIP_WINDOWS     4 /* balloon windows per screen */
+#define MAX_QUEUED_MESSAGES 8 /* balloon messages queued per icon */
+
+/* One per screen, shared by all the trays on that screen */
 typedef struct
 {
+  GdkScreen     *screen;
   NaTrayManager *tray_manager;
   GSList        *all_trays;
   GHashTable    *icon_table;
   GHashTable    *tip_table;
+
+  GQueue         tip_pool;        /* unused balloon windows */
+  guint          n_tip_windows;
+  GQueue         tip_waiting;     /* IconTips waiting for a window */
 } TraysScreen;
 
 struct _NaTrayPrivate
@@ -47,6 +60,24 @@ struct _NaTrayPrivate
 
   GtkWidget *box;
   GtkWidget *frame;
+  GtkWidget *inner;
+
+  /* Icons which don't fit in box end up in the overflow popup */
+  GtkWidget *overflow_button;
+  GtkWidget *overflow_arrow;
+  GtkWidget *overflow_window;
+  GtkWidget *overflow_box;
+  gint       max_icons;
+  gint       n_icons;
+  gint       n_overflow;
+
+  /* Size icons are normalized to: -1 when off, 0 to follow the thickness
+   * of the tray */
+  gint       normalize_size;
+  gint       thickness;
+
+  /* New icons go to this tray when there are several on the screen */
+  gboolean   preferred;
 
   guint idle_redraw_id;
 
@@ -62,12 +93,20 @@ typedef struct
 
 typedef struct
 {
+  TraysScreen *trays_screen;
   NaTray *tray;      /* tray containing the tray icon */
   GtkWidget  *icon;      /* tray icon sending the message */
   GtkWidget  *fixedtip;
+  gulong      clicked_id;
   guint       source_id;
   glong       id;        /* id of the current message */
-  GSList     *buffer;    /* buffered messages */
+  char       *text;      /* text of the current message, NULL if none */
+  gboolean    waiting;   /* in trays_screen->tip_waiting */
+
+  /* Ring of buffered messages; when full the oldest one is dropped */
+  IconTipBuffer buffer[MAX_QUEUED_MESSAGES];
+  guint         buffer_head;
+  guint         buffer_len;
 } IconTip;
 
 enum
@@ -77,10 +116,12 @@ enum
   PROP_SCREEN
 };
 
-static gboolean     initialized   = FALSE;
-static TraysScreen *trays_screens = NULL;
+static GHashTable  *trays_screens = NULL; /* GdkScreen -> TraysScreen */
+static guint        stats_source  = 0;
 
 static void icon_tip_show_next (IconTip *icontip);
+static void update_overflow    (NaTray  *tray);
+static gint get_normalized_size (NaTray *tray);
 
 /* NaTray */
 
@@ -194,6 +235,51 @@ find_icon_position (NaTray    *tray,
   return position;
 }
 
+static int
+get_tray_monitor (NaTray *tray)
+{
+  GdkWindow *window;
+
+  window = gtk_widget_get_window (GTK_WIDGET (tray));
+  if (window == NULL)
+    return -1;
+
+  return gdk_screen_get_monitor_at_window (tray->priv->screen, window);
+}
+
+/* With several trays on a screen (one per monitor), icons go to the tray
+ * set with na_tray_set_preferred(), or else to the tray on the primary
+ * monitor, or else to the first tray. Where the client created the icon
+ * window says nothing, it is nearly always unmapped at 0,0. */
+static NaTray *
+find_tray_for_icon (TraysScreen *trays_screen,
+                    GtkWidget   *icon)
+{
+  NaTray *primary_tray;
+  GSList *l;
+  int     primary_monitor;
+
+  if (trays_screen->all_trays == NULL ||
+      trays_screen->all_trays->next == NULL)
+    return get_tray (trays_screen);
+
+  primary_monitor = gdk_screen_get_primary_monitor (trays_screen->screen);
+  primary_tray = NULL;
+
+  for (l = trays_screen->all_trays; l; l = l->next)
+    {
+      NaTray *tray = l->data;
+
+      if (tray->priv->preferred)
+        return tray;
+
+      if (primary_tray == NULL && get_tray_monitor (tray) == primary_monitor)
+        primary_tray = tray;
+    }
+
+  return primary_tray ? primary_tray : get_tray (trays_screen);
+}
+
 static void
 tray_added (NaTrayManager *manager,
             GtkWidget     *icon,
@@ -203,7 +289,7 @@ tray_added (NaTrayManager *manager,
   NaTrayPrivate *priv;
   int position;
 
-  tray = get_tray (trays_screen);
+  tray = find_tray_for_icon (trays_screen, icon);
   if (tray == NULL)
     return;
 
@@ -213,11 +299,25 @@ tray_added (NaTrayManager *manager,
 
   g_hash_table_insert (trays_screen->icon_table, icon, tray);
 
-  position = find_icon_position (tray, icon);
-  gtk_box_pack_start (GTK_BOX (priv->box), icon, FALSE, FALSE, 0);
-  gtk_box_reorder_child (GTK_BOX (priv->box), icon, position);
+  na_tray_child_set_normalized (NA_TRAY_CHILD (icon),
+                                get_normalized_size (tray));
+
+  if (priv->max_icons > 0 && priv->n_icons >= priv->max_icons)
+    {
+      gtk_box_pack_start (GTK_BOX (priv->overflow_box), icon, FALSE, FALSE, 0);
+      priv->n_overflow++;
+    }
+  else
+    {
+      position = find_icon_position (tray, icon);
+      gtk_box_pack_start (GTK_BOX (priv->box), icon, FALSE, FALSE, 0);
+      gtk_box_reorder_child (GTK_BOX (priv->box), icon, position);
+      priv->n_icons++;
+    }
 
   gtk_widget_show (icon);
+
+  update_overflow (tray);
 }
 
 static void
@@ -236,66 +336,280 @@ tray_removed (NaTrayManager *manager,
 
   g_assert (tray->priv->trays_screen == trays_screen);
 
-  gtk_container_remove (GTK_CONTAINER (priv->box), icon);
+  /* this will also release the tip window associated to this icon */
+  g_hash_table_remove (trays_screen->tip_table, icon);
+
+  if (gtk_widget_get_parent (icon) == priv->overflow_box)
+    {
+      gtk_container_remove (GTK_CONTAINER (priv->overflow_box), icon);
+      priv->n_overflow--;
+    }
+  else
+    {
+      gtk_container_remove (GTK_CONTAINER (priv->box), icon);
+      priv->n_icons--;
+    }
 
   g_hash_table_remove (trays_screen->icon_table, icon);
-  /* this will also destroy the tip associated to this icon */
-  g_hash_table_remove (trays_screen->tip_table, icon);
+
+  update_overflow (tray);
+}
+
+/* Hands @icon over to one of the remaining trays when its own tray goes away.
+ * The socket keeps its window while it is reparented, so the client stays
+ * embedded. */
+static void
+move_icon (TraysScreen *trays_screen,
+           GtkWidget   *icon)
+{
+  NaTray        *tray;
+  NaTrayPrivate *priv;
+  IconTip       *icontip;
+  GtkWidget     *box;
+  int            position;
+
+  tray = find_tray_for_icon (trays_screen, icon);
+  priv = tray->priv;
+
+  if (priv->max_icons > 0 && priv->n_icons >= priv->max_icons)
+    box = priv->overflow_box;
+  else
+    box = priv->box;
+
+  /* The sockets need a realized toplevel to live in */
+  if (gtk_widget_is_toplevel (gtk_widget_get_toplevel (box)))
+    gtk_widget_realize (box);
+
+  if (!gtk_widget_get_realized (icon) || !gtk_widget_get_realized (box))
+    {
+      /* Nothing to keep it in, it goes away with its tray */
+      g_hash_table_remove (trays_screen->tip_table, icon);
+      g_hash_table_remove (trays_screen->icon_table, icon);
+      return;
+    }
+
+  g_hash_table_insert (trays_screen->icon_table, icon, tray);
+
+  icontip = g_hash_table_lookup (trays_screen->tip_table, icon);
+  if (icontip != NULL)
+    icontip->tray = tray;
+
+  na_tray_child_set_normalized (NA_TRAY_CHILD (icon),
+                                get_normalized_size (tray));
+
+  if (box == priv->box)
+    {
+      position = find_icon_position (tray, icon);
+      gtk_widget_reparent (icon, box);
+      gtk_box_set_child_packing (GTK_BOX (box), icon,
+                                 FALSE, FALSE, 0, GTK_PACK_START);
+      gtk_box_reorder_child (GTK_BOX (box), icon, position);
+      priv->n_icons++;
+    }
+  else
+    {
+      gtk_widget_reparent (icon, box);
+      gtk_box_set_child_packing (GTK_BOX (box), icon,
+                                 FALSE, FALSE, 0, GTK_PACK_START);
+      priv->n_overflow++;
+    }
+
+  update_overflow (tray);
+}
+
+static void
+pending_changed (NaTrayManager *manager,
+                 GParamSpec    *pspec,
+                 TraysScreen   *trays_screen)
+{
+  GSList *l;
+
+  for (l = trays_screen->all_trays; l; l = l->next)
+    update_overflow (l->data);
+}
+
+static IconTipBuffer *
+icon_tip_buffer_nth (IconTip *icontip,
+                     guint    n)
+{
+  return &icontip->buffer[(icontip->buffer_head + n) % MAX_QUEUED_MESSAGES];
+}
+
+static IconTipBuffer *
+icon_tip_buffer_find (IconTip *icontip,
+                      glong    id)
+{
+  guint i;
+
+  for (i = 0; i < icontip->buffer_len; i++)
+    {
+      IconTipBuffer *buffer = icon_tip_buffer_nth (icontip, i);
+
+      if (buffer->id == id)
+        return buffer;
+    }
+
+  return NULL;
 }
 
 static void
-icon_tip_buffer_free (gpointer data,
-                      gpointer userdata)
+icon_tip_buffer_push (IconTip    *icontip,
+                      const char *text,
+                      glong       id,
+                      glong       timeout)
 {
   IconTipBuffer *buffer;
 
-  buffer = data;
+  if (icontip->buffer_len == MAX_QUEUED_MESSAGES)
+    {
+      /* Drop the oldest message to make room */
+      buffer = icon_tip_buffer_nth (icontip, 0);
+      g_free (buffer->text);
+      buffer->text = NULL;
+
+      icontip->buffer_head = (icontip->buffer_head + 1) % MAX_QUEUED_MESSAGES;
+      icontip->buffer_len--;
+    }
+
+  buffer = icon_tip_buffer_nth (icontip, icontip->buffer_len);
+  buffer->text    = g_strdup (text);
+  buffer->id      = id;
+  buffer->timeout = timeout;
+
+  icontip->buffer_len++;
+}
+
+/* Takes the oldest message; the caller owns buffer->text afterwards */
+static gboolean
+icon_tip_buffer_pop (IconTip       *icontip,
+                     IconTipBuffer *buffer)
+{
+  IconTipBuffer *head;
+
+  if (icontip->buffer_len == 0)
+    return FALSE;
+
+  head = icon_tip_buffer_nth (icontip, 0);
+  *buffer = *head;
+  head->text = NULL;
+
+  icontip->buffer_head = (icontip->buffer_head + 1) % MAX_QUEUED_MESSAGES;
+  icontip->buffer_len--;
+
+  return TRUE;
+}
+
+static void
+icon_tip_buffer_remove (IconTip       *icontip,
+                        IconTipBuffer *buffer)
+{
+  guint i;
 
   g_free (buffer->text);
   buffer->text = NULL;
 
-  g_free (buffer);
+  /* Close the gap, the ring is small enough for this not to matter */
+  for (i = 0; i < icontip->buffer_len; i++)
+    {
+      if (icon_tip_buffer_nth (icontip, i) == buffer)
+        break;
+    }
+
+  for (; i + 1 < icontip->buffer_len; i++)
+    *icon_tip_buffer_nth (icontip, i) = *icon_tip_buffer_nth (icontip, i + 1);
+
+  icon_tip_buffer_nth (icontip, icontip->buffer_len - 1)->text = NULL;
+  icontip->buffer_len--;
+}
+
+/* Balloon windows are shared between all the icons of a screen and reused,
+ * so a chatty icon doesn't keep creating new windows */
+static GtkWidget *
+tip_window_get (IconTip *icontip)
+{
+  TraysScreen    *trays_screen = icontip->trays_screen;
+  GtkOrientation  orientation;
+  GtkWidget      *fixedtip;
+
+  orientation = na_tray_get_orientation (icontip->tray);
+
+  fixedtip = g_queue_pop_head (&trays_screen->tip_pool);
+  if (fixedtip != NULL)
+    na_fixed_tip_set_parent (fixedtip, icontip->icon, orientation);
+  else if (trays_screen->n_tip_windows < MAX_TIP_WINDOWS)
+    {
+      fixedtip = na_fixed_tip_new (icontip->icon, orientation);
+      trays_screen->n_tip_windows++;
+    }
+
+  return fixedtip;
+}
+
+static void
+tip_window_release (TraysScreen *trays_screen,
+                    GtkWidget   *fixedtip)
+{
+  IconTip *icontip;
+
+  gtk_widget_hide (fixedtip);
+  na_fixed_tip_set_parent (fixedtip, NULL, GTK_ORIENTATION_HORIZONTAL);
+
+  g_queue_push_tail (&trays_screen->tip_pool, fixedtip);
+
+  /* Hand the window over to the next icon waiting for one */
+  icontip = g_queue_pop_head (&trays_screen->tip_waiting);
+  if (icontip != NULL)
+    {
+      icontip->waiting = FALSE;
+      icon_tip_show_next (icontip);
+    }
+}
+
+static void
+tip_windows_destroy (TraysScreen *trays_screen)
+{
+  GtkWidget *fixedtip;
+
+  while ((fixedtip = g_queue_pop_head (&trays_screen->tip_pool)) != NULL)
+    gtk_widget_destroy (fixedtip);
+
+  trays_screen->n_tip_windows = 0;
 }
 
 static void
 icon_tip_free (gpointer data)
 {
   IconTip *icontip;
+  guint    i;
 
   if (data == NULL)
     return;
 
   icontip = data;
 
-  if (icontip->fixedtip != NULL)
-    gtk_widget_destroy (GTK_WIDGET (icontip->fixedtip));
-  icontip->fixedtip = NULL;
-
   if (icontip->source_id != 0)
     g_source_remove (icontip->source_id);
   icontip->source_id = 0;
 
-  if (icontip->buffer != NULL)
-    {
-      g_slist_foreach (icontip->buffer, icon_tip_buffer_free, NULL);
-      g_slist_free (icontip->buffer);
-    }
-  icontip->buffer = NULL;
+  if (icontip->waiting)
+    g_queue_remove (&icontip->trays_screen->tip_waiting, icontip);
+  icontip->waiting = FALSE;
 
-  g_free (icontip);
-}
+  for (i = 0; i < icontip->buffer_len; i++)
+    g_free (icon_tip_buffer_nth (icontip, i)->text);
+  icontip->buffer_len = 0;
 
-static int
-icon_tip_buffer_compare (gconstpointer a,
-                         gconstpointer b)
-{
-  const IconTipBuffer *buffer_a = a;
-  const IconTipBuffer *buffer_b = b;
+  g_free (icontip->text);
+  icontip->text = NULL;
 
-  if (buffer_a == NULL || buffer_b == NULL)
-    return !(buffer_a == buffer_b);
+  if (icontip->fixedtip != NULL)
+    {
+      g_signal_handler_disconnect (icontip->fixedtip, icontip->clicked_id);
+      tip_window_release (icontip->trays_screen, icontip->fixedtip);
+    }
+  icontip->fixedtip = NULL;
 
-  return buffer_a->id - buffer_b->id;
+  g_free (icontip);
 }
 
 static void
@@ -310,53 +624,71 @@ icon_tip_show_next_timeout (gpointer data)
 {
   IconTip *icontip = (IconTip *) data;
 
+  icontip->source_id = 0;
+
   icon_tip_show_next (icontip);
 
   return FALSE;
 }
 
+static void
+icon_tip_set_timeout (IconTip *icontip,
+                      glong    timeout)
+{
+  if (icontip->source_id != 0)
+    g_source_remove (icontip->source_id);
+  icontip->source_id = 0;
+
+  if (timeout > 0)
+    icontip->source_id = g_timeout_add_seconds (timeout,
+                                                icon_tip_show_next_timeout,
+                                                icontip);
+}
+
 static void
 icon_tip_show_next (IconTip *icontip)
 {
-  IconTipBuffer *buffer;
+  IconTipBuffer buffer;
 
-  if (icontip->buffer == NULL)
+  if (icontip->buffer_len == 0)
     {
-      /* this will also destroy the tip window */
-      g_hash_table_remove (icontip->tray->priv->trays_screen->tip_table,
+      /* this will also release the tip window */
+      g_hash_table_remove (icontip->trays_screen->tip_table,
                            icontip->icon);
       return;
     }
 
-  if (icontip->source_id != 0)
-    g_source_remove (icontip->source_id);
-  icontip->source_id = 0;
-
-  buffer = icontip->buffer->data;
-  icontip->buffer = g_slist_remove (icontip->buffer, buffer);
-
   if (icontip->fixedtip == NULL)
     {
-      icontip->fixedtip = na_fixed_tip_new (icontip->icon,
-                                            na_tray_get_orientation (icontip->tray));
+      icontip->fixedtip = tip_window_get (icontip);
+
+      if (icontip->fixedtip == NULL)
+        {
+          /* All the windows are busy, wait for one to be released */
+          if (!icontip->waiting)
+            g_queue_push_tail (&icontip->trays_screen->tip_waiting, icontip);
+          icontip->waiting = TRUE;
+          return;
+        }
 
-      g_signal_connect (icontip->fixedtip, "clicked",
-                        G_CALLBACK (icon_tip_show_next_clicked), icontip);
+      icontip->clicked_id = g_signal_connect (icontip->fixedtip, "clicked",
+                                              G_CALLBACK (icon_tip_show_next_clicked),
+                                              icontip);
     }
 
-  na_fixed_tip_set_markup (icontip->fixedtip, buffer->text);
+  icon_tip_buffer_pop (icontip, &buffer);
+
+  na_fixed_tip_set_markup (icontip->fixedtip, buffer.text);
 
   if (!gtk_widget_get_mapped (icontip->fixedtip))
     gtk_widget_show (icontip->fixedtip);
 
-  icontip->id = buffer->id;
+  icontip->id = buffer.id;
 
-  if (buffer->timeout > 0)
-    icontip->source_id = g_timeout_add_seconds (buffer->timeout,
-                                                icon_tip_show_next_timeout,
-                                                icontip);
+  g_free (icontip->text);
+  icontip->text = buffer.text;
 
-  icon_tip_buffer_free (buffer, NULL);
+  icon_tip_set_timeout (icontip, buffer.timeout);
 }
 
 static void
@@ -368,17 +700,14 @@ message_sent (NaTrayManager *manager,
               TraysScreen   *trays_screen)
 {
   IconTip       *icontip;
-  IconTipBuffer  find_buffer;
-  IconTipBuffer *buffer;
+  IconTipBuffer *last;
   gboolean       show_now;
 
   icontip = g_hash_table_lookup (trays_screen->tip_table, icon);
 
-  find_buffer.id = id;
   if (icontip && 
-      (icontip->id == id ||
-       g_slist_find_custom (icontip->buffer, &find_buffer,
-                            icon_tip_buffer_compare) != NULL))
+      ((icontip->text != NULL && icontip->id == id) ||
+       icon_tip_buffer_find (icontip, id) != NULL))
     /* we already have this message, so ignore it */
     /* FIXME: in an ideal world, we'd remember all the past ids and ignore them
      * too */
@@ -402,6 +731,7 @@ message_sent (NaTrayManager *manager,
         }
 
       icontip = g_new0 (IconTip, 1);
+      icontip->trays_screen = trays_screen;
       icontip->tray = tray;
       icontip->icon = icon;
 
@@ -409,14 +739,30 @@ message_sent (NaTrayManager *manager,
 
       show_now = TRUE;
     }
+  else if (icontip->buffer_len == 0)
+    {
+      /* Repeating the message on screen only restarts its timeout */
+      if (icontip->text != NULL && strcmp (icontip->text, text) == 0)
+        {
+          icontip->id = id;
+          if (icontip->fixedtip != NULL)
+            icon_tip_set_timeout (icontip, timeout);
+          return;
+        }
+    }
+  else
+    {
+      /* Merge with the last queued message if it's the same */
+      last = icon_tip_buffer_nth (icontip, icontip->buffer_len - 1);
+      if (strcmp (last->text, text) == 0)
+        {
+          last->id = id;
+          last->timeout = timeout;
+          return;
+        }
+    }
 
-  buffer = g_new0 (IconTipBuffer, 1);
-
-  buffer->text    = g_strdup (text);
-  buffer->id      = id;
-  buffer->timeout = timeout;
-
-  icontip->buffer = g_slist_append (icontip->buffer, buffer);
+  icon_tip_buffer_push (icontip, text, id, timeout);
 
   if (show_now)
     icon_tip_show_next (icontip);
@@ -429,31 +775,27 @@ message_cancelled (NaTrayManager *manager,
                    TraysScreen   *trays_screen)
 {
   IconTip       *icontip;
-  IconTipBuffer  find_buffer;
-  GSList        *cancel_buffer_l;
   IconTipBuffer *cancel_buffer;
 
   icontip = g_hash_table_lookup (trays_screen->tip_table, icon);
   if (icontip == NULL)
     return;
 
-  if (icontip->id == id)
+  if (icontip->text != NULL && icontip->id == id)
     {
       icon_tip_show_next (icontip);
       return;
     }
 
-  find_buffer.id = id;
-  cancel_buffer_l = g_slist_find_custom (icontip->buffer, &find_buffer,
-                                         icon_tip_buffer_compare);
-  if (cancel_buffer_l == NULL)
+  cancel_buffer = icon_tip_buffer_find (icontip, id);
+  if (cancel_buffer == NULL)
     return;
 
-  cancel_buffer = cancel_buffer_l->data;
-  icon_tip_buffer_free (cancel_buffer, NULL);
+  icon_tip_buffer_remove (icontip, cancel_buffer);
 
-  icontip->buffer = g_slist_remove_link (icontip->buffer, cancel_buffer_l);
-  g_slist_free_1 (cancel_buffer_l);
+  /* Nothing shown and nothing left to show */
+  if (icontip->text == NULL && icontip->buffer_len == 0)
+    g_hash_table_remove (trays_screen->tip_table, icon);
 }
 
 static void
@@ -481,14 +823,21 @@ update_size_and_orientation (NaTray *tray)
 {
   NaTrayPrivate *priv = tray->priv;
 
+  gtk_orientable_set_orientation (GTK_ORIENTABLE (priv->inner), priv->orientation);
   gtk_orientable_set_orientation (GTK_ORIENTABLE (priv->box), priv->orientation);
+  gtk_orientable_set_orientation (GTK_ORIENTABLE (priv->overflow_box), priv->orientation);
+  gtk_arrow_set (GTK_ARROW (priv->overflow_arrow),
+                 priv->orientation == GTK_ORIENTATION_HORIZONTAL ?
+                 GTK_ARROW_DOWN : GTK_ARROW_RIGHT,
+                 GTK_SHADOW_NONE);
 
   /* This only happens when setting the property during object construction */
   if (!priv->trays_screen)
     return;
 
-  g_hash_table_foreach (priv->trays_screen->tip_table,
-                        update_orientation_for_messages, tray);
+  if (priv->trays_screen->tip_table)
+    g_hash_table_foreach (priv->trays_screen->tip_table,
+                          update_orientation_for_messages, tray);
 
   if (get_tray (priv->trays_screen) == tray)
     na_tray_manager_set_orientation (priv->trays_screen->tray_manager,
@@ -515,22 +864,41 @@ na_tray_draw_icon (GtkWidget *widget,
 		   gpointer   data)
 {
   cairo_t *cr = (cairo_t *) data;
+  NaTrayChild *child = NA_TRAY_CHILD (widget);
+  gboolean normalized;
+
+  normalized = na_tray_child_is_normalized (child);
 
-  if (na_tray_child_has_alpha (NA_TRAY_CHILD (widget)))
+  if (normalized || na_tray_child_has_alpha (child))
     {
       GtkAllocation allocation;
+      GdkRectangle area;
+      gint64 start;
 
       gtk_widget_get_allocation (widget, &allocation);
 
+      start = g_get_monotonic_time ();
+
       cairo_save (cr);
-      gdk_cairo_set_source_window (cr,
-                                   gtk_widget_get_window (widget),
-				   allocation.x,
-				   allocation.y);
       cairo_rectangle (cr, allocation.x, allocation.y, allocation.width, allocation.height);
       cairo_clip (cr);
-      cairo_paint (cr);
+      /* The clip is now the damaged part of the icon */
+      if (!gdk_cairo_get_clip_rectangle (cr, &area))
+        area.width = area.height = 0;
+      if (normalized)
+        na_tray_child_paint_normalized (child, cr, allocation.x, allocation.y);
+      else
+        {
+          gdk_cairo_set_source_window (cr,
+                                       gtk_widget_get_window (widget),
+                                       allocation.x,
+                                       allocation.y);
+          cairo_paint (cr);
+        }
       cairo_restore (cr);
+
+      na_tray_child_record_draw (NA_TRAY_CHILD (widget), &area,
+                                 g_get_monotonic_time () - start);
     }
 }
 
@@ -543,6 +911,121 @@ na_tray_draw_box (GtkWidget *box,
   gtk_container_foreach (GTK_CONTAINER (box), na_tray_draw_icon, cr);
 }
 
+/* Keep the manager embedding as many icons as fit in the boxes, plus the ones
+ * already living in the overflow popups. Once the boxes are full the rest stay
+ * queued in the manager until a popup is opened. */
+static void
+update_embed_limit (TraysScreen *trays_screen)
+{
+  GSList *l;
+  guint   limit = 0;
+
+  for (l = trays_screen->all_trays; l; l = l->next)
+    {
+      NaTrayPrivate *priv = NA_TRAY (l->data)->priv;
+
+      if (priv->max_icons == 0)
+        {
+          /* Some tray takes any number of icons */
+          limit = 0;
+          break;
+        }
+
+      limit += priv->max_icons + priv->n_overflow;
+    }
+
+  na_tray_manager_set_max_icons (trays_screen->tray_manager, limit);
+}
+
+static void
+update_overflow (NaTray *tray)
+{
+  NaTrayPrivate *priv = tray->priv;
+  guint          n_pending = 0;
+
+  if (priv->trays_screen && priv->trays_screen->tray_manager)
+    {
+      update_embed_limit (priv->trays_screen);
+      n_pending = na_tray_manager_get_n_pending (priv->trays_screen->tray_manager);
+    }
+
+  if (priv->max_icons > 0 && (priv->n_overflow > 0 || n_pending > 0))
+    gtk_widget_show (priv->overflow_button);
+  else
+    {
+      gtk_toggle_button_set_active (GTK_TOGGLE_BUTTON (priv->overflow_button),
+                                    FALSE);
+      gtk_widget_hide (priv->overflow_button);
+    }
+}
+
+static void
+overflow_position (NaTray *tray)
+{
+  NaTrayPrivate  *priv = tray->priv;
+  GdkScreen      *screen;
+  GtkAllocation   allocation;
+  GtkRequisition  req;
+  int             x, y;
+  int             screen_width, screen_height;
+
+  screen = gtk_widget_get_screen (priv->overflow_button);
+  gtk_window_set_screen (GTK_WINDOW (priv->overflow_window), screen);
+
+  gtk_widget_get_preferred_size (priv->overflow_window, &req, NULL);
+  gtk_widget_get_allocation (priv->overflow_button, &allocation);
+
+  gdk_window_get_origin (gtk_widget_get_window (priv->overflow_button), &x, &y);
+  x += allocation.x;
+  y += allocation.y;
+
+  screen_width = gdk_screen_get_width (screen);
+  screen_height = gdk_screen_get_height (screen);
+
+  /* Open away from the screen edge the panel sits on */
+  if (priv->orientation == GTK_ORIENTATION_VERTICAL)
+    {
+      if (x <= screen_width / 2)
+        x += allocation.width;
+      else
+        x -= req.width;
+    }
+  else
+    {
+      if (y <= screen_height / 2)
+        y += allocation.height;
+      else
+        y -= req.height;
+    }
+
+  /* Push onscreen */
+  x = CLAMP (x, 0, MAX (0, screen_width - req.width));
+  y = CLAMP (y, 0, MAX (0, screen_height - req.height));
+
+  gtk_window_move (GTK_WINDOW (priv->overflow_window), x, y);
+}
+
+static void
+overflow_toggled (GtkToggleButton *button,
+                  NaTray          *tray)
+{
+  NaTrayPrivate *priv = tray->priv;
+
+  if (gtk_toggle_button_get_active (button))
+    {
+      /* The sockets need a realized toplevel before they can embed */
+      gtk_widget_realize (priv->overflow_window);
+
+      if (priv->trays_screen && priv->trays_screen->tray_manager)
+        na_tray_manager_embed_pending (priv->trays_screen->tray_manager);
+
+      overflow_position (tray);
+      gtk_widget_show (priv->overflow_window);
+    }
+  else
+    gtk_widget_hide (priv->overflow_window);
+}
+
 static void
 na_tray_init (NaTray *tray)
 {
@@ -552,16 +1035,73 @@ na_tray_init (NaTray *tray)
 
   priv->screen = NULL;
   priv->orientation = GTK_ORIENTATION_HORIZONTAL;
+  priv->normalize_size = -1;
 
   priv->frame = gtk_alignment_new (0.5, 0.5, 1.0, 1.0);
   gtk_container_add (GTK_CONTAINER (tray), priv->frame);
   gtk_widget_show (priv->frame);
 
+  priv->inner = gtk_box_new (priv->orientation, ICON_SPACING);
+  gtk_container_add (GTK_CONTAINER (priv->frame), priv->inner);
+  gtk_widget_show (priv->inner);
+
   priv->box = gtk_box_new (priv->orientation, ICON_SPACING);
   g_signal_connect (priv->box, "draw",
                     G_CALLBACK (na_tray_draw_box), NULL);
-  gtk_container_add (GTK_CONTAINER (priv->frame), priv->box);
+  gtk_box_pack_start (GTK_BOX (priv->inner), priv->box, FALSE, FALSE, 0);
   gtk_widget_show (priv->box);
+
+  priv->overflow_button = gtk_toggle_button_new ();
+  gtk_button_set_relief (GTK_BUTTON (priv->overflow_button), GTK_RELIEF_NONE);
+  gtk_widget_set_name (priv->overflow_button, "MatchboxPanelSystemTrayOverflow");
+  g_signal_connect (priv->overflow_button, "toggled",
+                    G_CALLBACK (overflow_toggled), tray);
+  gtk_box_pack_start (GTK_BOX (priv->inner), priv->overflow_button,
+                      FALSE, FALSE, 0);
+
+  priv->overflow_arrow = gtk_arrow_new (GTK_ARROW_DOWN, GTK_SHADOW_NONE);
+  gtk_container_add (GTK_CONTAINER (priv->overflow_button), priv->overflow_arrow);
+  gtk_widget_show (priv->overflow_arrow);
+
+  priv->overflow_window = gtk_window_new (GTK_WINDOW_POPUP);
+  gtk_window_set_type_hint (GTK_WINDOW (priv->overflow_window),
+                            GDK_WINDOW_TYPE_HINT_DROPDOWN_MENU);
+  gtk_window_set_resizable (GTK_WINDOW (priv->overflow_window), FALSE);
+
+  priv->overflow_box = gtk_box_new (priv->orientation, ICON_SPACING);
+  g_signal_connect (priv->overflow_box, "draw",
+                    G_CALLBACK (na_tray_draw_box), NULL);
+  gtk_container_add (GTK_CONTAINER (priv->overflow_window), priv->overflow_box);
+  gtk_widget_show (priv->overflow_box);
+}
+
+static void
+print_icon_stats (gpointer key,
+                  gpointer value,
+                  gpointer data)
+{
+  na_tray_child_print_stats (NA_TRAY_CHILD (key));
+}
+
+/* Dump the per-icon statistics on SIGUSR1 */
+static gboolean
+print_stats (gpointer data)
+{
+  GHashTableIter  iter;
+  TraysScreen    *trays_screen;
+
+  g_hash_table_iter_init (&iter, trays_screens);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &trays_screen))
+    {
+      if (trays_screen->icon_table == NULL)
+        continue;
+
+      g_printerr ("System tray icons on screen %d:\n",
+                  gdk_screen_get_number (trays_screen->screen));
+      g_hash_table_foreach (trays_screen->icon_table, print_icon_stats, NULL);
+    }
+
+  return TRUE;
 }
 
 static GObject *
@@ -572,7 +1112,7 @@ na_tray_constructor (GType type,
   GObject *object;
   NaTray *tray;
   NaTrayPrivate *priv;
-  int screen_number;
+  TraysScreen *trays_screen;
 
   object = G_OBJECT_CLASS (na_tray_parent_class)->constructor (type,
                                                                n_construct_properties,
@@ -582,20 +1122,21 @@ na_tray_constructor (GType type,
 
   g_assert (priv->screen != NULL);
 
-  if (!initialized)
-    {
-      GdkDisplay *display;
-      int n_screens;
+  if (trays_screens == NULL)
+    trays_screens = g_hash_table_new (NULL, NULL);
 
-      display = gdk_display_get_default ();
-      n_screens = gdk_display_get_n_screens (display);
-      trays_screens = g_new0 (TraysScreen, n_screens);
-      initialized = TRUE;
-    }
+  if (stats_source == 0)
+    stats_source = g_unix_signal_add (SIGUSR1, print_stats, NULL);
 
-  screen_number = gdk_screen_get_number (priv->screen);
+  trays_screen = g_hash_table_lookup (trays_screens, priv->screen);
+  if (trays_screen == NULL)
+    {
+      trays_screen = g_new0 (TraysScreen, 1);
+      trays_screen->screen = priv->screen;
+      g_hash_table_insert (trays_screens, priv->screen, trays_screen);
+    }
 
-  if (trays_screens [screen_number].tray_manager == NULL)
+  if (trays_screen->tray_manager == NULL)
     {
       NaTrayManager *tray_manager;
 
@@ -603,40 +1144,40 @@ na_tray_constructor (GType type,
 
       if (na_tray_manager_manage_screen (tray_manager, priv->screen))
         {
-          trays_screens [screen_number].tray_manager = tray_manager;
+          trays_screen->tray_manager = tray_manager;
 
           g_signal_connect (tray_manager, "tray_icon_added",
                             G_CALLBACK (tray_added),
-                            &trays_screens [screen_number]);
+                            trays_screen);
           g_signal_connect (tray_manager, "tray_icon_removed",
                             G_CALLBACK (tray_removed),
-                            &trays_screens [screen_number]);
+                            trays_screen);
           g_signal_connect (tray_manager, "message_sent",
                             G_CALLBACK (message_sent),
-                            &trays_screens [screen_number]);
+                            trays_screen);
           g_signal_connect (tray_manager, "message_cancelled",
                             G_CALLBACK (message_cancelled),
-                            &trays_screens [screen_number]);
-
-          trays_screens [screen_number].icon_table = g_hash_table_new (NULL,
-                                                                       NULL);
-          trays_screens [screen_number].tip_table = g_hash_table_new_full (
-                                                                NULL,
-                                                                NULL,
-                                                                NULL,
-                                                                icon_tip_free);
+                            trays_screen);
+          g_signal_connect (tray_manager, "notify::n-pending",
+                            G_CALLBACK (pending_changed),
+                            trays_screen);
+
+          trays_screen->icon_table = g_hash_table_new (NULL, NULL);
+          trays_screen->tip_table = g_hash_table_new_full (NULL,
+                                                           NULL,
+                                                           NULL,
+                                                           icon_tip_free);
         }
       else
         {
           g_printerr ("System tray didn't get the system tray manager selection for screen %d\n",
-		      screen_number);
+		      gdk_screen_get_number (priv->screen));
           g_object_unref (tray_manager);
         }
     }
       
-  priv->trays_screen = &trays_screens [screen_number];
-  trays_screens [screen_number].all_trays = g_slist_append (trays_screens [screen_number].all_trays,
-                                                            tray);
+  priv->trays_screen = trays_screen;
+  trays_screen->all_trays = g_slist_append (trays_screen->all_trays, tray);
 
   update_size_and_orientation (tray);
 
@@ -656,29 +1197,77 @@ na_tray_dispose (GObject *object)
 
       if (trays_screen->all_trays == NULL)
         {
-          /* Make sure we drop the manager selection */
-          g_object_unref (trays_screen->tray_manager);
-          trays_screen->tray_manager = NULL;
+          if (trays_screen->tray_manager != NULL)
+            {
+              /* Make sure we drop the manager selection */
+              g_object_unref (trays_screen->tray_manager);
+              trays_screen->tray_manager = NULL;
+
+              g_hash_table_destroy (trays_screen->icon_table);
+              trays_screen->icon_table = NULL;
+
+              /* Don't hand out windows while tearing down the tips */
+              g_queue_clear (&trays_screen->tip_waiting);
+
+              g_hash_table_destroy (trays_screen->tip_table);
+              trays_screen->tip_table = NULL;
+
+              tip_windows_destroy (trays_screen);
+            }
 
-          g_hash_table_destroy (trays_screen->icon_table);
-          trays_screen->icon_table = NULL;
+          g_hash_table_remove (trays_screens, trays_screen->screen);
+          g_free (trays_screen);
 
-          g_hash_table_destroy (trays_screen->tip_table);
-          trays_screen->tip_table = NULL;
+          if (g_hash_table_size (trays_screens) == 0 && stats_source != 0)
+            {
+              g_source_remove (stats_source);
+              stats_source = 0;
+            }
         }
       else
         {
-          NaTray *new_tray;
+          NaTray         *new_tray;
+          GHashTableIter  iter;
+          gpointer        icon, icon_tray;
+          GSList         *icons, *l;
+
+          /* The remaining trays take over the icons of this one */
+          if (trays_screen->tray_manager != NULL)
+            {
+              icons = NULL;
+
+              g_hash_table_iter_init (&iter, trays_screen->icon_table);
+              while (g_hash_table_iter_next (&iter, &icon, &icon_tray))
+                {
+                  if (icon_tray == tray)
+                    icons = g_slist_prepend (icons, icon);
+                }
+
+              for (l = icons; l; l = l->next)
+                move_icon (trays_screen, l->data);
+
+              g_slist_free (icons);
+            }
 
           new_tray = get_tray (trays_screen);
-          if (new_tray != NULL)
-            na_tray_manager_set_orientation (trays_screen->tray_manager,
-                                             na_tray_get_orientation (new_tray));
+          if (new_tray != NULL && trays_screen->tray_manager != NULL)
+            {
+              na_tray_manager_set_orientation (trays_screen->tray_manager,
+                                               na_tray_get_orientation (new_tray));
+              update_overflow (new_tray);
+            }
         }
     }
 
   priv->trays_screen = NULL;
 
+  if (priv->overflow_window != NULL)
+    {
+      gtk_widget_destroy (priv->overflow_window);
+      priv->overflow_window = NULL;
+      priv->overflow_box = NULL;
+    }
+
   if (priv->idle_redraw_id != 0)
     {
       g_source_remove (priv->idle_redraw_id);
@@ -731,12 +1320,68 @@ na_tray_get_preferred_height (GtkWidget *widget,
                                    natural_height);
 }
 
+static gint
+get_normalized_size (NaTray *tray)
+{
+  NaTrayPrivate *priv = tray->priv;
+
+  if (priv->normalize_size < 0)
+    return 0;
+  else if (priv->normalize_size > 0)
+    return priv->normalize_size;
+  else if (priv->thickness > 0)
+    return priv->thickness;
+  else
+    return DEFAULT_ICON_SIZE;
+}
+
+static void
+normalize_icon (GtkWidget *icon,
+                gpointer   data)
+{
+  na_tray_child_set_normalized (NA_TRAY_CHILD (icon), GPOINTER_TO_INT (data));
+}
+
+static void
+update_normalized_icons (NaTray *tray)
+{
+  NaTrayPrivate *priv = tray->priv;
+  gint           size;
+
+  size = get_normalized_size (tray);
+
+  gtk_container_foreach (GTK_CONTAINER (priv->box),
+                         normalize_icon, GINT_TO_POINTER (size));
+  if (priv->overflow_box)
+    gtk_container_foreach (GTK_CONTAINER (priv->overflow_box),
+                           normalize_icon, GINT_TO_POINTER (size));
+
+  /* Let well-behaved clients draw at the right size in the first place */
+  if (size > 0 && priv->trays_screen && get_tray (priv->trays_screen) == tray)
+    na_tray_manager_set_icon_size (priv->trays_screen->tray_manager, size);
+}
+
 static void
 na_tray_size_allocate (GtkWidget        *widget,
                        GtkAllocation    *allocation)
 {
+  NaTray *tray = NA_TRAY (widget);
+  NaTrayPrivate *priv = tray->priv;
+  gint thickness;
+
   gtk_widget_size_allocate (gtk_bin_get_child (GTK_BIN (widget)), allocation);
   gtk_widget_set_allocation (widget, allocation);
+
+  thickness = priv->orientation == GTK_ORIENTATION_HORIZONTAL ?
+              allocation->height : allocation->width;
+
+  if (thickness != priv->thickness)
+    {
+      priv->thickness = thickness;
+
+      if (priv->normalize_size == 0)
+        update_normalized_icons (tray);
+    }
 }
 
 static void
@@ -814,6 +1459,8 @@ idle_redraw_cb (NaTray *tray)
   NaTrayPrivate *priv = tray->priv;
 
   gtk_container_foreach (GTK_CONTAINER (priv->box), (GtkCallback)na_tray_child_force_redraw, tray);
+  if (priv->overflow_box)
+    gtk_container_foreach (GTK_CONTAINER (priv->overflow_box), (GtkCallback)na_tray_child_force_redraw, tray);
   
   priv->idle_redraw_id = 0;
 
@@ -840,6 +1487,51 @@ na_tray_set_icon_size (NaTray *tray,
     na_tray_manager_set_icon_size (priv->trays_screen->tray_manager, size);
 }
 
+/* Show at most @max_icons icons in the tray itself, 0 meaning no limit. The
+ * remaining icons are only embedded when the overflow popup is opened. */
+void
+na_tray_set_max_icons (NaTray *tray,
+                       gint    max_icons)
+{
+  NaTrayPrivate *priv = tray->priv;
+
+  if (priv->max_icons == max_icons)
+    return;
+
+  priv->max_icons = MAX (max_icons, 0);
+
+  update_overflow (tray);
+}
+
+/* Normalize the icons to @size pixels: tray clients which ignore the icon
+ * size hint are composited offscreen and scaled, so they can't change the
+ * geometry of the tray. A @size of 0 follows the thickness of the tray, and
+ * a negative one turns normalization off. */
+void
+na_tray_set_normalize_icons (NaTray *tray,
+                             gint    size)
+{
+  NaTrayPrivate *priv = tray->priv;
+
+  size = MAX (size, -1);
+
+  if (priv->normalize_size == size)
+    return;
+
+  priv->normalize_size = size;
+
+  update_normalized_icons (tray);
+}
+
+/* Make @tray the one new icons are added to when there are several trays
+ * on the screen */
+void
+na_tray_set_preferred (NaTray   *tray,
+                       gboolean  preferred)
+{
+  tray->priv->preferred = preferred != FALSE;
+}
+
 void
 na_tray_set_colors (NaTray   *tray,
                     GdkColor *fg,
@@ -64,6 +64,12 @@ void            na_tray_set_padding     (NaTray        *tray,
 					 gint           padding);
 void            na_tray_set_icon_size   (NaTray        *tray,
 					 gint           icon_size);
+void            na_tray_set_max_icons   (NaTray        *tray,
+					 gint           max_icons);
+void            na_tray_set_normalize_icons (NaTray    *tray,
+					 gint           size);
+void            na_tray_set_preferred   (NaTray        *tray,
+					 gboolean       preferred);
 void            na_tray_set_colors      (NaTray        *tray,
 					 GdkColor      *fg,
 					 GdkColor      *error,
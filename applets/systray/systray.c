@@ -9,6 +9,8 @@
  */
 
 #include <config.h>
+#include <stdlib.h>
+#include <string.h>
 #include <gtk/gtk.h>
 #include <matchbox-panel/mb-panel.h>
 
@@ -28,6 +30,17 @@ on_realize (GtkWidget *widget, gpointer user_data)
 
   tray = (GtkWidget *)na_tray_new_for_screen (screen, orientation);
 
+  na_tray_set_max_icons (NA_TRAY (tray),
+                         GPOINTER_TO_INT (g_object_get_data (G_OBJECT (widget),
+                                                             "max-icons")));
+  if (g_object_get_data (G_OBJECT (widget), "normalize"))
+    na_tray_set_normalize_icons (NA_TRAY (tray),
+                                 GPOINTER_TO_INT (g_object_get_data (G_OBJECT (widget),
+                                                                     "normalize-size")));
+  na_tray_set_preferred (NA_TRAY (tray),
+                         GPOINTER_TO_INT (g_object_get_data (G_OBJECT (widget),
+                                                             "preferred")));
+
   gtk_widget_show (tray);
 
   gtk_container_add (GTK_CONTAINER (widget), tray);
@@ -38,11 +51,38 @@ mb_panel_applet_create (const char    *id,
                         GtkOrientation orientation)
 {
         GtkWidget *box;
+        char **options, **option;
 
         box = gtk_box_new (GTK_ORIENTATION_HORIZONTAL, 0);
 
         gtk_widget_set_name (box, "MatchboxPanelSystemTray");
 
+        /* The ID is a list of options separated by colons. A number limits
+           the number of icons shown in the panel, the others go into an
+           overflow popup. "normalize" scales every icon to the thickness of
+           the panel, or "normalize=SIZE" to SIZE pixels. With a panel on
+           every monitor, new icons go to the tray with the "preferred"
+           option, or else to the one on the primary monitor. */
+        options = g_strsplit (id ? id : "", ":", -1);
+        for (option = options; *option; option++) {
+                if (g_ascii_isdigit ((*option)[0])) {
+                        g_object_set_data (G_OBJECT (box), "max-icons",
+                                           GINT_TO_POINTER (atoi (*option)));
+                } else if (g_str_has_prefix (*option, "normalize")) {
+                        const char *size = *option + strlen ("normalize");
+
+                        g_object_set_data (G_OBJECT (box), "normalize",
+                                           GINT_TO_POINTER (TRUE));
+                        if (*size == '=')
+                                g_object_set_data (G_OBJECT (box), "normalize-size",
+                                                   GINT_TO_POINTER (atoi (size + 1)));
+                } else if (strcmp (*option, "preferred") == 0) {
+                        g_object_set_data (G_OBJECT (box), "preferred",
+                                           GINT_TO_POINTER (TRUE));
+                }
+        }
+        g_strfreev (options);
+
         g_signal_connect (box, "realize", G_CALLBACK (on_realize), GINT_TO_POINTER (orientation));
 
         gtk_widget_show (box);
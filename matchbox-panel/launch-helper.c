@@ -0,0 +1,247 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+
+/*
+ * Licensed under the GPL v2 or greater.
+ *
+ * matchbox-panel-launch-helper: spawns applications for the launchers, so
+ * that the panel never forks, and reports when they exit. It reads
+ * requests from the socket on LAUNCH_HELPER_FD and exits when the panel
+ * closes it.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "launch-helper.h"
+
+#define STARTUP_ID_VAR "DESKTOP_STARTUP_ID="
+
+typedef struct {
+        pid_t pid;
+        uint32_t serial;
+} Child;
+
+static Child *children = NULL;
+static size_t n_children = 0;
+
+static int sigchld_pipe[2];
+
+static void
+sigchld_handler (int sig)
+{
+        int saved_errno = errno;
+        ssize_t ret;
+
+        ret = write (sigchld_pipe[1], "", 1);
+        (void) ret;
+
+        errno = saved_errno;
+}
+
+static void
+send_reply (uint32_t serial, uint32_t type, int32_t pid, int32_t status)
+{
+        LaunchHelperReply reply;
+
+        reply.serial = serial;
+        reply.type = type;
+        reply.pid = pid;
+        reply.status = status;
+
+        /* The panel is gone */
+        if (send (LAUNCH_HELPER_FD, &reply, sizeof (reply), 0) == -1 &&
+            errno != EINTR)
+                exit (0);
+}
+
+static void
+reap_children (void)
+{
+        pid_t pid;
+        size_t i;
+        int status;
+
+        while ((pid = waitpid (-1, &status, WNOHANG)) > 0) {
+                for (i = 0; i < n_children; i++) {
+                        if (children[i].pid != pid)
+                                continue;
+
+                        send_reply (children[i].serial, LAUNCH_HELPER_EXITED,
+                                    pid, status);
+                        children[i] = children[--n_children];
+                        break;
+                }
+        }
+}
+
+/* Split the NUL-terminated strings from @p to @end into @strv, returning
+ * the end of the last one or NULL if there aren't @n of them */
+static char *
+split_strings (char *p, char *end, char **strv, uint32_t n)
+{
+        uint32_t i;
+        char *nul;
+
+        for (i = 0; i < n; i++) {
+                nul = memchr (p, '\0', end - p);
+                if (nul == NULL)
+                        return NULL;
+
+                strv[i] = p;
+                p = nul + 1;
+        }
+
+        strv[n] = NULL;
+
+        return p;
+}
+
+static void
+handle_request (char *buf, size_t len)
+{
+        LaunchHelperRequest request;
+        posix_spawnattr_t attr;
+        sigset_t mask;
+        char **argv, **envp, *startup_id, *p, *end = buf + len;
+        char *startup_var = NULL;
+        uint32_t i, j;
+        pid_t pid;
+        int err;
+
+        if (len < sizeof (request))
+                return;
+
+        memcpy (&request, buf, sizeof (request));
+        if (request.argc == 0 ||
+            request.argc > LAUNCH_HELPER_MAX_MESSAGE ||
+            request.envc > LAUNCH_HELPER_MAX_MESSAGE)
+                return;
+
+        argv = calloc (request.argc + 1, sizeof (char *));
+        envp = calloc (request.envc + 2, sizeof (char *));
+        if (argv == NULL || envp == NULL)
+                goto out;
+
+        p = buf + sizeof (request);
+        startup_id = p;
+        p = memchr (p, '\0', end - p);
+        if (p == NULL ||
+            (p = split_strings (p + 1, end, argv, request.argc)) == NULL ||
+            split_strings (p, end, envp, request.envc) == NULL) {
+                send_reply (request.serial, LAUNCH_HELPER_SPAWNED, -EINVAL, 0);
+                goto out;
+        }
+
+        /* Replace any startup ID inherited from the panel */
+        for (i = j = 0; i < request.envc; i++)
+                if (strncmp (envp[i], STARTUP_ID_VAR,
+                             strlen (STARTUP_ID_VAR)) != 0)
+                        envp[j++] = envp[i];
+
+        if (startup_id[0]) {
+                startup_var = malloc (strlen (STARTUP_ID_VAR) +
+                                      strlen (startup_id) + 1);
+                if (startup_var) {
+                        strcpy (startup_var, STARTUP_ID_VAR);
+                        strcat (startup_var, startup_id);
+                        envp[j++] = startup_var;
+                }
+        }
+        envp[j] = NULL;
+
+        posix_spawnattr_init (&attr);
+        sigemptyset (&mask);
+        posix_spawnattr_setsigmask (&attr, &mask);
+        sigaddset (&mask, SIGPIPE);
+        posix_spawnattr_setsigdefault (&attr, &mask);
+        posix_spawnattr_setflags (&attr,
+                                  POSIX_SPAWN_SETSIGMASK |
+                                  POSIX_SPAWN_SETSIGDEF);
+
+        err = posix_spawnp (&pid, argv[0], NULL, &attr, argv, envp);
+
+        posix_spawnattr_destroy (&attr);
+
+        if (err == 0) {
+                Child *c = realloc (children,
+                                    (n_children + 1) * sizeof (Child));
+                if (c) {
+                        children = c;
+                        children[n_children].pid = pid;
+                        children[n_children].serial = request.serial;
+                        n_children++;
+                }
+        }
+
+        send_reply (request.serial, LAUNCH_HELPER_SPAWNED,
+                    err == 0 ? pid : -err, 0);
+
+ out:
+        free (startup_var);
+        free (argv);
+        free (envp);
+}
+
+int
+main (int argc, char **argv)
+{
+        static char buf[LAUNCH_HELPER_MAX_MESSAGE];
+        struct sigaction sa;
+        struct pollfd fds[2];
+        ssize_t len;
+        char c;
+
+        if (pipe (sigchld_pipe) == -1)
+                return 1;
+
+        fcntl (sigchld_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl (sigchld_pipe[1], F_SETFL, O_NONBLOCK);
+        fcntl (sigchld_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl (sigchld_pipe[1], F_SETFD, FD_CLOEXEC);
+        fcntl (LAUNCH_HELPER_FD, F_SETFD, FD_CLOEXEC);
+
+        memset (&sa, 0, sizeof (sa));
+        sa.sa_handler = sigchld_handler;
+        sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+        sigaction (SIGCHLD, &sa, NULL);
+
+        signal (SIGPIPE, SIG_IGN);
+
+        fds[0].fd = LAUNCH_HELPER_FD;
+        fds[0].events = POLLIN;
+        fds[1].fd = sigchld_pipe[0];
+        fds[1].events = POLLIN;
+
+        for (;;) {
+                if (poll (fds, 2, -1) == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return 1;
+                }
+
+                if (fds[1].revents) {
+                        while (read (sigchld_pipe[0], &c, 1) == 1)
+                                ;
+                        reap_children ();
+                }
+
+                if (fds[0].revents) {
+                        len = recv (LAUNCH_HELPER_FD, buf, sizeof (buf), 0);
+                        if (len == -1 && errno == EINTR)
+                                continue;
+                        /* The panel closed the socket */
+                        if (len <= 0)
+                                return 0;
+
+                        handle_request (buf, len);
+                }
+        }
+}
@@ -0,0 +1,38 @@
+/*
+ * Licensed under the GPL v2 or greater.
+ *
+ * Protocol between the panel and matchbox-panel-launch-helper, over a
+ * SOCK_SEQPACKET socket so that every message arrives whole.
+ */
+
+#ifndef __LAUNCH_HELPER_H__
+#define __LAUNCH_HELPER_H__
+
+#include <stdint.h>
+
+/* The helper's end of the socket */
+#define LAUNCH_HELPER_FD 3
+
+#define LAUNCH_HELPER_MAX_MESSAGE 65536
+
+/* Followed by the startup ID, which may be empty, then @argc arguments and
+ * @envc environment variables, all NUL-terminated */
+typedef struct {
+        uint32_t serial;
+        uint32_t argc;
+        uint32_t envc;
+} LaunchHelperRequest;
+
+enum {
+        LAUNCH_HELPER_SPAWNED,
+        LAUNCH_HELPER_EXITED
+};
+
+typedef struct {
+        uint32_t serial;
+        uint32_t type;
+        int32_t pid;    /* SPAWNED: the child, or minus errno */
+        int32_t status; /* EXITED: the wait() status */
+} LaunchHelperReply;
+
+#endif /* __LAUNCH_HELPER_H__ */
@@ -0,0 +1,636 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+
+/*
+ * Licensed under the GPL v2 or greater.
+ *
+ * Index of the desktop entries in the XDG data directories, shared by the
+ * applets. The directories are scanned once and only the keys the panel
+ * uses are parsed. The index is kept in a cache file which is mapped
+ * straight into memory, and only rebuilt when the modification time of one
+ * of the directories changed. While the panel runs the directories are
+ * watched, and the index is rebuilt shortly after desktop entries change.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <gio/gio.h>
+
+#include "mb-panel.h"
+
+#define CACHE_MAGIC 0x44504d4d /* MMPD */
+#define CACHE_VERSION 2
+
+/* How long to wait for more changes before rebuilding, in milliseconds */
+#define RELOAD_DELAY 500
+
+/* All offsets are from the start of the cache, 0 meaning none */
+typedef struct {
+        guint32 magic;
+        guint32 version;
+        guint32 n_dirs;
+        guint32 n_entries;
+} CacheHeader;
+
+typedef struct {
+        guint32 path;
+        guint32 padding;
+        gint64 mtime;
+} CacheDir;
+
+typedef struct {
+        guint32 id;
+        guint32 name;
+        guint32 icon;
+        guint32 exec;
+        guint32 categories;
+        guint32 startup_notify;
+        guint32 no_display;
+} CacheEntry;
+
+static GBytes *cache = NULL;
+static MBPanelDesktopEntry *entries = NULL;
+static guint n_entries = 0;
+/* ID to MBPanelDesktopEntry */
+static GHashTable *entry_index = NULL;
+
+static GPtrArray *dir_monitors = NULL;
+static guint reload_id = 0;
+static GHookList monitors;
+
+/* The directories holding desktop entries, most important first */
+static char **
+get_dirs (void)
+{
+        const char * const *data_dirs;
+        char **dirs;
+        int i, n;
+
+        data_dirs = g_get_system_data_dirs ();
+        n = g_strv_length ((char **) data_dirs);
+
+        dirs = g_new (char *, n + 2);
+        dirs[0] = g_build_filename (g_get_user_data_dir (),
+                                    "applications", NULL);
+        for (i = 0; i < n; i++)
+                dirs[i + 1] = g_build_filename (data_dirs[i],
+                                                "applications", NULL);
+        dirs[n + 1] = NULL;
+
+        return dirs;
+}
+
+static gint64
+get_mtime (const char *path)
+{
+        GStatBuf st;
+
+        if (g_stat (path, &st) != 0)
+                return 0;
+
+        return st.st_mtime;
+}
+
+static char *
+get_cache_filename (void)
+{
+        return g_build_filename (g_get_user_cache_dir (),
+                                 "matchbox-panel",
+                                 "desktop-entries",
+                                 NULL);
+}
+
+/* Undo the escapes of a desktop entry string, like GKeyFile does */
+static char *
+unescape (const char *value, gsize len)
+{
+        char *result, *q;
+        const char *p;
+
+        result = q = g_malloc (len + 1);
+
+        for (p = value; p < value + len; p++) {
+                if (*p != '\\' || p + 1 == value + len) {
+                        *q++ = *p;
+                        continue;
+                }
+
+                switch (*++p) {
+                case 's':
+                        *q++ = ' ';
+                        break;
+                case 'n':
+                        *q++ = '\n';
+                        break;
+                case 't':
+                        *q++ = '\t';
+                        break;
+                case 'r':
+                        *q++ = '\r';
+                        break;
+                default:
+                        *q++ = *p;
+                        break;
+                }
+        }
+
+        *q = '\0';
+
+        return g_strstrip (result);
+}
+
+typedef struct {
+        char *name;
+        char *icon;
+        char *exec;
+        char *categories;
+        gboolean startup_notify;
+        gboolean no_display;
+} ParsedEntry;
+
+static void
+parsed_entry_free (ParsedEntry *entry)
+{
+        g_free (entry->name);
+        g_free (entry->icon);
+        g_free (entry->exec);
+        g_free (entry->categories);
+        g_slice_free (ParsedEntry, entry);
+}
+
+/* Read the keys we want from the Desktop Entry group of @filename, without
+ * building a whole GKeyFile */
+static ParsedEntry *
+parse_entry (const char *filename)
+{
+        ParsedEntry *entry;
+        char *contents, *line, *next, *eq, *end;
+        gboolean in_group = FALSE;
+        gsize length;
+
+        if (!g_file_get_contents (filename, &contents, &length, NULL))
+                return NULL;
+
+        entry = g_slice_new0 (ParsedEntry);
+
+        for (line = contents; line < contents + length; line = next) {
+                next = memchr (line, '\n', contents + length - line);
+                if (next)
+                        *next++ = '\0';
+                else
+                        next = contents + length;
+
+                if (line[0] == '[') {
+                        /* Only the first group matters */
+                        if (in_group)
+                                break;
+                        in_group = g_str_has_prefix (line, "[Desktop Entry]");
+                        continue;
+                }
+
+                if (!in_group || line[0] == '#' ||
+                    (eq = strchr (line, '=')) == NULL)
+                        continue;
+
+                for (end = eq; end > line && g_ascii_isspace (end[-1]); end--)
+                        ;
+                *end = '\0';
+
+                for (eq++; g_ascii_isspace (*eq); eq++)
+                        ;
+
+                if (strcmp (line, "Name") == 0 && entry->name == NULL)
+                        entry->name = unescape (eq, strlen (eq));
+                else if (strcmp (line, "Icon") == 0 && entry->icon == NULL)
+                        entry->icon = unescape (eq, strlen (eq));
+                else if (strcmp (line, "Exec") == 0 && entry->exec == NULL)
+                        entry->exec = unescape (eq, strlen (eq));
+                else if (strcmp (line, "Categories") == 0 &&
+                         entry->categories == NULL)
+                        entry->categories = unescape (eq, strlen (eq));
+                else if (strcmp (line, "StartupNotify") == 0)
+                        entry->startup_notify = g_str_has_prefix (eq, "true");
+                else if (strcmp (line, "NoDisplay") == 0 ||
+                         strcmp (line, "Hidden") == 0)
+                        entry->no_display |= g_str_has_prefix (eq, "true");
+        }
+
+        g_free (contents);
+
+        if (!in_group) {
+                parsed_entry_free (entry);
+                return NULL;
+        }
+
+        return entry;
+}
+
+static guint32
+add_string (GString *buffer, const char *str)
+{
+        guint32 offset;
+
+        if (str == NULL)
+                return 0;
+
+        offset = buffer->len;
+        g_string_append_len (buffer, str, strlen (str) + 1);
+
+        return offset;
+}
+
+/* Scan @dirs and serialize the index in the cache format */
+static GBytes *
+build_cache (char **dirs)
+{
+        GHashTable *parsed;
+        GHashTableIter iter;
+        GString *buffer;
+        CacheHeader *header;
+        CacheDir *cache_dirs;
+        CacheEntry *cache_entries;
+        ParsedEntry *entry;
+        const char *id;
+        guint32 n_dirs, i;
+        gsize size;
+
+        parsed = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                        (GDestroyNotify) parsed_entry_free);
+
+        n_dirs = g_strv_length (dirs);
+        for (i = 0; i < n_dirs; i++) {
+                const char *name;
+                GDir *dir;
+
+                dir = g_dir_open (dirs[i], 0, NULL);
+                if (dir == NULL)
+                        continue;
+
+                while ((name = g_dir_read_name (dir))) {
+                        char *filename, *entry_id;
+
+                        if (!g_str_has_suffix (name, ".desktop"))
+                                continue;
+
+                        entry_id = g_strndup (name,
+                                              strlen (name) - strlen (".desktop"));
+
+                        /* The first directory wins */
+                        if (g_hash_table_contains (parsed, entry_id)) {
+                                g_free (entry_id);
+                                continue;
+                        }
+
+                        filename = g_build_filename (dirs[i], name, NULL);
+                        entry = parse_entry (filename);
+                        g_free (filename);
+
+                        if (entry)
+                                g_hash_table_insert (parsed, entry_id, entry);
+                        else
+                                g_free (entry_id);
+                }
+
+                g_dir_close (dir);
+        }
+
+        /* Fixed-size parts first, then the strings */
+        size = sizeof (CacheHeader) +
+               n_dirs * sizeof (CacheDir) +
+               g_hash_table_size (parsed) * sizeof (CacheEntry);
+        buffer = g_string_sized_new (size * 4);
+        g_string_set_size (buffer, size);
+        memset (buffer->str, 0, size);
+
+        for (i = 0; i < n_dirs; i++) {
+                guint32 path = add_string (buffer, dirs[i]);
+
+                cache_dirs = (CacheDir *) (buffer->str + sizeof (CacheHeader));
+                cache_dirs[i].path = path;
+                cache_dirs[i].mtime = get_mtime (dirs[i]);
+        }
+
+        i = 0;
+        g_hash_table_iter_init (&iter, parsed);
+        while (g_hash_table_iter_next (&iter, (gpointer *) &id,
+                                       (gpointer *) &entry)) {
+                CacheEntry e;
+
+                e.id = add_string (buffer, id);
+                e.name = add_string (buffer, entry->name);
+                e.icon = add_string (buffer, entry->icon);
+                e.exec = add_string (buffer, entry->exec);
+                e.categories = add_string (buffer, entry->categories);
+                e.startup_notify = entry->startup_notify;
+                e.no_display = entry->no_display;
+
+                /* The buffer may have moved */
+                cache_entries = (CacheEntry *) (buffer->str +
+                                                sizeof (CacheHeader) +
+                                                n_dirs * sizeof (CacheDir));
+                cache_entries[i++] = e;
+        }
+
+        header = (CacheHeader *) buffer->str;
+        header->magic = CACHE_MAGIC;
+        header->version = CACHE_VERSION;
+        header->n_dirs = n_dirs;
+        header->n_entries = i;
+
+        g_hash_table_destroy (parsed);
+
+        size = buffer->len;
+        return g_bytes_new_take (g_string_free (buffer, FALSE), size);
+}
+
+static const char *
+get_string (const char *data, gsize size, guint32 offset)
+{
+        return (offset && offset < size) ? data + offset : NULL;
+}
+
+/* Check that @bytes is a well-formed cache of @dirs as they are now */
+static gboolean
+cache_is_valid (GBytes *bytes, char **dirs)
+{
+        const CacheHeader *header;
+        const CacheDir *cache_dirs;
+        const char *data, *path;
+        gsize size;
+        guint32 i;
+
+        data = g_bytes_get_data (bytes, &size);
+        header = (const CacheHeader *) data;
+
+        if (size < sizeof (CacheHeader) ||
+            data[size - 1] != '\0' ||
+            header->magic != CACHE_MAGIC ||
+            header->version != CACHE_VERSION ||
+            header->n_dirs != g_strv_length (dirs) ||
+            sizeof (CacheHeader) +
+            (gsize) header->n_dirs * sizeof (CacheDir) +
+            (gsize) header->n_entries * sizeof (CacheEntry) > size)
+                return FALSE;
+
+        cache_dirs = (const CacheDir *) (header + 1);
+        for (i = 0; i < header->n_dirs; i++) {
+                path = get_string (data, size, cache_dirs[i].path);
+                if (g_strcmp0 (path, dirs[i]) != 0 ||
+                    cache_dirs[i].mtime != get_mtime (dirs[i]))
+                        return FALSE;
+        }
+
+        return TRUE;
+}
+
+/* Point the entries into the cache and index them */
+static void
+load_cache (GBytes *bytes)
+{
+        const CacheHeader *header;
+        const CacheEntry *cache_entries;
+        const char *data;
+        gsize size;
+        guint32 i;
+
+        data = g_bytes_get_data (bytes, &size);
+        header = (const CacheHeader *) data;
+        cache_entries = (const CacheEntry *)
+                (data + sizeof (CacheHeader) +
+                 header->n_dirs * sizeof (CacheDir));
+
+        cache = bytes;
+        n_entries = header->n_entries;
+        entries = g_new0 (MBPanelDesktopEntry, n_entries);
+        entry_index = g_hash_table_new (g_str_hash, g_str_equal);
+
+        for (i = 0; i < n_entries; i++) {
+                MBPanelDesktopEntry *entry = &entries[i];
+
+                entry->id = get_string (data, size, cache_entries[i].id);
+                if (entry->id == NULL)
+                        continue;
+
+                entry->name = get_string (data, size, cache_entries[i].name);
+                entry->icon = get_string (data, size, cache_entries[i].icon);
+                entry->exec = get_string (data, size, cache_entries[i].exec);
+                entry->categories = get_string (data, size,
+                                                cache_entries[i].categories);
+                entry->startup_notify = cache_entries[i].startup_notify;
+                entry->no_display = cache_entries[i].no_display;
+
+                g_hash_table_insert (entry_index, (gpointer) entry->id, entry);
+        }
+}
+
+static void
+unload_cache (void)
+{
+        g_hash_table_destroy (entry_index);
+        entry_index = NULL;
+
+        g_free (entries);
+        entries = NULL;
+        n_entries = 0;
+
+        g_bytes_unref (cache);
+        cache = NULL;
+}
+
+/* Still use the index if the cache can't be written */
+static void
+write_cache (const char *filename, GBytes *bytes)
+{
+        GError *error = NULL;
+        char *dirname;
+
+        dirname = g_path_get_dirname (filename);
+        g_mkdir_with_parents (dirname, 0700);
+        g_free (dirname);
+
+        if (!g_file_set_contents (filename,
+                                  g_bytes_get_data (bytes, NULL),
+                                  g_bytes_get_size (bytes),
+                                  &error)) {
+                g_warning ("Cannot write %s: %s", filename, error->message);
+                g_error_free (error);
+        }
+}
+
+static gboolean
+reload (gpointer user_data)
+{
+        GBytes *bytes;
+        char **dirs, *filename;
+
+        reload_id = 0;
+
+        dirs = get_dirs ();
+        filename = get_cache_filename ();
+
+        bytes = build_cache (dirs);
+        write_cache (filename, bytes);
+
+        g_free (filename);
+        g_strfreev (dirs);
+
+        unload_cache ();
+        load_cache (bytes);
+
+        if (monitors.is_setup)
+                g_hook_list_invoke (&monitors, FALSE);
+
+        return FALSE;
+}
+
+static void
+dir_changed_cb (GFileMonitor     *monitor,
+                GFile            *file,
+                GFile            *other_file,
+                GFileMonitorEvent event_type,
+                gpointer          user_data)
+{
+        char *name;
+        gboolean is_entry;
+
+        /* Wait for whole files to be written */
+        if (event_type != G_FILE_MONITOR_EVENT_CHANGES_DONE_HINT &&
+            event_type != G_FILE_MONITOR_EVENT_CREATED &&
+            event_type != G_FILE_MONITOR_EVENT_DELETED)
+                return;
+
+        name = g_file_get_basename (file);
+        is_entry = g_str_has_suffix (name, ".desktop");
+        g_free (name);
+
+        if (!is_entry)
+                return;
+
+        /* Package managers change many files at once, only rebuild once
+         * they are done */
+        if (reload_id)
+                g_source_remove (reload_id);
+        reload_id = g_timeout_add (RELOAD_DELAY, reload, NULL);
+}
+
+/* Directories which don't exist yet are watched too, in case they are
+ * created later */
+static void
+watch_dirs (char **dirs)
+{
+        GFileMonitor *monitor;
+        GFile *file;
+        int i;
+
+        dir_monitors = g_ptr_array_new_with_free_func (g_object_unref);
+
+        for (i = 0; dirs[i]; i++) {
+                file = g_file_new_for_path (dirs[i]);
+                monitor = g_file_monitor_directory (file, G_FILE_MONITOR_NONE,
+                                                    NULL, NULL);
+                g_object_unref (file);
+
+                if (monitor == NULL)
+                        continue;
+
+                g_signal_connect (monitor, "changed",
+                                  G_CALLBACK (dir_changed_cb), NULL);
+                g_ptr_array_add (dir_monitors, monitor);
+        }
+}
+
+static void
+ensure_index (void)
+{
+        GMappedFile *mapped;
+        GBytes *bytes = NULL;
+        char **dirs, *filename;
+
+        if (entry_index)
+                return;
+
+        dirs = get_dirs ();
+        filename = get_cache_filename ();
+
+        mapped = g_mapped_file_new (filename, FALSE, NULL);
+        if (mapped) {
+                bytes = g_mapped_file_get_bytes (mapped);
+                g_mapped_file_unref (mapped);
+
+                if (!cache_is_valid (bytes, dirs)) {
+                        g_bytes_unref (bytes);
+                        bytes = NULL;
+                }
+        }
+
+        if (bytes == NULL) {
+                bytes = build_cache (dirs);
+                write_cache (filename, bytes);
+        }
+
+        load_cache (bytes);
+        watch_dirs (dirs);
+
+        g_free (filename);
+        g_strfreev (dirs);
+}
+
+/* Look up the desktop entry @id, the name of a file in an applications
+ * directory without the .desktop suffix. The entry is only valid until the
+ * monitors are told that the entries changed. */
+const MBPanelDesktopEntry *
+mb_panel_desktop_entry_lookup (const char *id)
+{
+        g_return_val_if_fail (id != NULL, NULL);
+
+        ensure_index ();
+
+        return g_hash_table_lookup (entry_index, id);
+}
+
+/* Get all the desktop entries, in no particular order. Entries without an
+ * ID are invalid and should be skipped. */
+const MBPanelDesktopEntry *
+mb_panel_desktop_entry_get_all (guint *n)
+{
+        ensure_index ();
+
+        if (n)
+                *n = n_entries;
+
+        return entries;
+}
+
+/* Call @func whenever the desktop entries changed, until
+ * mb_panel_desktop_remove_monitor() is called with the returned ID. The
+ * entries looked up before are invalid from then on. */
+guint
+mb_panel_desktop_add_monitor (MBPanelDesktopFunc func,
+                              gpointer           user_data)
+{
+        GHook *hook;
+
+        g_return_val_if_fail (func != NULL, 0);
+
+        if (!monitors.is_setup)
+                g_hook_list_init (&monitors, sizeof (GHook));
+
+        hook = g_hook_alloc (&monitors);
+        hook->func = func;
+        hook->data = user_data;
+        g_hook_append (&monitors, hook);
+
+        return hook->hook_id;
+}
+
+void
+mb_panel_desktop_remove_monitor (guint id)
+{
+        g_return_if_fail (id != 0);
+
+        g_hook_destroy (&monitors, id);
+}
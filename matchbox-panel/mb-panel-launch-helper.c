@@ -0,0 +1,236 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+
+/*
+ * Licensed under the GPL v2 or greater.
+ *
+ * Launching through matchbox-panel-launch-helper. The helper is started
+ * once, spawns the applications it is sent and reports back when they were
+ * spawned and when they exit, so the panel itself never forks.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "launch-helper.h"
+#include "mb-panel-launch-helper.h"
+#include "mb-panel-launch-stats.h"
+
+#define HELPER_PATH LIBEXECDIR "/matchbox-panel-launch-helper"
+
+typedef struct {
+        char *desktop_id;
+        MBPanelLaunchSpawnedFunc func;
+        gpointer user_data;
+} Request;
+
+static int helper_fd = -1;
+static guint32 next_serial = 1;
+/* Serial to Request, until the child exits */
+static GHashTable *requests = NULL;
+
+static void
+request_free (Request *request)
+{
+        g_free (request->desktop_id);
+        g_slice_free (Request, request);
+}
+
+static void
+helper_exited_cb (GPid pid, gint status, gpointer user_data)
+{
+        g_spawn_close_pid (pid);
+}
+
+/* The helper is gone: fail the launches it didn't answer for, and launch
+ * directly from now on */
+static void
+stop_helper (void)
+{
+        GHashTableIter iter;
+        Request *request;
+
+        g_warning ("The launch helper exited");
+
+        close (helper_fd);
+        helper_fd = -1;
+
+        g_hash_table_iter_init (&iter, requests);
+        while (g_hash_table_iter_next (&iter, NULL, (gpointer *) &request))
+                if (request->func)
+                        request->func (-1, request->user_data);
+
+        g_hash_table_destroy (requests);
+        requests = NULL;
+}
+
+static gboolean
+helper_io_cb (GIOChannel   *channel,
+              GIOCondition  condition,
+              gpointer      user_data)
+{
+        LaunchHelperReply reply;
+        Request *request;
+        gpointer serial;
+        ssize_t len;
+
+        for (;;) {
+                len = recv (helper_fd, &reply, sizeof (reply), MSG_DONTWAIT);
+                if (len == -1 && errno == EINTR)
+                        continue;
+                if (len == -1 && errno == EAGAIN)
+                        return TRUE;
+                if (len <= 0) {
+                        stop_helper ();
+                        return FALSE;
+                }
+                if (len != sizeof (reply))
+                        continue;
+
+                serial = GUINT_TO_POINTER (reply.serial);
+                request = g_hash_table_lookup (requests, serial);
+                if (request == NULL)
+                        continue;
+
+                switch (reply.type) {
+                case LAUNCH_HELPER_SPAWNED:
+                        if (reply.pid < 0)
+                                g_warning ("Failed to execute %s: %s",
+                                           request->desktop_id,
+                                           g_strerror (-reply.pid));
+
+                        request->func (MAX (reply.pid, -1),
+                                       request->user_data);
+                        request->func = NULL;
+
+                        if (reply.pid < 0)
+                                g_hash_table_remove (requests, serial);
+                        break;
+                case LAUNCH_HELPER_EXITED:
+                        mb_panel_launch_stats_exited (request->desktop_id,
+                                                      reply.status);
+                        g_hash_table_remove (requests, serial);
+                        break;
+                }
+        }
+}
+
+/* Start the helper, if it isn't running already */
+gboolean
+mb_panel_launch_helper_start (void)
+{
+        posix_spawn_file_actions_t actions;
+        GIOChannel *channel;
+        char *argv[] = { HELPER_PATH, NULL };
+        char **envp;
+        int sv[2], fd, err;
+        pid_t pid;
+
+        if (helper_fd != -1)
+                return TRUE;
+
+        if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+                g_warning ("Cannot create launch helper socket: %s",
+                           g_strerror (errno));
+                return FALSE;
+        }
+
+        /* dup2() onto itself would leave it close-on-exec */
+        if (sv[1] == LAUNCH_HELPER_FD) {
+                fd = fcntl (sv[1], F_DUPFD_CLOEXEC, LAUNCH_HELPER_FD + 1);
+                close (sv[1]);
+                sv[1] = fd;
+        }
+
+        envp = g_get_environ ();
+
+        posix_spawn_file_actions_init (&actions);
+        posix_spawn_file_actions_adddup2 (&actions, sv[1], LAUNCH_HELPER_FD);
+        err = posix_spawn (&pid, HELPER_PATH, &actions, NULL, argv, envp);
+        posix_spawn_file_actions_destroy (&actions);
+
+        g_strfreev (envp);
+        close (sv[1]);
+
+        if (err != 0) {
+                g_warning ("Cannot start %s: %s", HELPER_PATH, g_strerror (err));
+                close (sv[0]);
+                return FALSE;
+        }
+
+        /* It exits when its end of the socket is closed */
+        g_child_watch_add (pid, helper_exited_cb, NULL);
+
+        helper_fd = sv[0];
+        requests = g_hash_table_new_full (NULL, NULL, NULL,
+                                          (GDestroyNotify) request_free);
+
+        channel = g_io_channel_unix_new (helper_fd);
+        g_io_add_watch (channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
+                        helper_io_cb, NULL);
+        g_io_channel_unref (channel);
+
+        return TRUE;
+}
+
+static void
+append_string (GString *message, const char *str)
+{
+        g_string_append_len (message, str, strlen (str) + 1);
+}
+
+/* Queue a launch in the helper. @func is called once it has been spawned.
+ * Returns FALSE if the helper isn't running or can't take the request, in
+ * which case the caller should launch directly. */
+gboolean
+mb_panel_launch_helper_launch (const char              *desktop_id,
+                               char                   **argv,
+                               char                   **envp,
+                               const char              *startup_id,
+                               MBPanelLaunchSpawnedFunc func,
+                               gpointer                 user_data)
+{
+        LaunchHelperRequest header;
+        GString *message;
+        Request *request;
+        ssize_t len;
+        int i;
+
+        if (helper_fd == -1)
+                return FALSE;
+
+        header.serial = next_serial++;
+        header.argc = g_strv_length (argv);
+        header.envc = g_strv_length (envp);
+
+        message = g_string_new_len ((const char *) &header, sizeof (header));
+        append_string (message, startup_id ? startup_id : "");
+        for (i = 0; argv[i]; i++)
+                append_string (message, argv[i]);
+        for (i = 0; envp[i]; i++)
+                append_string (message, envp[i]);
+
+        len = -1;
+        if (message->len <= LAUNCH_HELPER_MAX_MESSAGE)
+                len = send (helper_fd, message->str, message->len,
+                            MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (len != (ssize_t) message->len) {
+                g_string_free (message, TRUE);
+                return FALSE;
+        }
+
+        g_string_free (message, TRUE);
+
+        request = g_slice_new (Request);
+        request->desktop_id = g_strdup (desktop_id);
+        request->func = func;
+        request->user_data = user_data;
+        g_hash_table_insert (requests,
+                             GUINT_TO_POINTER (header.serial), request);
+
+        return TRUE;
+}
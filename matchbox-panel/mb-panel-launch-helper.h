@@ -0,0 +1,30 @@
+/*
+ * Licensed under the GPL v2 or greater.
+ */
+
+#ifndef __MB_PANEL_LAUNCH_HELPER_H__
+#define __MB_PANEL_LAUNCH_HELPER_H__
+
+#include <sys/types.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* Called with the child, or -1 if it couldn't be spawned */
+typedef void (* MBPanelLaunchSpawnedFunc) (pid_t    pid,
+                                           gpointer user_data);
+
+gboolean
+mb_panel_launch_helper_start  (void);
+
+gboolean
+mb_panel_launch_helper_launch (const char              *desktop_id,
+                               char                   **argv,
+                               char                   **envp,
+                               const char              *startup_id,
+                               MBPanelLaunchSpawnedFunc func,
+                               gpointer                 user_data);
+
+G_END_DECLS
+
+#endif /* __MB_PANEL_LAUNCH_HELPER_H__ */
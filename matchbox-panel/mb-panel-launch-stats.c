@@ -0,0 +1,261 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+
+/*
+ * Licensed under the GPL v2 or greater.
+ *
+ * Launch latency statistics. Every launch records when the button was
+ * released, when the application was spawned and, with startup
+ * notification, when the launch was initiated and completed. The latencies
+ * are kept in histograms per desktop file and printed on SIGUSR1.
+ */
+
+#include <config.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <glib-unix.h>
+#include "mb-panel.h"
+#include "mb-panel-launch-stats.h"
+
+/* Launches which haven't completed by then are forgotten, in seconds */
+#define PENDING_TIMEOUT 60
+
+/* Upper bounds of the histogram buckets, in milliseconds. The last bucket
+ * is for everything slower. */
+static const guint bucket_bounds[] = {
+        10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000
+};
+#define N_BUCKETS (G_N_ELEMENTS (bucket_bounds) + 1)
+
+typedef struct {
+        guint count;
+        gint64 total;
+        gint64 max;
+        guint buckets[N_BUCKETS];
+} Histogram;
+
+typedef struct {
+        guint launches;
+        guint lost;
+        guint exited;
+        guint failed;
+        Histogram spawn;     /* Release to spawn */
+        Histogram initiated; /* Release to startup initiated */
+        Histogram ready;     /* Release to startup completed */
+} LaunchStats;
+
+struct _MBPanelLaunchStats {
+        LaunchStats *stats;
+        gint64 released;
+        gint64 spawned;
+};
+
+/* Desktop ID to LaunchStats */
+static GHashTable *all_stats = NULL;
+#ifdef USE_LIBSN
+/* Startup ID to MBPanelLaunchStats, for launches waiting to complete */
+static GHashTable *pending = NULL;
+#endif
+
+static void
+histogram_add (Histogram *histogram, gint64 usec)
+{
+        guint i;
+
+        histogram->count++;
+        histogram->total += usec;
+        histogram->max = MAX (histogram->max, usec);
+
+        for (i = 0; i < G_N_ELEMENTS (bucket_bounds); i++)
+                if (usec < bucket_bounds[i] * (gint64) 1000)
+                        break;
+
+        histogram->buckets[i]++;
+}
+
+static void
+histogram_print (const char *label, Histogram *histogram)
+{
+        guint i;
+
+        if (histogram->count == 0)
+                return;
+
+        g_printerr ("  %-9s %4u  mean %7.1f ms  max %7.1f ms ",
+                    label, histogram->count,
+                    histogram->total / 1000.0 / histogram->count,
+                    histogram->max / 1000.0);
+
+        for (i = 0; i < N_BUCKETS; i++) {
+                if (histogram->buckets[i] == 0)
+                        continue;
+
+                if (i < G_N_ELEMENTS (bucket_bounds))
+                        g_printerr (" <%ums:%u", bucket_bounds[i],
+                                    histogram->buckets[i]);
+                else
+                        g_printerr (" >=%ums:%u", bucket_bounds[i - 1],
+                                    histogram->buckets[i]);
+        }
+
+        g_printerr ("\n");
+}
+
+/* Dump the per-desktop file statistics on SIGUSR1 */
+static gboolean
+print_stats (gpointer data)
+{
+        GHashTableIter iter;
+        const char *desktop_id;
+        LaunchStats *stats;
+
+        g_hash_table_iter_init (&iter, all_stats);
+        while (g_hash_table_iter_next (&iter,
+                                       (gpointer *) &desktop_id,
+                                       (gpointer *) &stats)) {
+                g_printerr ("%s.desktop: %u launches, %u never completed, "
+                            "%u exited, %u failed\n",
+                            desktop_id, stats->launches, stats->lost,
+                            stats->exited, stats->failed);
+                histogram_print ("spawn", &stats->spawn);
+                histogram_print ("initiated", &stats->initiated);
+                histogram_print ("ready", &stats->ready);
+        }
+
+        return TRUE;
+}
+
+static LaunchStats *
+get_stats (const char *desktop_id)
+{
+        LaunchStats *stats;
+
+        if (all_stats == NULL) {
+                all_stats = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                   g_free, g_free);
+                g_unix_signal_add (SIGUSR1, print_stats, NULL);
+        }
+
+        stats = g_hash_table_lookup (all_stats, desktop_id);
+        if (stats == NULL) {
+                stats = g_new0 (LaunchStats, 1);
+                g_hash_table_insert (all_stats, g_strdup (desktop_id), stats);
+        }
+
+        return stats;
+}
+
+/* Start timing a launch of @desktop_id, when the button is released */
+MBPanelLaunchStats *
+mb_panel_launch_stats_begin (const char *desktop_id)
+{
+        MBPanelLaunchStats *launch;
+        LaunchStats *stats;
+
+        stats = get_stats (desktop_id);
+        stats->launches++;
+
+        launch = g_slice_new0 (MBPanelLaunchStats);
+        launch->stats = stats;
+        launch->released = g_get_monotonic_time ();
+
+        return launch;
+}
+
+void
+mb_panel_launch_stats_spawned (MBPanelLaunchStats *launch)
+{
+        launch->spawned = g_get_monotonic_time ();
+
+        histogram_add (&launch->stats->spawn,
+                       launch->spawned - launch->released);
+}
+
+/* Stop timing a launch without startup notification */
+void
+mb_panel_launch_stats_finish (MBPanelLaunchStats *launch)
+{
+        g_slice_free (MBPanelLaunchStats, launch);
+}
+
+/* A launched application exited with the wait() @status */
+void
+mb_panel_launch_stats_exited (const char *desktop_id, int status)
+{
+        LaunchStats *stats;
+
+        stats = get_stats (desktop_id);
+        stats->exited++;
+
+        if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+                stats->failed++;
+}
+
+#ifdef USE_LIBSN
+static gboolean
+prune_pending (gpointer key, gpointer value, gpointer user_data)
+{
+        MBPanelLaunchStats *launch = value;
+
+        if (launch->released + PENDING_TIMEOUT * G_USEC_PER_SEC >
+            *(gint64 *) user_data)
+                return FALSE;
+
+        launch->stats->lost++;
+
+        return TRUE;
+}
+
+static void
+monitor_event_func (const MBPanelStartupEvent *event, gpointer user_data)
+{
+        MBPanelLaunchStats *launch;
+
+        launch = g_hash_table_lookup (pending, event->id);
+        if (launch == NULL)
+                return;
+
+        switch (event->type) {
+        case MB_PANEL_STARTUP_INITIATED:
+                histogram_add (&launch->stats->initiated,
+                               event->time - launch->released);
+                break;
+        case MB_PANEL_STARTUP_COMPLETED:
+                histogram_add (&launch->stats->ready,
+                               event->time - launch->released);
+                g_hash_table_remove (pending, event->id);
+                break;
+        case MB_PANEL_STARTUP_CANCELED:
+                launch->stats->lost++;
+                g_hash_table_remove (pending, event->id);
+                break;
+        default:
+                break;
+        }
+}
+#endif
+
+/* Keep timing a launch until its startup sequence @startup_id completes */
+void
+mb_panel_launch_stats_watch (MBPanelLaunchStats *launch,
+                             GdkScreen          *screen,
+                             const char         *startup_id)
+{
+#ifdef USE_LIBSN
+        gint64 now;
+
+        if (pending == NULL) {
+                pending = g_hash_table_new_full
+                        (g_str_hash, g_str_equal,
+                         g_free, (GDestroyNotify) mb_panel_launch_stats_finish);
+                mb_panel_startup_add_monitor (screen, monitor_event_func, NULL);
+        }
+
+        /* Forget about applications which never said they are ready */
+        now = g_get_monotonic_time ();
+        g_hash_table_foreach_remove (pending, prune_pending, &now);
+
+        g_hash_table_replace (pending, g_strdup (startup_id), launch);
+#else
+        mb_panel_launch_stats_finish (launch);
+#endif
+}
@@ -0,0 +1,34 @@
+/*
+ * Licensed under the GPL v2 or greater.
+ */
+
+#ifndef __MB_PANEL_LAUNCH_STATS_H__
+#define __MB_PANEL_LAUNCH_STATS_H__
+
+#include <gtk/gtk.h>
+
+G_BEGIN_DECLS
+
+typedef struct _MBPanelLaunchStats MBPanelLaunchStats;
+
+MBPanelLaunchStats *
+mb_panel_launch_stats_begin   (const char         *desktop_id);
+
+void
+mb_panel_launch_stats_spawned (MBPanelLaunchStats *launch);
+
+void
+mb_panel_launch_stats_watch   (MBPanelLaunchStats *launch,
+                               GdkScreen          *screen,
+                               const char         *startup_id);
+
+void
+mb_panel_launch_stats_finish  (MBPanelLaunchStats *launch);
+
+void
+mb_panel_launch_stats_exited  (const char         *desktop_id,
+                               int                 status);
+
+G_END_DECLS
+
+#endif /* __MB_PANEL_LAUNCH_STATS_H__ */
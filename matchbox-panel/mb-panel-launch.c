@@ -0,0 +1,257 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+
+/*
+ * Licensed under the GPL v2 or greater.
+ *
+ * Launching desktop entries, shared by the launcher applets so that there
+ * is only one launch helper and one set of launch statistics per panel.
+ *
+ * The command line parsing comes from the launcher applet,
+ * (C) 2006 OpenedHand Ltd., by Jorn Baayen <jorn@openedhand.com>.
+ */
+
+#include <config.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <gtk/gtk.h>
+#include <gdk/gdkx.h>
+#include "mb-panel.h"
+#include "mb-panel-launch-helper.h"
+#include "mb-panel-launch-stats.h"
+
+#ifdef USE_LIBSN
+  #define SN_API_NOT_YET_FROZEN 1
+  #include <libsn/sn.h>
+#endif
+
+/* Convert command line to argv array, stripping % conversions on the way */
+#define MAX_ARGS 255
+
+char **
+mb_panel_launch_exec_to_argv (const char *exec)
+{
+	const char *p;
+        char *buf, *bufp, **argv;
+        int nargs;
+        gboolean escape, single_quote, double_quote;
+
+        argv = g_new (char *, MAX_ARGS + 1);
+        buf = g_alloca (strlen (exec) + 1);
+        bufp = buf;
+        nargs = 0;
+        escape = single_quote = double_quote = FALSE;
+
+	for (p = exec; *p; p++) {
+                if (escape) {
+                        *bufp++ = *p;
+
+                        escape = FALSE;
+                } else {
+                        switch (*p) {
+                        case '\\':
+                                escape = TRUE;
+                                
+                                break;
+                        case '%':
+                                /* Strip '%' conversions */
+                                if (p[1] && p[1] == '%')
+                                        *bufp++ = *p;
+
+                                p++;
+
+                                break;
+                        case '\'':
+                                if (double_quote)
+                                        *bufp++ = *p;
+                                else
+                                        single_quote = !single_quote;
+
+                                break;
+                        case '\"':
+                                if (single_quote)
+                                        *bufp++ = *p;
+                                else
+                                        double_quote = !double_quote;
+
+                                break;
+                        case ' ':
+                                if (single_quote || double_quote)
+                                        *bufp++ = *p;
+                                else {
+                                        *bufp = 0;
+
+                                        if (nargs < MAX_ARGS)
+                                                argv[nargs++] = g_strdup (buf);
+
+                                        bufp = buf;
+                                }
+
+                                break;
+                        default:
+                                *bufp++ = *p;
+                                break;
+                        }
+                }
+	}
+
+        if (bufp != buf) {
+                *bufp = 0;
+
+                if (nargs < MAX_ARGS)
+	                argv[nargs++] = g_strdup (buf);
+        }
+
+        argv[nargs] = NULL;
+
+        return argv;
+}
+
+/* Reap launched applications */
+static void
+child_watch_cb (GPid pid, gint status, gpointer user_data)
+{
+        const char *desktop_id = user_data;
+
+        mb_panel_launch_stats_exited (desktop_id, status);
+
+        g_spawn_close_pid (pid);
+}
+
+/* Spawn @argv without copying the panel's address space the way fork()
+ * does, reaping it when it exits */
+static pid_t
+spawn (const char *desktop_id, char **argv, char **envp)
+{
+        posix_spawnattr_t attr;
+        sigset_t mask;
+        pid_t pid;
+        int err;
+
+        posix_spawnattr_init (&attr);
+
+        /* Don't pass the panel's blocked or ignored signals on */
+        sigemptyset (&mask);
+        posix_spawnattr_setsigmask (&attr, &mask);
+        sigaddset (&mask, SIGPIPE);
+        posix_spawnattr_setsigdefault (&attr, &mask);
+        posix_spawnattr_setflags (&attr,
+                                  POSIX_SPAWN_SETSIGMASK |
+                                  POSIX_SPAWN_SETSIGDEF);
+
+        err = posix_spawnp (&pid, argv[0], NULL, &attr, argv, envp);
+
+        posix_spawnattr_destroy (&attr);
+
+        if (err != 0) {
+                g_warning ("Failed to execute %s: %s",
+                           argv[0], g_strerror (err));
+                return -1;
+        }
+
+        g_child_watch_add_full (G_PRIORITY_DEFAULT,
+                                pid,
+                                child_watch_cb,
+                                g_strdup (desktop_id),
+                                g_free);
+
+        return pid;
+}
+
+/* A launch between the button release and the application being spawned */
+typedef struct {
+        MBPanelLaunchStats *stats;
+        GdkScreen *screen;
+#ifdef USE_LIBSN
+        SnLauncherContext *context;
+#endif
+} Launch;
+
+static void
+launch_spawned (pid_t pid, gpointer user_data)
+{
+        Launch *launch = user_data;
+
+        if (pid > 0)
+                mb_panel_launch_stats_spawned (launch->stats);
+
+#ifdef USE_LIBSN
+        if (launch->context) {
+                if (pid > 0) {
+                        mb_panel_launch_stats_watch
+                                (launch->stats,
+                                 launch->screen,
+                                 sn_launcher_context_get_startup_id
+                                        (launch->context));
+                } else {
+                        /* Nothing is going to complete the launch */
+                        sn_launcher_context_complete (launch->context);
+                        mb_panel_launch_stats_finish (launch->stats);
+                }
+
+                sn_launcher_context_unref (launch->context);
+        } else
+#endif
+                mb_panel_launch_stats_finish (launch->stats);
+
+        g_object_unref (launch->screen);
+        g_slice_free (Launch, launch);
+}
+
+/* Launch @argv for the desktop entry @desktop_id, activated from @widget.
+ * @argv is not taken over. */
+void
+mb_panel_launch (GtkWidget  *widget,
+                 const char *desktop_id,
+                 const char *name,
+                 char      **argv,
+                 gboolean    use_sn)
+{
+        Launch *launch;
+        const char *startup_id = NULL;
+        char **envp;
+
+        launch = g_slice_new0 (Launch);
+        launch->stats = mb_panel_launch_stats_begin (desktop_id);
+        launch->screen = g_object_ref (gtk_widget_get_screen (widget));
+
+#ifdef USE_LIBSN
+        if (use_sn) {
+                SnDisplay *sn_dpy;
+                SnLauncherContext *context;
+
+                sn_dpy = mb_panel_startup_get_display
+                              (gtk_widget_get_display (widget));
+
+                context = sn_launcher_context_new
+                              (sn_dpy, gdk_screen_get_number (launch->screen));
+          
+                sn_launcher_context_set_name (context, name);
+                sn_launcher_context_set_binary_name (context, argv[0]);
+          
+                sn_launcher_context_initiate (context,
+                                              "matchbox-panel",
+                                              argv[0],
+                                              CurrentTime);
+
+                launch->context = context;
+                startup_id = sn_launcher_context_get_startup_id (context);
+        }
+#endif
+
+        envp = g_get_environ ();
+
+        /* Prefer the helper, which spawns outside the panel */
+        if (!mb_panel_launch_helper_launch (desktop_id, argv, envp,
+                                     startup_id, launch_spawned, launch)) {
+                /* What sn_launcher_context_setup_child_process() would do
+                 * in a forked child */
+                if (startup_id)
+                        envp = g_environ_setenv (envp, "DESKTOP_STARTUP_ID",
+                                                 startup_id, TRUE);
+
+                launch_spawned (spawn (desktop_id, argv, envp), launch);
+        }
+
+        g_strfreev (envp);
+}
@@ -0,0 +1,144 @@
+/* -*- Mode: C; tab-width: 8; indent-tabs-mode: nil; c-basic-offset: 8 -*- */
+
+/*
+ * Licensed under the GPL v2 or greater.
+ *
+ * Startup notification shared by the applets: one SnDisplay, one monitor
+ * context and one root window filter for the whole panel, whatever the
+ * number of applets interested in launches.
+ *
+ * The monitoring comes from the startup applet, Copyright 2004 - 2013,
+ * Intel Corp.
+ */
+
+#if HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gtk/gtk.h>
+#include <gdk/gdkx.h>
+
+#define SN_API_NOT_YET_FROZEN 1
+#include <libsn/sn.h>
+
+#include "mb-panel.h"
+
+static SnDisplay *sn_display = NULL;
+static SnMonitorContext *sn_context = NULL;
+static GHookList monitors;
+
+/* Get the panel's SnDisplay, for launching with startup notification. The
+ * panel only ever uses one display. */
+SnDisplay *
+mb_panel_startup_get_display (GdkDisplay *display)
+{
+        if (sn_display == NULL)
+                sn_display = sn_display_new (GDK_DISPLAY_XDISPLAY (display),
+                                             NULL, NULL);
+
+        return sn_display;
+}
+
+static GdkFilterReturn
+filter_func (GdkXEvent *gdk_xevent,
+             GdkEvent  *event,
+             gpointer   user_data)
+{
+        sn_display_process_event (sn_display, (XEvent *) gdk_xevent);
+
+        return GDK_FILTER_CONTINUE;
+}
+
+static void
+dispatch (GHook *hook, gpointer data)
+{
+        ((MBPanelStartupFunc) hook->func) (data, hook->data);
+}
+
+static void
+monitor_event_func (SnMonitorEvent *sn_event, gpointer user_data)
+{
+        SnStartupSequence *sequence;
+        MBPanelStartupEvent event;
+
+        switch (sn_monitor_event_get_type (sn_event)) {
+        case SN_MONITOR_EVENT_INITIATED:
+                event.type = MB_PANEL_STARTUP_INITIATED;
+                break;
+        case SN_MONITOR_EVENT_CHANGED:
+                event.type = MB_PANEL_STARTUP_CHANGED;
+                break;
+        case SN_MONITOR_EVENT_COMPLETED:
+                event.type = MB_PANEL_STARTUP_COMPLETED;
+                break;
+        case SN_MONITOR_EVENT_CANCELED:
+                event.type = MB_PANEL_STARTUP_CANCELED;
+                break;
+        default:
+                return;
+        }
+
+        sequence = sn_monitor_event_get_startup_sequence (sn_event);
+
+        event.id = sn_startup_sequence_get_id (sequence);
+        event.name = sn_startup_sequence_get_name (sequence);
+        event.binary_name = sn_startup_sequence_get_binary_name (sequence);
+        event.icon_name = sn_startup_sequence_get_icon_name (sequence);
+        event.wmclass = sn_startup_sequence_get_wmclass (sequence);
+        event.time = g_get_monotonic_time ();
+
+        /* Monitors may be removed from their callback */
+        g_hook_list_marshal (&monitors, FALSE, dispatch, &event);
+}
+
+/* Call @func for every startup sequence event on the screen, until
+ * mb_panel_startup_remove_monitor() is called with the returned ID. */
+guint
+mb_panel_startup_add_monitor (GdkScreen         *screen,
+                              MBPanelStartupFunc func,
+                              gpointer           user_data)
+{
+        GdkDisplay *display;
+        GdkWindow *root_window;
+        GHook *hook;
+
+        g_return_val_if_fail (GDK_IS_SCREEN (screen), 0);
+        g_return_val_if_fail (func != NULL, 0);
+
+        if (!monitors.is_setup)
+                g_hook_list_init (&monitors, sizeof (GHook));
+
+        /* The monitor is kept once it exists, applets are only unloaded when
+         * the panel exits */
+        if (sn_context == NULL) {
+                display = gdk_screen_get_display (screen);
+
+                sn_context = sn_monitor_context_new
+                        (mb_panel_startup_get_display (display),
+                         gdk_screen_get_number (screen),
+                         monitor_event_func, NULL, NULL);
+
+                /* Startup messages go to every root window, so listening
+                 * on one of them is enough */
+                root_window = gdk_screen_get_root_window (screen);
+                gdk_window_set_events (root_window,
+                                       gdk_window_get_events (root_window) |
+                                       GDK_PROPERTY_CHANGE_MASK);
+                gdk_window_add_filter (root_window, filter_func, NULL);
+        }
+
+        hook = g_hook_alloc (&monitors);
+        hook->func = func;
+        hook->data = user_data;
+        g_hook_append (&monitors, hook);
+
+        return hook->hook_id;
+}
+
+void
+mb_panel_startup_remove_monitor (guint id)
+{
+        g_return_if_fail (id != 0);
+
+        g_hook_destroy (&monitors, id);
+}
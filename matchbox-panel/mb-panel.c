@@ -19,6 +19,8 @@
 
 #include <X11/Xatom.h>
 
+#include "mb-panel-launch-helper.h"
+
 #define DEFAULT_HEIGHT 32 /* Default panel height */
 #define PADDING        4  /* Applet padding */
 
@@ -254,131 +256,33 @@ get_atoms (Display *xdisplay)
         XInternAtoms (xdisplay, (char**)names, G_N_ELEMENTS (names), False, atoms);
 }
 
-int
-main (int argc, char **argv)
+typedef enum {
+        MODE_DOCK,
+        MODE_TITLEBAR,
+        MODE_WINDOW
+} PanelMode;
+
+/* Create a panel window on @monitor_num of @screen */
+static GtkWidget *
+create_panel (GdkScreen      *screen,
+              int             monitor_num,
+              GtkPositionType edge,
+              PanelMode       mode,
+              int             size,
+              const char     *start_applets,
+              const char     *end_applets)
 {
-        GOptionContext *option_context;
-        GOptionGroup *option_group;
-        GError *error;
-        char *start_applets = NULL, *end_applets = NULL;
-        char *edge_string = NULL, *mode_string = NULL;
-        enum { MODE_DOCK, MODE_TITLEBAR, MODE_WINDOW } mode = MODE_DOCK;
-        int size = DEFAULT_HEIGHT;
-        int screen_num = -1;
-        int monitor_num = -1;
-        GtkPositionType edge = GTK_POS_TOP;
         GtkWidget *window, *box, *frame;
-        GdkDisplay *display;
-        GdkScreen *screen;
         GtkOrientation orientation = GTK_ORIENTATION_HORIZONTAL;
         GdkRectangle screen_geom;
 
-        /* TODO: add these as groups (applets / position) */
-        GOptionEntry option_entries[] = {
-                { "start-applets", 0, 0, G_OPTION_ARG_STRING, &start_applets,
-                  N_("Applets to pack at the start"), N_("APPLET[:APPLET_ID] ...") },
-                { "end-applets", 0, 0, G_OPTION_ARG_STRING, &end_applets,
-                  N_("Applets to pack at the end"), N_("APPLET[:APPLET_ID] ...") },
-
-                { "screen", 'n', 0, G_OPTION_ARG_INT, &screen_num,
-                  N_("Screen number"), N_("SCREEN") },
-                { "monitor", 'm', 0, G_OPTION_ARG_INT, &monitor_num,
-                  N_("Monitor number"), N_("MONITOR") },
-
-                { "edge", 'e', 0, G_OPTION_ARG_STRING, &edge_string,
-                  N_("Panel edge"), N_("TOP|BOTTON|LEFT|RIGHT") },
-                { "size", 's', 0, G_OPTION_ARG_INT, &size,
-                  N_("Panel size"), N_("PIXELS")},
-                { "mode", 'm', 0, G_OPTION_ARG_STRING, &mode_string,
-                  N_("Panel mode"), N_("DOCK|TITLEBAR|WINDOW") },
-                { NULL }
-        };
-
-        /* Make sure that GModule is supported */
-        if (!g_module_supported ()) {
-                g_warning (_("GModule support not found, this is required for matchbox-panel to work"));
-                return -1;
-        }
-
-        /* Set up command line handling */
-        option_context = g_option_context_new (NULL);
-
-        option_group = g_option_group_new ("matchbox-panel",
-                                           N_("Matchbox Panel"),
-                                           N_("Matchbox Panel options"),
-                                           NULL, NULL);
-        g_option_group_add_entries (option_group, option_entries);
-        g_option_context_set_main_group (option_context, option_group);
-
-        g_option_context_add_group (option_context,
-                                    gtk_get_option_group (TRUE));
-
-        /* Parse command line */
-        error = NULL;
-        if (!g_option_context_parse (option_context, &argc, &argv, &error)) {
-                g_option_context_free (option_context);
-
-                g_warning ("%s", error->message);
-                g_error_free (error);
-
-                return 1;
-        }
-
-        g_option_context_free (option_context);
-
-        if (edge_string) {
-                if (g_ascii_strcasecmp (edge_string, "top") == 0) {
-                        edge = GTK_POS_TOP;
-                } else if (g_ascii_strcasecmp (edge_string, "bottom") == 0) {
-                        edge = GTK_POS_BOTTOM;
-                } else if (g_ascii_strcasecmp (edge_string, "left") == 0) {
-                        edge = GTK_POS_LEFT;
-                } else if (g_ascii_strcasecmp (edge_string, "right") == 0) {
-                        edge = GTK_POS_RIGHT;
-                } else {
-                        g_printerr ("Unparsable edge '%s', expecting top/bottom/left/right\n", edge_string);
-                        return 1;
-                }
-                g_free (edge_string);
-        }
-
-        if (mode_string) {
-                if (g_ascii_strcasecmp (mode_string, "dock") == 0) {
-                        mode = MODE_DOCK;
-                } else if (g_ascii_strcasecmp (mode_string, "titlebar") == 0) {
-                        mode = MODE_TITLEBAR;
-                } else if (g_ascii_strcasecmp (mode_string, "window") == 0) {
-                        mode = MODE_WINDOW;
-                } else {
-                        g_printerr ("Unparsable mode '%s', expecting dock/titlebar/window\n", mode_string);
-                        return 1;
-                }
-                g_free (mode_string);
-        }
-
-        /* Set app name */
-        g_set_application_name (_("Matchbox Panel"));
-
-        display = gdk_display_get_default ();
-
-        get_atoms (GDK_DISPLAY_XDISPLAY (display));
-
-        if (screen_num != -1) {
-                screen = gdk_display_get_screen (display, screen_num);
-        } else {
-                screen = gdk_display_get_default_screen (display);
-        }
-
-        if (monitor_num == -1) {
-                monitor_num = gdk_screen_get_primary_monitor (screen);
-        }
-
         /* Note that this is bare monitor geometry and not the work area, so
            panels will overlap. */
         gdk_screen_get_monitor_geometry (screen, monitor_num, &screen_geom);
 
         /* Create window */
         window = gtk_window_new (GTK_WINDOW_TOPLEVEL);
+        gtk_window_set_screen (GTK_WINDOW (window), screen);
         gtk_widget_set_name (window, "MatchboxPanel");
         gtk_window_set_has_resize_grip (GTK_WINDOW (window), FALSE);
 
@@ -495,13 +399,156 @@ main (int argc, char **argv)
                       gtk_box_pack_end,
                       orientation);
 
+        return window;
+}
+
+int
+main (int argc, char **argv)
+{
+        GOptionContext *option_context;
+        GOptionGroup *option_group;
+        GError *error;
+        char *start_applets = NULL, *end_applets = NULL;
+        char *edge_string = NULL, *mode_string = NULL;
+        PanelMode mode = MODE_DOCK;
+        int size = DEFAULT_HEIGHT;
+        int screen_num = -1;
+        int monitor_num = -1;
+        gboolean all_monitors = FALSE;
+        GtkPositionType edge = GTK_POS_TOP;
+        GdkDisplay *display;
+        GdkScreen *screen;
+        GList *windows = NULL;
+
+        /* TODO: add these as groups (applets / position) */
+        GOptionEntry option_entries[] = {
+                { "start-applets", 0, 0, G_OPTION_ARG_STRING, &start_applets,
+                  N_("Applets to pack at the start"), N_("APPLET[:APPLET_ID] ...") },
+                { "end-applets", 0, 0, G_OPTION_ARG_STRING, &end_applets,
+                  N_("Applets to pack at the end"), N_("APPLET[:APPLET_ID] ...") },
+
+                { "screen", 'n', 0, G_OPTION_ARG_INT, &screen_num,
+                  N_("Screen number"), N_("SCREEN") },
+                { "monitor", 'm', 0, G_OPTION_ARG_INT, &monitor_num,
+                  N_("Monitor number"), N_("MONITOR") },
+                { "all-monitors", 'a', 0, G_OPTION_ARG_NONE, &all_monitors,
+                  N_("Show a panel on every monitor"), NULL },
+
+                { "edge", 'e', 0, G_OPTION_ARG_STRING, &edge_string,
+                  N_("Panel edge"), N_("TOP|BOTTON|LEFT|RIGHT") },
+                { "size", 's', 0, G_OPTION_ARG_INT, &size,
+                  N_("Panel size"), N_("PIXELS")},
+                { "mode", 'm', 0, G_OPTION_ARG_STRING, &mode_string,
+                  N_("Panel mode"), N_("DOCK|TITLEBAR|WINDOW") },
+                { NULL }
+        };
+
+        /* Make sure that GModule is supported */
+        if (!g_module_supported ()) {
+                g_warning (_("GModule support not found, this is required for matchbox-panel to work"));
+                return -1;
+        }
+
+        /* Set up command line handling */
+        option_context = g_option_context_new (NULL);
+
+        option_group = g_option_group_new ("matchbox-panel",
+                                           N_("Matchbox Panel"),
+                                           N_("Matchbox Panel options"),
+                                           NULL, NULL);
+        g_option_group_add_entries (option_group, option_entries);
+        g_option_context_set_main_group (option_context, option_group);
+
+        g_option_context_add_group (option_context,
+                                    gtk_get_option_group (TRUE));
+
+        /* Parse command line */
+        error = NULL;
+        if (!g_option_context_parse (option_context, &argc, &argv, &error)) {
+                g_option_context_free (option_context);
+
+                g_warning ("%s", error->message);
+                g_error_free (error);
+
+                return 1;
+        }
+
+        g_option_context_free (option_context);
+
+        if (edge_string) {
+                if (g_ascii_strcasecmp (edge_string, "top") == 0) {
+                        edge = GTK_POS_TOP;
+                } else if (g_ascii_strcasecmp (edge_string, "bottom") == 0) {
+                        edge = GTK_POS_BOTTOM;
+                } else if (g_ascii_strcasecmp (edge_string, "left") == 0) {
+                        edge = GTK_POS_LEFT;
+                } else if (g_ascii_strcasecmp (edge_string, "right") == 0) {
+                        edge = GTK_POS_RIGHT;
+                } else {
+                        g_printerr ("Unparsable edge '%s', expecting top/bottom/left/right\n", edge_string);
+                        return 1;
+                }
+                g_free (edge_string);
+        }
+
+        if (mode_string) {
+                if (g_ascii_strcasecmp (mode_string, "dock") == 0) {
+                        mode = MODE_DOCK;
+                } else if (g_ascii_strcasecmp (mode_string, "titlebar") == 0) {
+                        mode = MODE_TITLEBAR;
+                } else if (g_ascii_strcasecmp (mode_string, "window") == 0) {
+                        mode = MODE_WINDOW;
+                } else {
+                        g_printerr ("Unparsable mode '%s', expecting dock/titlebar/window\n", mode_string);
+                        return 1;
+                }
+                g_free (mode_string);
+        }
+
+        /* Set app name */
+        g_set_application_name (_("Matchbox Panel"));
+
+        /* Start the launch helper while the panel is still small */
+        if (g_getenv ("MATCHBOX_PANEL_LAUNCH_HELPER"))
+                mb_panel_launch_helper_start ();
+
+        display = gdk_display_get_default ();
+
+        get_atoms (GDK_DISPLAY_XDISPLAY (display));
+
+        if (screen_num != -1) {
+                screen = gdk_display_get_screen (display, screen_num);
+        } else {
+                screen = gdk_display_get_default_screen (display);
+        }
+
+        /* Create the panels. With --all-monitors every monitor gets its own
+           panel window, all sharing this process (and so the applets' shared
+           state, such as the system tray manager). */
+        if (all_monitors) {
+                int i;
+
+                for (i = 0; i < gdk_screen_get_n_monitors (screen); i++)
+                        windows = g_list_prepend (windows,
+                                                  create_panel (screen, i, edge, mode, size,
+                                                                start_applets, end_applets));
+        } else {
+                if (monitor_num == -1) {
+                        monitor_num = gdk_screen_get_primary_monitor (screen);
+                }
+
+                windows = g_list_prepend (windows,
+                                          create_panel (screen, monitor_num, edge, mode, size,
+                                                        start_applets, end_applets));
+        }
+
         /* And go! */
-        gtk_widget_show (window);
+        g_list_foreach (windows, (GFunc) gtk_widget_show, NULL);
 
         gtk_main ();
 
         /* Cleanup */
-        gtk_widget_destroy (window);
+        g_list_free_full (windows, (GDestroyNotify) gtk_widget_destroy);
 
         while (open_modules) {
                 g_module_close (open_modules->data);
@@ -17,6 +17,77 @@ G_MODULE_IMPORT GtkWidget *
 mb_panel_applet_create (const char    *id,
                         GtkOrientation orientation);
 
+/* Desktop entries in the applications directories, shared between the
+ * applets. */
+typedef struct {
+        const char *id;
+        const char *name;
+        const char *icon;
+        const char *exec;
+        const char *categories;
+        gboolean    startup_notify;
+        gboolean    no_display;
+} MBPanelDesktopEntry;
+
+const MBPanelDesktopEntry *
+mb_panel_desktop_entry_lookup   (const char        *id);
+
+const MBPanelDesktopEntry *
+mb_panel_desktop_entry_get_all  (guint             *n_entries);
+
+typedef void (* MBPanelDesktopFunc) (gpointer user_data);
+
+guint
+mb_panel_desktop_add_monitor    (MBPanelDesktopFunc func,
+                                 gpointer           user_data);
+
+void
+mb_panel_desktop_remove_monitor (guint              id);
+
+/* Launching desktop entries, shared between the applets */
+char **
+mb_panel_launch_exec_to_argv    (const char        *exec);
+
+void
+mb_panel_launch                 (GtkWidget         *widget,
+                                 const char        *desktop_id,
+                                 const char        *name,
+                                 char             **argv,
+                                 gboolean           use_sn);
+
+/* Startup notification, shared between the applets. Only available when
+ * the panel is built with startup notification support. */
+typedef enum {
+        MB_PANEL_STARTUP_INITIATED,
+        MB_PANEL_STARTUP_CHANGED,
+        MB_PANEL_STARTUP_COMPLETED,
+        MB_PANEL_STARTUP_CANCELED
+} MBPanelStartupEventType;
+
+typedef struct {
+        MBPanelStartupEventType type;
+        const char *id;
+        const char *name;
+        const char *binary_name;
+        const char *icon_name;
+        const char *wmclass;
+        gint64 time; /* Monotonic time the event arrived */
+} MBPanelStartupEvent;
+
+typedef void (* MBPanelStartupFunc) (const MBPanelStartupEvent *event,
+                                     gpointer                   user_data);
+
+struct SnDisplay *
+mb_panel_startup_get_display    (GdkDisplay        *display);
+
+guint
+mb_panel_startup_add_monitor    (GdkScreen         *screen,
+                                 MBPanelStartupFunc func,
+                                 gpointer           user_data);
+
+void
+mb_panel_startup_remove_monitor (guint              id);
+
 G_END_DECLS
 
 #endif /* __MB_PANEL_H__ */